@@ -0,0 +1,82 @@
+#include "arena.h"
+#include <stdint.h> // For uintptr_t
+#include <stdbool.h> // For bool
+
+/**
+ * Allocate a new block with room for size bytes after alignment.
+ * @return pointer to the block, NULL in case of allocation error
+ */
+static ArenaBlock *new_block (size_t size)
+{
+  ArenaBlock *block = malloc (sizeof (ArenaBlock) + size + ARENA_ALIGNMENT);
+  if (!block) return NULL;
+  block->next = NULL;
+  block->size = size + ARENA_ALIGNMENT;
+  block->used = 0;
+  return block;
+}
+
+/**
+ * Carve size bytes out of a block.
+ * @return pointer to the memory, NULL if the block has no room for it
+ */
+static void *carve (ArenaBlock *block, size_t size)
+{
+  uintptr_t start = (uintptr_t) (block->data + block->used);
+  size_t padding = (ARENA_ALIGNMENT - start % ARENA_ALIGNMENT)
+                   % ARENA_ALIGNMENT;
+  if (padding + size > block->size - block->used) return NULL;
+  block->used += padding + size;
+  return (void *) (start + padding);
+}
+
+Arena *arena_create (size_t block_size)
+{
+  Arena *arena = malloc (sizeof (Arena));
+  if (!arena) return NULL;
+  arena->head = NULL;
+  arena->block_size = block_size;
+  arena->bytes_allocated = 0;
+  return arena;
+}
+
+void *arena_alloc (Arena *arena, size_t size)
+{
+  void *p = arena->head ? carve (arena->head, size) : NULL;
+  if (!p)
+  {
+    bool big = size > arena->block_size / 4;
+    ArenaBlock *block = new_block (big ? size : arena->block_size);
+    if (!block) return NULL;
+    if (big && arena->head)
+    {
+      // keep carving from the current block
+      block->next = arena->head->next;
+      arena->head->next = block;
+    }
+    else
+    {
+      block->next = arena->head;
+      arena->head = block;
+    }
+    p = carve (block, size);
+  }
+  arena->bytes_allocated += size;
+  return p;
+}
+
+void arena_free (Arena **arena)
+{
+  if (arena && *arena)
+  {
+    ArenaBlock *block = (*arena)->head;
+    while (block)
+    {
+      ArenaBlock *next = block->next;
+      free (block);
+      block = next;
+    }
+    free (*arena);
+    *arena = NULL;
+  }
+}
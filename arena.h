@@ -0,0 +1,46 @@
+#ifndef _ARENA_H_
+#define _ARENA_H_
+#include <stdlib.h> // For malloc()
+
+#define ARENA_ALIGNMENT 16
+
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t size; // usable bytes in data
+    size_t used;
+    unsigned char data[];
+} ArenaBlock;
+
+/**
+ * Bump allocator: memory is carved out of big blocks and is released all at
+ * once by arena_free. Pointers returned by arena_alloc stay valid until then.
+ */
+typedef struct Arena {
+    ArenaBlock *head; // the block allocations are currently carved from
+    size_t block_size;
+    size_t bytes_allocated; // total bytes handed out by arena_alloc
+} Arena;
+
+/**
+ * Create an empty arena.
+ * @param block_size size of the blocks the arena allocates from the heap
+ * @return pointer to the new arena, NULL in case of allocation error
+ */
+Arena *arena_create (size_t block_size);
+
+/**
+ * Allocate memory from the arena, aligned to ARENA_ALIGNMENT.
+ * Requests bigger than a quarter block get a block of their own.
+ * @param arena arena to allocate from
+ * @param size number of bytes to allocate
+ * @return pointer to the memory, NULL in case of allocation error
+ */
+void *arena_alloc (Arena *arena, size_t size);
+
+/**
+ * Release all the memory of the arena and the arena itself.
+ * @param arena arena to free
+ */
+void arena_free (Arena **arena);
+
+#endif //_ARENA_H_
@@ -0,0 +1,141 @@
+#include "batch.h"
+#include <pthread.h>
+
+#define MIN_BUFFER_CAPACITY 1024
+
+/**
+ * Work of one thread: a range of walks and the buffer they go to.
+ */
+typedef struct Worker {
+    const FrozenChain *frozen;
+    size_t max_length;
+    long first_state;
+    uint64_t seed;
+    BatchBuffer *buffer;
+    bool success;
+} Worker;
+
+/**
+ * Append a state to a worker buffer, doubling it when it is full.
+ * @return true on success, false in case of allocation error
+ */
+static bool push_state(BatchBuffer *buffer, size_t state)
+{
+  if (buffer->size == buffer->capacity)
+  {
+    size_t capacity = buffer->capacity ? buffer->capacity * 2
+                                       : MIN_BUFFER_CAPACITY;
+    uint32_t *tmp = realloc (buffer->states, capacity * sizeof (uint32_t));
+    if (!tmp) return false;
+    buffer->states = tmp;
+    buffer->capacity = capacity;
+  }
+  buffer->states[buffer->size++] = (uint32_t) state;
+  return true;
+}
+
+/**
+ * Thread entry point: generate the worker's walks into its buffer.
+ * @param arg the Worker
+ * @return NULL
+ */
+static void *run_worker(void *arg)
+{
+  Worker *worker = arg;
+  const FrozenChain *frozen = worker->frozen;
+  BatchBuffer *buffer = worker->buffer;
+  worker->success = true;
+  for (size_t i = 0; i < buffer->walk_count; ++i)
+  {
+    Rng rng;
+    // one stream per walk, so walks do not depend on the thread layout
+    rng_seed (&rng, worker->seed ^ (buffer->first_walk + i)
+                                     * 0xD1B54A32D192ED03ULL);
+    size_t state = worker->first_state < 0
+                   ? get_random_start_state (frozen, &rng)
+                   : (size_t) worker->first_state;
+    size_t length = 1;
+    worker->success = push_state (buffer, state);
+    while (worker->success && !frozen->is_last[state]
+           && frozen->offsets[state] < frozen->offsets[state + 1]
+           && length < worker->max_length)
+    {
+      state = get_next_random_state (frozen, state, &rng);
+      worker->success = push_state (buffer, state);
+      length++;
+    }
+    if (!worker->success) break;
+    buffer->walk_ends[i] = buffer->size;
+  }
+  return NULL;
+}
+
+bool generate_batch(const FrozenChain *frozen, size_t walk_count,
+                    size_t max_length, long first_state, uint64_t seed,
+                    size_t thread_count, Batch *batch)
+{
+  if (thread_count > walk_count) thread_count = walk_count;
+  if (thread_count == 0) thread_count = 1;
+  if (first_state < 0 && frozen->start_count == 0) walk_count = 0;
+  batch->buffers = calloc (thread_count, sizeof (BatchBuffer));
+  batch->buffer_count = thread_count;
+  Worker *workers = calloc (thread_count, sizeof (Worker));
+  pthread_t *threads = calloc (thread_count, sizeof (pthread_t));
+  bool success = batch->buffers && workers && threads;
+
+  size_t started = 0;
+  for (size_t t = 0; success && t < thread_count; ++t)
+  {
+    BatchBuffer *buffer = batch->buffers + t;
+    buffer->first_walk = walk_count * t / thread_count;
+    buffer->walk_count = walk_count * (t + 1) / thread_count
+                         - buffer->first_walk;
+    buffer->walk_ends = malloc ((buffer->walk_count + 1) * sizeof (size_t));
+    workers[t] = (Worker) {frozen, max_length, first_state, seed, buffer,
+                           false};
+    success = buffer->walk_ends
+              && !pthread_create (threads + t, NULL, run_worker,
+                                  workers + t);
+    if (success) started++;
+  }
+  for (size_t t = 0; t < started; ++t)
+  {
+    pthread_join (threads[t], NULL);
+    success = success && workers[t].success;
+  }
+
+  free (workers);
+  free (threads);
+  if (!success)
+  {
+    fprintf (stderr, ALLOCATION_ERROR_MASSAGE);
+    free_batch (batch);
+  }
+  return success;
+}
+
+const uint32_t *batch_walk(const Batch *batch, size_t walk, size_t *length)
+{
+  size_t t = 0;
+  while (walk >= batch->buffers[t].first_walk + batch->buffers[t].walk_count)
+  {
+    t++;
+  }
+  const BatchBuffer *buffer = batch->buffers + t;
+  size_t i = walk - buffer->first_walk;
+  size_t start = i ? buffer->walk_ends[i - 1] : 0;
+  *length = buffer->walk_ends[i] - start;
+  return buffer->states + start;
+}
+
+void free_batch(Batch *batch)
+{
+  for (size_t t = 0; batch->buffers && t < batch->buffer_count; ++t)
+  {
+    free (batch->buffers[t].walk_ends);
+    free (batch->buffers[t].states);
+  }
+  free (batch->buffers);
+  batch->buffers = NULL;
+  batch->buffer_count = 0;
+}
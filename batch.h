@@ -0,0 +1,62 @@
+#ifndef _BATCH_H_
+#define _BATCH_H_
+#include "markov_chain.h"
+
+/**
+ * The walks generated by one worker of generate_batch, a contiguous range
+ * of the batch's walks. Walk first_walk + i is
+ * states[walk_ends[i - 1]] .. states[walk_ends[i] - 1] (from 0 for i = 0).
+ */
+typedef struct BatchBuffer {
+    size_t first_walk;
+    size_t walk_count;
+    size_t *walk_ends;
+    uint32_t *states; // ids of the visited states
+    size_t size;
+    size_t capacity;
+} BatchBuffer;
+
+/**
+ * Walks generated by generate_batch, one buffer per worker, in walk order.
+ */
+typedef struct Batch {
+    BatchBuffer *buffers;
+    size_t buffer_count;
+} Batch;
+
+/**
+ * Generate independent random walks over a frozen chain on a pool of
+ * threads. Walk i draws from its own generator seeded from seed and i, so
+ * the result depends on the seed only and not on the number of threads.
+ * Each walk starts at first_state, or at a random start state if it is
+ * negative, and stops after a last state, a state with no next state, or
+ * max_length states.
+ * @param frozen the frozen chain, only read
+ * @param walk_count number of walks to generate
+ * @param max_length maximal number of states in a walk, positive
+ * @param first_state id of the state to start from, negative for random
+ * @param seed the seed of the batch
+ * @param thread_count number of threads to use, positive
+ * @param batch the batch to fill, freed with free_batch
+ * @return true on success, false in case of allocation or thread error
+ */
+bool generate_batch(const FrozenChain *frozen, size_t walk_count,
+                    size_t max_length, long first_state, uint64_t seed,
+                    size_t thread_count, Batch *batch);
+
+/**
+ * Get a walk of a batch.
+ * @param batch the batch
+ * @param walk index of the walk
+ * @param length set to the number of states in the walk
+ * @return pointer to the ids of the walk's states
+ */
+const uint32_t *batch_walk(const Batch *batch, size_t walk, size_t *length);
+
+/**
+ * Free the buffers of a batch.
+ * @param batch the batch to free
+ */
+void free_batch(Batch *batch);
+
+#endif //_BATCH_H_
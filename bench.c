@@ -0,0 +1,455 @@
+#define _POSIX_C_SOURCE 200809L // For clock_gettime()
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h> // For getrusage()
+#include "markov_chain.h"
+#include "markov_analysis.h"
+#include "string_pool.h"
+
+/* Benchmark of the chain operations over synthetic corpora whose words
+ * follow a Zipf law, like natural text. For each corpus size, from
+ * MIN_WORDS up to the given maximum by factors of 10, it times
+ * add_to_database, add_node_to_counter_list, get_first_random_node,
+ * get_next_random_node with linear draws, freeze_sampling,
+ * get_next_random_node with alias draws, the iterations of
+ * compute_stationary_distribution and free_markov_chain separately, counts
+ * the heap allocations each of them makes and reads the peak resident set
+ * size. The stationary distribution is compared with the share of the
+ * alias walk spent in each state, which restarts the same way.
+ * The results are printed as one JSON object.
+ *
+ * Usage: markov_bench [MAX_WORDS] [SEED]
+ *
+ * Allocations are counted by wrapping malloc, calloc and realloc at link
+ * time (-Wl,--wrap=...), see the bench target of the makefile. */
+
+#define MIN_WORDS 1000
+#define DEFAULT_MAX_WORDS 10000000
+#define DEFAULT_SEED 1
+#define WORDS_PER_TYPE 10 // corpus words per vocabulary word
+#define MIN_VOCABULARY 100
+#define LAST_WORD_PERIOD 16 // one vocabulary word in that many ends a sentence
+#define SAMPLE_COUNT (1 << 20)
+#define ARENA_BLOCK_SIZE (1 << 20)
+#define MAX_WORD_LENGTH 16
+#define STATIONARY_TOLERANCE 1e-9
+#define STATIONARY_MAX_ITERATIONS 1000
+
+/* Allocation counters, bumped by the wrappers of the allocation functions
+ * every object of the benchmark calls. */
+
+static size_t allocation_count = 0;
+
+void *__real_malloc (size_t size);
+void *__real_calloc (size_t count, size_t size);
+void *__real_realloc (void *pointer, size_t size);
+
+void *__wrap_malloc (size_t size)
+{
+  allocation_count++;
+  return __real_malloc (size);
+}
+
+void *__wrap_calloc (size_t count, size_t size)
+{
+  allocation_count++;
+  return __real_calloc (count, size);
+}
+
+void *__wrap_realloc (void *pointer, size_t size)
+{
+  allocation_count++;
+  return __real_realloc (pointer, size);
+}
+
+/**
+ * Measures of one operation: how many times it ran, for how long and with
+ * how many allocations.
+ */
+typedef struct Measure {
+    size_t operations;
+    double seconds;
+    size_t allocations;
+} Measure;
+
+static double now (void)
+{
+  struct timespec time;
+  clock_gettime (CLOCK_MONOTONIC, &time);
+  return (double) time.tv_sec + (double) time.tv_nsec * 1e-9;
+}
+
+static void start_measure (Measure *measure)
+{
+  measure->operations = 0;
+  measure->allocations = allocation_count;
+  measure->seconds = now ();
+}
+
+static void stop_measure (Measure *measure, size_t operations)
+{
+  measure->seconds = now () - measure->seconds;
+  measure->allocations = allocation_count - measure->allocations;
+  measure->operations = operations;
+}
+
+/* States are interned words, compared and hashed by their handles like
+ * the states of the tweets generator. */
+
+static void print_func_word (void *data)
+{
+  fprintf (stdout, "%s", (const char *) data);
+}
+
+static int comp_func_word (void *data_one, void *data_two)
+{
+  // relational operators are only defined on pointers into the same object
+  uintptr_t one = (uintptr_t) data_one, two = (uintptr_t) data_two;
+  return (one > two) - (one < two);
+}
+
+static size_t hash_func_word (void *data)
+{
+  return string_pool_hash ((const char *) data);
+}
+
+static void free_data_word (void *data)
+{
+  // the string belongs to the pool
+  (void) data;
+}
+
+static void *copy_func_word (void *data)
+{
+  return data;
+}
+
+static bool is_last_word (void *data)
+{
+  const char *word = (const char *) data;
+  return word[strlen (word) - 1] == '.';
+}
+
+static MarkovChain *create_chain (void)
+{
+  MarkovChain *markov_chain = calloc (1, sizeof (MarkovChain));
+  LinkedList *list = calloc (1, sizeof (LinkedList));
+  Arena *arena = arena_create (ARENA_BLOCK_SIZE);
+  if (!markov_chain || !list || !arena)
+  {
+    free (markov_chain);
+    free (list);
+    arena_free (&arena);
+    return NULL;
+  }
+  markov_chain->database = list;
+  markov_chain->arena = arena;
+  markov_chain->print_func = print_func_word;
+  markov_chain->comp_func = comp_func_word;
+  markov_chain->hash_func = hash_func_word;
+  markov_chain->free_data = free_data_word;
+  markov_chain->copy_func = copy_func_word;
+  markov_chain->is_last = is_last_word;
+  return markov_chain;
+}
+
+/**
+ * A synthetic corpus: words[i] is the vocabulary rank of its i'th word.
+ */
+typedef struct Corpus {
+    StringPool *pool;
+    const char **vocabulary; // interned word of each rank
+    size_t vocabulary_size;
+    uint32_t *words;
+    size_t word_count;
+} Corpus;
+
+static void free_corpus (Corpus *corpus)
+{
+  string_pool_free (&corpus->pool);
+  free (corpus->vocabulary);
+  free (corpus->words);
+}
+
+/**
+ * Draw a corpus whose word of rank r has probability proportional to
+ * 1 / (r + 1).
+ * @return false in case of allocation error
+ */
+static bool create_corpus (Corpus *corpus, size_t word_count, Rng *rng)
+{
+  size_t size = word_count / WORDS_PER_TYPE;
+  size = size < MIN_VOCABULARY ? MIN_VOCABULARY : size;
+  corpus->pool = string_pool_create ();
+  corpus->vocabulary = malloc (size * sizeof (const char *));
+  corpus->words = malloc (word_count * sizeof (uint32_t));
+  corpus->vocabulary_size = size;
+  corpus->word_count = word_count;
+  double *cumulative = malloc (size * sizeof (double));
+  if (!corpus->pool || !corpus->vocabulary || !corpus->words || !cumulative)
+  {
+    free (cumulative);
+    return false;
+  }
+
+  double sum = 0;
+  for (size_t r = 0; r < size; ++r)
+  {
+    char word[MAX_WORD_LENGTH];
+    int length = snprintf (word, sizeof (word), "w%zu%s", r,
+                           r % LAST_WORD_PERIOD == LAST_WORD_PERIOD - 1
+                           ? "." : "");
+    corpus->vocabulary[r] = string_pool_intern (corpus->pool, word,
+                                                (size_t) length);
+    if (!corpus->vocabulary[r])
+    {
+      free (cumulative);
+      return false;
+    }
+    sum += 1.0 / (double) (r + 1);
+    cumulative[r] = sum;
+  }
+  for (size_t i = 0; i < word_count; ++i)
+  {
+    // 53 random bits, uniform in [0, sum)
+    double u = (double) (rng_next (rng) >> 11) / 9007199254740992.0 * sum;
+    size_t low = 0, high = size - 1;
+    while (low < high)
+    {
+      size_t middle = low + (high - low) / 2;
+      if (cumulative[middle] > u) high = middle;
+      else low = middle + 1;
+    }
+    corpus->words[i] = (uint32_t) low;
+  }
+  free (cumulative);
+  return true;
+}
+
+/**
+ * The measures of one corpus.
+ */
+typedef struct Result {
+    size_t word_count;
+    size_t vocabulary_size;
+    size_t state_count;
+    Measure add_to_database;
+    Measure add_node_to_counter_list;
+    Measure get_first_random_node;
+    Measure get_next_random_node;
+    Measure freeze_sampling;
+    Measure get_next_random_node_alias;
+    Measure compute_stationary_distribution;
+    // L1 distance between the stationary distribution and the visits of
+    // the alias walk
+    double stationary_distance;
+    // false if the iteration stopped at STATIONARY_MAX_ITERATIONS
+    bool stationary_converged;
+    Measure free_markov_chain;
+    long peak_rss_kb;
+} Result;
+
+/**
+ * Measure a walk of SAMPLE_COUNT get_next_random_node draws. A walk that
+ * reaches a last state restarts at a start state, the restarts are part of
+ * the measure.
+ * @param checksum the drawn pointers are added to it, so the draws can not
+ * be optimized away
+ * @param visits if not NULL, visits[id] is incremented for each drawn state
+ * and each state the walk restarts at
+ */
+static void measure_walk (MarkovChain *markov_chain, Rng *rng,
+                          Measure *measure, uintptr_t *checksum,
+                          size_t *visits)
+{
+  MarkovNode *node = get_random_start_node (markov_chain, rng);
+  start_measure (measure);
+  for (size_t i = 0; node && i < SAMPLE_COUNT; ++i)
+  {
+    node = get_next_random_node (node, rng);
+    *checksum += (uintptr_t) node;
+    if (visits) visits[node->id]++;
+    if (node->counter_list_size == 0 || is_last_word (node->data))
+    {
+      node = get_random_start_node (markov_chain, rng);
+      if (visits && node) visits[node->id]++;
+    }
+  }
+  stop_measure (measure, node ? SAMPLE_COUNT : 0);
+}
+
+/**
+ * Train a chain on the corpus and sample it, measuring every step.
+ * @return false in case of allocation error
+ */
+static bool run_benchmark (const Corpus *corpus, Rng *rng, Result *result)
+{
+  MarkovChain *markov_chain = create_chain ();
+  MarkovNode **nodes = calloc (corpus->vocabulary_size,
+                               sizeof (MarkovNode *));
+  if (!markov_chain || !nodes)
+  {
+    free_markov_chain (&markov_chain);
+    free (nodes);
+    return false;
+  }
+  bool success = true;
+
+  start_measure (&result->add_to_database);
+  for (size_t i = 0; success && i < corpus->word_count; ++i)
+  {
+    uint32_t rank = corpus->words[i];
+    Node *node = add_to_database (markov_chain,
+                                  (void *) corpus->vocabulary[rank]);
+    success = node != NULL;
+    if (success) nodes[rank] = node->data;
+  }
+  stop_measure (&result->add_to_database, corpus->word_count);
+
+  size_t links = 0;
+  start_measure (&result->add_node_to_counter_list);
+  for (size_t i = 1; success && i < corpus->word_count; ++i)
+  {
+    MarkovNode *previous = nodes[corpus->words[i - 1]];
+    if (is_last_word (previous->data)) continue;
+    success = add_node_to_counter_list (previous, nodes[corpus->words[i]],
+                                        markov_chain);
+    links++;
+  }
+  stop_measure (&result->add_node_to_counter_list, links);
+
+  // the pointers are summed so the draws can not be optimized away
+  uintptr_t checksum = 0;
+  start_measure (&result->get_first_random_node);
+  for (size_t i = 0; success && i < SAMPLE_COUNT; ++i)
+  {
+    checksum += (uintptr_t) get_first_random_node (markov_chain, rng);
+  }
+  stop_measure (&result->get_first_random_node, SAMPLE_COUNT);
+
+  // the same walk with linear draws, then with the alias tables
+  if (success)
+  {
+    measure_walk (markov_chain, rng, &result->get_next_random_node,
+                  &checksum, NULL);
+    start_measure (&result->freeze_sampling);
+    success = freeze_sampling (markov_chain);
+    stop_measure (&result->freeze_sampling, 1);
+  }
+  size_t state_count = (size_t) markov_chain->database->size;
+  size_t *visits = calloc (state_count, sizeof (size_t));
+  double *stationary = malloc (state_count * sizeof (double));
+  success = success && visits && stationary;
+  if (success)
+  {
+    measure_walk (markov_chain, rng, &result->get_next_random_node_alias,
+                  &checksum, visits);
+    size_t iterations = 0;
+    start_measure (&result->compute_stationary_distribution);
+    StationaryStatus status = compute_stationary_distribution (
+        markov_chain, STATIONARY_TOLERANCE, STATIONARY_MAX_ITERATIONS, 1,
+        stationary, &iterations);
+    success = status != STATIONARY_ERROR;
+    result->stationary_converged = status == STATIONARY_CONVERGED;
+    stop_measure (&result->compute_stationary_distribution, iterations);
+  }
+  size_t visit_count = 0;
+  for (size_t i = 0; success && i < state_count; ++i)
+  {
+    visit_count += visits[i];
+  }
+  for (size_t i = 0; success && i < state_count; ++i)
+  {
+    double share = (double) visits[i] / (double) visit_count - stationary[i];
+    result->stationary_distance += share < 0 ? -share : share;
+  }
+  free (visits);
+  free (stationary);
+
+  result->word_count = corpus->word_count;
+  result->vocabulary_size = corpus->vocabulary_size;
+  result->state_count = (size_t) markov_chain->database->size;
+  start_measure (&result->free_markov_chain);
+  free_markov_chain (&markov_chain);
+  stop_measure (&result->free_markov_chain, 1);
+  free (nodes);
+
+  struct rusage usage;
+  getrusage (RUSAGE_SELF, &usage);
+  result->peak_rss_kb = usage.ru_maxrss;
+  return success && checksum != 0;
+}
+
+static void print_measure (const char *name, const Measure *measure,
+                           bool last)
+{
+  double ns = measure->operations
+              ? measure->seconds * 1e9 / (double) measure->operations : 0;
+  fprintf (stdout, "      \"%s\": {\"operations\": %zu, \"seconds\": %.6f, "
+                   "\"ns_per_op\": %.2f, \"allocations\": %zu}%s\n", name,
+           measure->operations, measure->seconds, ns, measure->allocations,
+           last ? "" : ",");
+}
+
+static void print_result (const Result *result, bool last)
+{
+  fprintf (stdout, "    {\n");
+  fprintf (stdout, "      \"words\": %zu,\n", result->word_count);
+  fprintf (stdout, "      \"vocabulary\": %zu,\n", result->vocabulary_size);
+  fprintf (stdout, "      \"states\": %zu,\n", result->state_count);
+  print_measure ("add_to_database", &result->add_to_database, false);
+  print_measure ("add_node_to_counter_list",
+                 &result->add_node_to_counter_list, false);
+  print_measure ("get_first_random_node", &result->get_first_random_node,
+                 false);
+  print_measure ("get_next_random_node", &result->get_next_random_node,
+                 false);
+  print_measure ("freeze_sampling", &result->freeze_sampling, false);
+  print_measure ("get_next_random_node_alias",
+                 &result->get_next_random_node_alias, false);
+  print_measure ("compute_stationary_distribution",
+                 &result->compute_stationary_distribution, false);
+  fprintf (stdout, "      \"stationary_distance\": %.6f,\n",
+           result->stationary_distance);
+  fprintf (stdout, "      \"stationary_converged\": %s,\n",
+           result->stationary_converged ? "true" : "false");
+  print_measure ("free_markov_chain", &result->free_markov_chain, false);
+  fprintf (stdout, "      \"peak_rss_kb\": %ld\n", result->peak_rss_kb);
+  fprintf (stdout, "    }%s\n", last ? "" : ",");
+}
+
+/**
+ * @param argc num of arguments
+ * @param argv 1) Largest corpus size in words, 10^7 by default
+ *             2) Seed, 1 by default
+ * @return EXIT_SUCCESS or EXIT_FAILURE
+ */
+int main (int argc, char *argv[])
+{
+  size_t max_words = argc > 1 ? strtoull (argv[1], NULL, 10)
+                              : DEFAULT_MAX_WORDS;
+  uint64_t seed = argc > 2 ? strtoull (argv[2], NULL, 10) : DEFAULT_SEED;
+  Rng rng;
+  rng_seed (&rng, seed);
+  fprintf (stdout, "{\n  \"seed\": %llu,\n  \"samples\": %d,\n"
+                   "  \"corpora\": [\n", (unsigned long long) seed,
+           SAMPLE_COUNT);
+  for (size_t words = MIN_WORDS; words <= max_words; words *= 10)
+  {
+    Corpus corpus = {0};
+    Result result = {0};
+    if (!create_corpus (&corpus, words, &rng)
+        || !run_benchmark (&corpus, &rng, &result))
+    {
+      free_corpus (&corpus);
+      fprintf (stderr, ALLOCATION_ERROR_MASSAGE);
+      return EXIT_FAILURE;
+    }
+    free_corpus (&corpus);
+    print_result (&result, words > max_words / 10);
+  }
+  fprintf (stdout, "  ]\n}\n");
+  return EXIT_SUCCESS;
+}
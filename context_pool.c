@@ -0,0 +1,119 @@
+#include "context_pool.h"
+#include <string.h> // For memcmp(), memcpy()
+
+#define POOL_BLOCK_SIZE (1 << 20)
+#define MIN_CAPACITY 1024
+
+/**
+ * Hash of a token tuple, mixing one 32 bit id at a time.
+ */
+static size_t hash_tokens (const uint32_t *tokens, size_t order)
+{
+  uint64_t hash = 0x9E3779B97F4A7C15ULL;
+  for (size_t i = 0; i < order; ++i)
+  {
+    hash = (hash ^ tokens[i]) * 0xBF58476D1CE4E5B9ULL;
+    hash ^= hash >> 31;
+  }
+  return (size_t) hash;
+}
+
+/**
+ * Put a context in the first free slot of its probe sequence.
+ * The table must have at least one free slot.
+ */
+static void place (const Context **slots, size_t capacity,
+                   const Context *context)
+{
+  size_t mask = capacity - 1;
+  size_t i = context->hash & mask;
+  while (slots[i])
+  {
+    i = (i + 1) & mask;
+  }
+  slots[i] = context;
+}
+
+/**
+ * Double the table and re-place every context using its stored hash.
+ * @return 0 on success, 1 otherwise
+ */
+static int grow (ContextPool *pool)
+{
+  size_t capacity = pool->capacity * 2;
+  const Context **slots = calloc (capacity, sizeof (const Context *));
+  if (!slots) return 1;
+  for (size_t i = 0; i < pool->capacity; ++i)
+  {
+    if (pool->slots[i])
+    {
+      place (slots, capacity, pool->slots[i]);
+    }
+  }
+  free (pool->slots);
+  pool->slots = slots;
+  pool->capacity = capacity;
+  return 0;
+}
+
+ContextPool *context_pool_create (size_t order)
+{
+  ContextPool *pool = malloc (sizeof (ContextPool));
+  if (!pool) return NULL;
+  pool->bytes = arena_create (POOL_BLOCK_SIZE);
+  pool->slots = calloc (MIN_CAPACITY, sizeof (const Context *));
+  if (!pool->bytes || !pool->slots)
+  {
+    arena_free (&pool->bytes);
+    free (pool->slots);
+    free (pool);
+    return NULL;
+  }
+  pool->capacity = MIN_CAPACITY;
+  pool->size = 0;
+  pool->order = order;
+  return pool;
+}
+
+const Context *context_pool_intern (ContextPool *pool,
+                                    const uint32_t *tokens,
+                                    const char *last)
+{
+  size_t key_size = pool->order * sizeof (uint32_t);
+  size_t hash = hash_tokens (tokens, pool->order);
+  size_t mask = pool->capacity - 1;
+  size_t i = hash & mask;
+  while (pool->slots[i])
+  {
+    const Context *context = pool->slots[i];
+    if (context->hash == hash && !memcmp (context->tokens, tokens, key_size))
+    {
+      return context;
+    }
+    i = (i + 1) & mask;
+  }
+
+  if ((pool->size + 1) * 2 > pool->capacity && grow (pool))
+  {
+    return NULL;
+  }
+  Context *context = arena_alloc (pool->bytes, sizeof (Context) + key_size);
+  if (!context) return NULL;
+  context->hash = hash;
+  context->last = last;
+  memcpy (context->tokens, tokens, key_size);
+  place (pool->slots, pool->capacity, context);
+  pool->size++;
+  return context;
+}
+
+void context_pool_free (ContextPool **pool)
+{
+  if (pool && *pool)
+  {
+    arena_free (&(*pool)->bytes);
+    free ((*pool)->slots);
+    free (*pool);
+    *pool = NULL;
+  }
+}
@@ -0,0 +1,54 @@
+#ifndef _CONTEXT_POOL_H_
+#define _CONTEXT_POOL_H_
+#include "arena.h"
+#include <stddef.h> // For size_t
+#include <stdint.h> // For uint32_t
+
+/**
+ * An interned context: the ids of the last order tokens, oldest first.
+ */
+typedef struct Context {
+    size_t hash;
+    const char *last; // the last token, the word the context stands for
+    uint32_t tokens[];
+} Context;
+
+/**
+ * Set of interned fixed width contexts. Each distinct token tuple is stored
+ * once in the pool's arena, in 4 bytes per token, so two contexts are equal
+ * iff their pointers are.
+ */
+typedef struct ContextPool {
+    Arena *bytes; // context storage
+    const Context **slots; // open addressing table, NULL marks empty slots
+    size_t capacity; // always a power of two
+    size_t size;
+    size_t order; // number of tokens in every context
+} ContextPool;
+
+/**
+ * Create an empty context pool.
+ * @param order number of tokens in a context, positive
+ * @return pointer to the new pool, NULL in case of allocation error
+ */
+ContextPool *context_pool_create (size_t order);
+
+/**
+ * Get the context of a token tuple, adding it to the pool if it is not
+ * there. Known contexts cost no allocation.
+ * @param pool pool to intern in
+ * @param tokens the order token ids of the context, oldest first
+ * @param last the string of the last token, kept in new contexts
+ * @return the context, NULL in case of allocation error
+ */
+const Context *context_pool_intern (ContextPool *pool,
+                                    const uint32_t *tokens,
+                                    const char *last);
+
+/**
+ * Free the pool and all its contexts. Contexts become invalid.
+ * @param pool pool to free
+ */
+void context_pool_free (ContextPool **pool);
+
+#endif //_CONTEXT_POOL_H_
@@ -0,0 +1,129 @@
+#include "hash_index.h"
+#include "markov_chain.h"
+
+#define MIN_CAPACITY 16
+
+/**
+ * Allocate empty slot arrays of the given capacity into the index.
+ * @return 0 on success, 1 otherwise
+ */
+static int allocate_slots (HashIndex *index, size_t capacity)
+{
+  Node **slots = calloc (capacity, sizeof (Node *));
+  if (!slots) return 1;
+  size_t *hashes = malloc (capacity * sizeof (size_t));
+  if (!hashes)
+  {
+    free (slots);
+    return 1;
+  }
+  index->slots = slots;
+  index->hashes = hashes;
+  index->capacity = capacity;
+  return 0;
+}
+
+/**
+ * Put a node in the first free slot of its probe sequence.
+ * The table must have at least one free slot.
+ */
+static void place (HashIndex *index, size_t hash, Node *node)
+{
+  size_t mask = index->capacity - 1;
+  size_t i = hash & mask;
+  while (index->slots[i])
+  {
+    i = (i + 1) & mask;
+  }
+  index->slots[i] = node;
+  index->hashes[i] = hash;
+}
+
+/**
+ * Double the table and re-place every node using its cached hash.
+ * @return 0 on success, 1 otherwise
+ */
+static int grow (HashIndex *index)
+{
+  Node **old_slots = index->slots;
+  size_t *old_hashes = index->hashes;
+  size_t old_capacity = index->capacity;
+  if (allocate_slots (index, old_capacity * 2))
+  {
+    return 1;
+  }
+  for (size_t i = 0; i < old_capacity; ++i)
+  {
+    if (old_slots[i])
+    {
+      place (index, old_hashes[i], old_slots[i]);
+    }
+  }
+  free (old_slots);
+  free (old_hashes);
+  return 0;
+}
+
+HashIndex *hash_index_create (size_t capacity)
+{
+  size_t real_capacity = MIN_CAPACITY;
+  while (real_capacity < capacity)
+  {
+    real_capacity *= 2;
+  }
+
+  HashIndex *index = malloc (sizeof (HashIndex));
+  if (!index) return NULL;
+  index->size = 0;
+  index->probes = 0;
+  index->comparisons = 0;
+  if (allocate_slots (index, real_capacity))
+  {
+    free (index);
+    return NULL;
+  }
+  return index;
+}
+
+Node *hash_index_find (HashIndex *index, size_t hash, void *data,
+                       int (*comp_func) (void *, void *))
+{
+  size_t mask = index->capacity - 1;
+  size_t i = hash & mask;
+  while (index->slots[i])
+  {
+#ifdef MARKOV_STATS
+    index->probes++;
+    index->comparisons += index->hashes[i] == hash;
+#endif
+    if (index->hashes[i] == hash
+        && !comp_func (index->slots[i]->data->data, data))
+    {
+      return index->slots[i];
+    }
+    i = (i + 1) & mask;
+  }
+  return NULL;
+}
+
+int hash_index_insert (HashIndex *index, size_t hash, Node *node)
+{
+  if ((index->size + 1) * 2 > index->capacity && grow (index))
+  {
+    return 1;
+  }
+  place (index, hash, node);
+  index->size++;
+  return 0;
+}
+
+void hash_index_free (HashIndex **index)
+{
+  if (index && *index)
+  {
+    free ((*index)->slots);
+    free ((*index)->hashes);
+    free (*index);
+    *index = NULL;
+  }
+}
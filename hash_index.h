@@ -0,0 +1,52 @@
+#ifndef _HASH_INDEX_H_
+#define _HASH_INDEX_H_
+#include "linked_list.h"
+#include <stddef.h> // For size_t
+
+typedef struct HashIndex {
+    Node **slots;   // open addressing table, NULL marks an empty slot
+    size_t *hashes; // cached hash of the node stored in the same slot
+    size_t capacity; // always a power of two
+    size_t size;
+
+    // slots looked at and compare calls of hash_index_find, counted only
+    // with MARKOV_STATS
+    size_t probes;
+    size_t comparisons;
+} HashIndex;
+
+/**
+ * Create an empty hash index.
+ * @param capacity initial number of slots, rounded up to a power of two
+ * @return pointer to the new index, NULL in case of allocation error
+ */
+HashIndex *hash_index_create (size_t capacity);
+
+/**
+ * Look for the node whose MarkovNode data equals the given data.
+ * @param index index to search in
+ * @param hash hash of data, as returned by the chain's hash_func
+ * @param data the state to look for
+ * @param comp_func compare function of the chain, 0 means equal
+ * @return the node wrapping data, NULL if it is not indexed
+ */
+Node *hash_index_find (HashIndex *index, size_t hash, void *data,
+                       int (*comp_func) (void *, void *));
+
+/**
+ * Insert a node to the index, growing the table when it gets half full.
+ * The node must not already be in the index.
+ * @param index index to insert to
+ * @param hash hash of the node's data
+ * @param node node to insert
+ * @return 0 on success, 1 otherwise
+ */
+int hash_index_insert (HashIndex *index, size_t hash, Node *node);
+
+/**
+ * Free the index table. The indexed nodes are not freed.
+ * @param index index to free
+ */
+void hash_index_free (HashIndex **index);
+
+#endif //_HASH_INDEX_H_
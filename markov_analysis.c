@@ -0,0 +1,597 @@
+#define _POSIX_C_SOURCE 200809L // For pthread_barrier_t
+#include "markov_analysis.h"
+#include <pthread.h>
+#include <string.h> // For memset()
+
+#define PIVOT_EPSILON 1e-12
+#define MASS_EPSILON 1e-12
+
+/**
+ * The transient part of a chain, with the transition probabilities of its
+ * counter lists precomputed.
+ */
+typedef struct TransientChain {
+    size_t size; // number of transient states
+    size_t *states; // id of each transient state
+    long *index; // index of each state among the transient states, or -1
+
+    // row i holds the moves of transient state i, to transient state
+    // columns[k] with probability probabilities[k] for offsets[i] <= k <
+    // offsets[i + 1]. Moves to absorbing states have column -1.
+    size_t *offsets;
+    long *columns;
+    uint32_t *targets; // id of the state of each move
+    double *probabilities;
+} TransientChain;
+
+static void free_transient_chain(TransientChain *chain)
+{
+  free (chain->states);
+  free (chain->index);
+  free (chain->offsets);
+  free (chain->columns);
+  free (chain->targets);
+  free (chain->probabilities);
+}
+
+/**
+ * Split the chain in transient and absorbing states and collect the moves
+ * of the transient states.
+ * @return false in case of allocation error
+ */
+static bool build_transient_chain(const MarkovChain *markov_chain,
+                                  TransientChain *chain)
+{
+  size_t n = (size_t) markov_chain->database->size, edges = 0;
+  memset (chain, 0, sizeof (TransientChain));
+  chain->states = malloc ((n + 1) * sizeof (size_t));
+  chain->index = malloc ((n + 1) * sizeof (long));
+  chain->offsets = malloc ((n + 1) * sizeof (size_t));
+  if (!chain->states || !chain->index || !chain->offsets) return false;
+  for (size_t i = 0; i < n; ++i)
+  {
+    MarkovNode *node = markov_chain->states[i];
+    bool absorbing = node->counter_list_size == 0
+                     || markov_chain->is_last (node->data);
+    chain->index[i] = absorbing ? -1 : (long) chain->size;
+    if (absorbing) continue;
+    chain->states[chain->size++] = i;
+    edges += node->counter_list_size;
+  }
+
+  chain->columns = malloc ((edges + 1) * sizeof (long));
+  chain->targets = malloc ((edges + 1) * sizeof (uint32_t));
+  chain->probabilities = malloc ((edges + 1) * sizeof (double));
+  if (!chain->columns || !chain->targets || !chain->probabilities)
+  {
+    return false;
+  }
+  size_t k = 0;
+  for (size_t i = 0; i < chain->size; ++i)
+  {
+    MarkovNode *node = markov_chain->states[chain->states[i]];
+    chain->offsets[i] = k;
+    for (size_t j = 0; j < node->counter_list_size; ++j, ++k)
+    {
+      chain->targets[k] = node->counter_list[j].next_id;
+      chain->columns[k] = chain->index[chain->targets[k]];
+      chain->probabilities[k] = (double) node->counter_list[j].frequency
+                                / (double) node->counter_list_sum;
+    }
+  }
+  chain->offsets[chain->size] = k;
+  return true;
+}
+
+/**
+ * Factor a dense t * t matrix in place into L U with partial pivoting, so
+ * that row pivots[i] of the matrix is row i of L U.
+ * @return false if the matrix is singular
+ */
+static bool lu_factor(double *matrix, size_t t, size_t *pivots)
+{
+  for (size_t i = 0; i < t; ++i) pivots[i] = i;
+  for (size_t k = 0; k < t; ++k)
+  {
+    size_t best = k;
+    for (size_t i = k + 1; i < t; ++i)
+    {
+      double value = matrix[i * t + k], best_value = matrix[best * t + k];
+      if ((value < 0 ? -value : value)
+          > (best_value < 0 ? -best_value : best_value))
+      {
+        best = i;
+      }
+    }
+    double pivot = matrix[best * t + k];
+    if ((pivot < 0 ? -pivot : pivot) < PIVOT_EPSILON) return false;
+    if (best != k)
+    {
+      for (size_t j = 0; j < t; ++j)
+      {
+        double tmp = matrix[k * t + j];
+        matrix[k * t + j] = matrix[best * t + j];
+        matrix[best * t + j] = tmp;
+      }
+      size_t tmp = pivots[k];
+      pivots[k] = pivots[best];
+      pivots[best] = tmp;
+    }
+    double *pivot_row = matrix + k * t;
+    for (size_t i = k + 1; i < t; ++i)
+    {
+      double *row = matrix + i * t;
+      double factor = row[k] / pivot;
+      row[k] = factor;
+      if (factor == 0) continue;
+      for (size_t j = k + 1; j < t; ++j)
+      {
+        row[j] -= factor * pivot_row[j];
+      }
+    }
+  }
+  return true;
+}
+
+/**
+ * Solve L U x = P b with a factored matrix.
+ * @param b the right hand side, in the original row order
+ * @param x set to the solution
+ */
+static void lu_solve(const double *lu, const size_t *pivots, size_t t,
+                     const double *b, double *x)
+{
+  for (size_t i = 0; i < t; ++i)
+  {
+    double sum = b[pivots[i]];
+    for (size_t j = 0; j < i; ++j) sum -= lu[i * t + j] * x[j];
+    x[i] = sum;
+  }
+  for (size_t i = t; i-- > 0;)
+  {
+    double sum = x[i];
+    for (size_t j = i + 1; j < t; ++j) sum -= lu[i * t + j] * x[j];
+    x[i] = sum / lu[i * t + i];
+  }
+}
+
+/**
+ * Solve the fundamental matrix equations: the expected moves from every
+ * state, and the expected visits and visit probabilities from the start.
+ * @return false if I - Q is singular, or in case of allocation error
+ */
+static bool solve_fundamental(const TransientChain *chain, size_t start,
+                              AbsorbingAnalysis *analysis)
+{
+  size_t t = chain->size;
+  double *matrix = calloc (t * t + 1, sizeof (double));
+  // zeroed, as gcc -O2 cannot see that lu_factor fills pivots and warns
+  // that lu_solve may read them uninitialized
+  size_t *pivots = calloc (t + 1, sizeof (size_t));
+  double *column = calloc (t + 1, sizeof (double));
+  double *solution = malloc ((t + 1) * sizeof (double));
+  bool success = matrix && pivots && column && solution;
+  for (size_t i = 0; success && i < t; ++i)
+  {
+    double *row = matrix + i * t;
+    row[i] += 1;
+    for (size_t k = chain->offsets[i]; k < chain->offsets[i + 1]; ++k)
+    {
+      if (chain->columns[k] >= 0)
+      {
+        row[chain->columns[k]] -= chain->probabilities[k];
+      }
+    }
+  }
+  success = success && lu_factor (matrix, t, pivots);
+  if (success)
+  {
+    // expected moves: (I - Q) m = 1
+    for (size_t i = 0; i < t; ++i) column[i] = 1;
+    lu_solve (matrix, pivots, t, column, solution);
+    for (size_t i = 0; i < t; ++i)
+    {
+      analysis->expected_moves[chain->states[i]] = solution[i];
+    }
+
+    // column j of the fundamental matrix N = (I - Q)^-1. A walk from start
+    // visits j with probability N[start][j] / N[j][j].
+    long from = chain->index[start];
+    for (size_t j = 0; from >= 0 && j < t; ++j)
+    {
+      memset (column, 0, t * sizeof (double));
+      column[j] = 1;
+      lu_solve (matrix, pivots, t, column, solution);
+      analysis->expected_visits[chain->states[j]] = solution[from];
+      analysis->visit_probability[chain->states[j]] = solution[from]
+                                                      / solution[j];
+    }
+
+    // an absorbing state is entered at most once, so the probability to
+    // visit it is the expected number of moves into it
+    if (from < 0) analysis->visit_probability[start] = 1;
+    for (size_t i = 0; from >= 0 && i < t; ++i)
+    {
+      for (size_t k = chain->offsets[i]; k < chain->offsets[i + 1]; ++k)
+      {
+        if (chain->columns[k] < 0)
+        {
+          analysis->visit_probability[chain->targets[k]] +=
+              analysis->expected_visits[chain->states[i]]
+              * chain->probabilities[k];
+        }
+      }
+    }
+  }
+  free (matrix);
+  free (pivots);
+  free (column);
+  free (solution);
+  return success;
+}
+
+/**
+ * Propagate the distribution of walks from start over the transient states
+ * move by move, and record the mass absorbed at every move.
+ * @return false in case of allocation error
+ */
+static bool absorption_times(const TransientChain *chain, size_t start,
+                             size_t max_steps, AbsorbingAnalysis *analysis)
+{
+  size_t t = chain->size;
+  double *times = malloc ((max_steps + 1) * sizeof (double));
+  double *current = calloc (t + 1, sizeof (double));
+  double *next = calloc (t + 1, sizeof (double));
+  if (!times || !current || !next)
+  {
+    free (times);
+    free (current);
+    free (next);
+    return false;
+  }
+
+  long from = chain->index[start];
+  double left = from >= 0;
+  if (from >= 0) current[from] = 1;
+  size_t steps = 0;
+  times[steps++] = 1 - left;
+  while (left > MASS_EPSILON && steps <= max_steps)
+  {
+    double absorbed = 0;
+    for (size_t i = 0; i < t; ++i)
+    {
+      double mass = current[i];
+      if (mass == 0) continue;
+      for (size_t k = chain->offsets[i]; k < chain->offsets[i + 1]; ++k)
+      {
+        if (chain->columns[k] < 0) absorbed += mass * chain->probabilities[k];
+        else next[chain->columns[k]] += mass * chain->probabilities[k];
+      }
+      current[i] = 0;
+    }
+    double *tmp = current;
+    current = next;
+    next = tmp;
+    times[steps++] = absorbed;
+    left -= absorbed;
+  }
+  free (current);
+  free (next);
+  analysis->absorption_time = times;
+  analysis->time_steps = steps;
+  return true;
+}
+
+bool analyze_absorbing_chain(const MarkovChain *markov_chain, size_t start,
+                             size_t max_steps, AbsorbingAnalysis *analysis)
+{
+  size_t n = (size_t) markov_chain->database->size;
+  memset (analysis, 0, sizeof (AbsorbingAnalysis));
+  analysis->state_count = n;
+  analysis->expected_moves = calloc (n + 1, sizeof (double));
+  analysis->expected_visits = calloc (n + 1, sizeof (double));
+  analysis->visit_probability = calloc (n + 1, sizeof (double));
+  TransientChain chain;
+  bool success = build_transient_chain (markov_chain, &chain)
+                 && analysis->expected_moves && analysis->expected_visits
+                 && analysis->visit_probability
+                 && solve_fundamental (&chain, start, analysis)
+                 && absorption_times (&chain, start, max_steps, analysis);
+  free_transient_chain (&chain);
+  if (!success) free_absorbing_analysis (analysis);
+  return success;
+}
+
+void free_absorbing_analysis(AbsorbingAnalysis *analysis)
+{
+  free (analysis->expected_moves);
+  free (analysis->expected_visits);
+  free (analysis->visit_probability);
+  free (analysis->absorption_time);
+  memset (analysis, 0, sizeof (AbsorbingAnalysis));
+}
+
+/**
+ * The chain's transition matrix transposed for power iteration. The moves
+ * into state j come from sources[k] with weight weights[k] for
+ * offsets[j] <= k < offsets[j + 1]. A move from i has probability
+ * weights[k] * scale[i], and scale is 0 for the states walks restart from.
+ */
+typedef struct PowerIteration {
+    size_t state_count;
+    size_t *offsets;
+    uint32_t *sources;
+    uint32_t *weights;
+    double *scale;
+    double *restart; // probability to restart at each state
+
+    // the distribution before and after an iteration, alternately, and the
+    // distribution times scale
+    double *distribution[2];
+    double *scaled[2];
+
+    double tolerance;
+    size_t max_iterations;
+    size_t thread_count;
+    pthread_barrier_t barrier;
+    struct PowerWorker *workers;
+
+    // the workers wait for all of them to be created before iterating, and
+    // stop at once if some could not be
+    pthread_mutex_t lock;
+    pthread_cond_t created;
+    int start; // 0 while creating, 1 to run, -1 to stop
+} PowerIteration;
+
+/**
+ * Work of one thread: a range of states, and the sums it contributes to
+ * the last two iterations, by iteration parity.
+ */
+typedef struct PowerWorker {
+    PowerIteration *power;
+    size_t first;
+    size_t last;
+    double change[2]; // L1 norm of the change of the range
+    double restarting[2]; // mass of the range that restarts
+    size_t iterations;
+    bool converged;
+} PowerWorker;
+
+/**
+ * Thread entry point: run the iterations on the worker's range of states.
+ * All the workers sum the partial sums in the same order after each
+ * iteration, so they agree on when to stop.
+ * @param arg the PowerWorker
+ * @return NULL
+ */
+static void *run_power_worker(void *arg)
+{
+  PowerWorker *worker = arg;
+  PowerIteration *power = worker->power;
+  pthread_mutex_lock (&power->lock);
+  while (power->start == 0) pthread_cond_wait (&power->created, &power->lock);
+  bool run = power->start > 0;
+  pthread_mutex_unlock (&power->lock);
+  size_t iteration = 0;
+  while (run && iteration < power->max_iterations && !worker->converged)
+  {
+    size_t from = iteration & 1, to = from ^ 1;
+    double restarting = 0;
+    for (size_t t = 0; t < power->thread_count; ++t)
+    {
+      restarting += power->workers[t].restarting[from];
+    }
+    const double *scaled = power->scaled[from];
+    const double *previous = power->distribution[from];
+    double *next = power->distribution[to], *next_scaled = power->scaled[to];
+    double change = 0, restarted = 0;
+    for (size_t j = worker->first; j < worker->last; ++j)
+    {
+      double sum = 0;
+      for (size_t k = power->offsets[j]; k < power->offsets[j + 1]; ++k)
+      {
+        sum += (double) power->weights[k] * scaled[power->sources[k]];
+      }
+      // lazy step: stay put with probability 1/2
+      double value = (previous[j] + sum + restarting * power->restart[j]) / 2;
+      double delta = value - previous[j];
+      change += delta < 0 ? -delta : delta;
+      next[j] = value;
+      next_scaled[j] = value * power->scale[j];
+      if (power->scale[j] == 0) restarted += value;
+    }
+    worker->change[to] = change;
+    worker->restarting[to] = restarted;
+    pthread_barrier_wait (&power->barrier);
+
+    change = 0;
+    for (size_t t = 0; t < power->thread_count; ++t)
+    {
+      change += power->workers[t].change[to];
+    }
+    worker->converged = change < power->tolerance;
+    iteration++;
+  }
+  worker->iterations = iteration;
+  return NULL;
+}
+
+/**
+ * Build the transposed matrix and the restart probabilities of a chain.
+ * @return false in case of allocation error
+ */
+static bool build_power_iteration(const MarkovChain *markov_chain,
+                                  PowerIteration *power)
+{
+  size_t n = power->state_count, edges = 0;
+  power->offsets = calloc (n + 2, sizeof (size_t));
+  power->scale = calloc (n + 1, sizeof (double));
+  power->restart = calloc (n + 1, sizeof (double));
+  if (!power->offsets || !power->scale || !power->restart) return false;
+  for (size_t i = 0; i < n; ++i)
+  {
+    MarkovNode *node = markov_chain->states[i];
+    if (node->counter_list_size == 0 || markov_chain->is_last (node->data))
+    {
+      continue;
+    }
+    power->scale[i] = 1.0 / (double) node->counter_list_sum;
+    for (size_t j = 0; j < node->counter_list_size; ++j)
+    {
+      power->offsets[node->counter_list[j].next_id + 2]++;
+    }
+    edges += node->counter_list_size;
+  }
+  for (size_t j = 2; j <= n + 1; ++j)
+  {
+    power->offsets[j] += power->offsets[j - 1];
+  }
+
+  // offsets[j + 1] is the fill position of row j while filling, and ends
+  // as the start of row j + 1
+  power->sources = malloc ((edges + 1) * sizeof (uint32_t));
+  power->weights = malloc ((edges + 1) * sizeof (uint32_t));
+  if (!power->sources || !power->weights) return false;
+  for (size_t i = 0; i < n; ++i)
+  {
+    MarkovNode *node = markov_chain->states[i];
+    for (size_t j = 0; power->scale[i] != 0 && j < node->counter_list_size;
+         ++j)
+    {
+      size_t k = power->offsets[node->counter_list[j].next_id + 1]++;
+      power->sources[k] = (uint32_t) i;
+      power->weights[k] = node->counter_list[j].frequency;
+    }
+  }
+
+  size_t starts = markov_chain->start_states_size;
+  for (size_t i = 0; i < starts; ++i)
+  {
+    power->restart[markov_chain->start_states[i]->id] = 1.0 / (double) starts;
+  }
+  for (size_t i = 0; starts == 0 && i < n; ++i)
+  {
+    power->restart[i] = 1.0 / (double) n;
+  }
+  return true;
+}
+
+static void free_power_iteration(PowerIteration *power)
+{
+  free (power->offsets);
+  free (power->sources);
+  free (power->weights);
+  free (power->scale);
+  free (power->restart);
+  for (int i = 0; i < 2; ++i)
+  {
+    free (power->distribution[i]);
+    free (power->scaled[i]);
+  }
+  free (power->workers);
+}
+
+StationaryStatus compute_stationary_distribution(
+    const MarkovChain *markov_chain, double tolerance, size_t max_iterations,
+    size_t thread_count, double *distribution, size_t *iterations)
+{
+  size_t n = (size_t) markov_chain->database->size;
+  if (thread_count > n) thread_count = n;
+  if (thread_count == 0) thread_count = 1;
+  if (iterations) *iterations = 0;
+  PowerIteration power;
+  memset (&power, 0, sizeof (PowerIteration));
+  power.state_count = n;
+  power.tolerance = tolerance;
+  power.max_iterations = max_iterations;
+  power.thread_count = thread_count;
+  for (int i = 0; i < 2; ++i)
+  {
+    power.distribution[i] = calloc (n + 1, sizeof (double));
+    power.scaled[i] = calloc (n + 1, sizeof (double));
+  }
+  power.workers = calloc (thread_count, sizeof (PowerWorker));
+  pthread_t *threads = calloc (thread_count, sizeof (pthread_t));
+  bool success = power.distribution[0] && power.distribution[1]
+                 && power.scaled[0] && power.scaled[1] && power.workers
+                 && threads && build_power_iteration (markov_chain, &power);
+  if (!success || n == 0)
+  {
+    free (threads);
+    free_power_iteration (&power);
+    if (!success)
+    {
+      fprintf (stderr, ALLOCATION_ERROR_MASSAGE);
+      return STATIONARY_ERROR;
+    }
+    return STATIONARY_CONVERGED;
+  }
+
+  // start uniform, with the first worker holding the initial restart mass
+  for (size_t i = 0; i < n; ++i)
+  {
+    power.distribution[0][i] = 1.0 / (double) n;
+    power.scaled[0][i] = power.distribution[0][i] * power.scale[i];
+    if (power.scale[i] == 0)
+    {
+      power.workers[0].restarting[0] += power.distribution[0][i];
+    }
+  }
+  size_t edges = power.offsets[n], first = 0;
+  for (size_t t = 0; t < thread_count; ++t)
+  {
+    size_t last = first;
+    while (last < n && (power.offsets[last] < edges * (t + 1) / thread_count
+                        || last - first < 1))
+    {
+      last++;
+    }
+    if (t + 1 == thread_count) last = n;
+    power.workers[t].power = &power;
+    power.workers[t].first = first;
+    power.workers[t].last = last;
+    first = last;
+  }
+
+  size_t started = 0;
+  pthread_mutex_init (&power.lock, NULL);
+  pthread_cond_init (&power.created, NULL);
+  success = !pthread_barrier_init (&power.barrier, NULL,
+                                   (unsigned) thread_count);
+  bool barrier = success;
+  for (size_t t = 0; success && t < thread_count; ++t)
+  {
+    success = !pthread_create (threads + t, NULL, run_power_worker,
+                               power.workers + t);
+    if (success) started++;
+  }
+  pthread_mutex_lock (&power.lock);
+  power.start = success ? 1 : -1;
+  pthread_cond_broadcast (&power.created);
+  pthread_mutex_unlock (&power.lock);
+  for (size_t t = 0; t < started; ++t)
+  {
+    pthread_join (threads[t], NULL);
+  }
+  if (barrier) pthread_barrier_destroy (&power.barrier);
+  pthread_cond_destroy (&power.created);
+  pthread_mutex_destroy (&power.lock);
+  if (!success)
+  {
+    fprintf (stderr, ALLOCATION_ERROR_MASSAGE);
+    free (threads);
+    free_power_iteration (&power);
+    return STATIONARY_ERROR;
+  }
+
+  // renormalize away the rounding drift of the iterations
+  const double *result = power.distribution[power.workers[0].iterations & 1];
+  double total = 0;
+  for (size_t i = 0; i < n; ++i) total += result[i];
+  for (size_t i = 0; i < n; ++i) distribution[i] = result[i] / total;
+  if (iterations) *iterations = power.workers[0].iterations;
+  bool converged = power.workers[0].converged;
+  free (threads);
+  free_power_iteration (&power);
+  return converged ? STATIONARY_CONVERGED : STATIONARY_NOT_CONVERGED;
+}
@@ -0,0 +1,89 @@
+#ifndef _MARKOV_ANALYSIS_H_
+#define _MARKOV_ANALYSIS_H_
+#include "markov_chain.h"
+
+/**
+ * Exact statistics of a chain seen as an absorbing chain: last states and
+ * states with no next state are absorbing, all the others are transient.
+ * Times are counted in chain moves, i.e. transitions.
+ */
+typedef struct AbsorbingAnalysis {
+    size_t state_count;
+
+    // expected_moves[i] is the expected number of moves from state i until
+    // an absorbing state is reached, 0 for absorbing states
+    double *expected_moves;
+
+    // expected number of visits of each state in a walk from the start
+    // state, counting the start itself. 0 for absorbing states.
+    double *expected_visits;
+
+    // probability that a walk from the start state visits each state
+    double *visit_probability;
+
+    // absorption_time[n] is the probability that a walk from the start
+    // state is absorbed after exactly n moves, for n < time_steps
+    double *absorption_time;
+    size_t time_steps;
+} AbsorbingAnalysis;
+
+/**
+ * Analyze the chain as an absorbing chain. The transition matrix is built
+ * from the counter lists, and I - Q (Q the transient to transient part) is
+ * factored once with a dense LU decomposition. Its inverse, the fundamental
+ * matrix, gives the expected moves, visits and visit probabilities. The
+ * absorption time distribution is propagated along the counter lists.
+ * Costs O(t^3) for t transient states.
+ * @param markov_chain the chain to analyze
+ * @param start id of the state walks start from
+ * @param max_steps the absorption time distribution stops after that many
+ * moves, or once less than 1e-12 of the mass is left
+ * @param analysis the analysis to fill, freed with free_absorbing_analysis
+ * @return true on success, false if some transient state can not reach an
+ * absorbing state, or in case of allocation error
+ */
+bool analyze_absorbing_chain(const MarkovChain *markov_chain, size_t start,
+                             size_t max_steps, AbsorbingAnalysis *analysis);
+
+/**
+ * Free the arrays of an analysis.
+ * @param analysis the analysis to free
+ */
+void free_absorbing_analysis(AbsorbingAnalysis *analysis);
+
+/**
+ * Outcome of compute_stationary_distribution.
+ */
+typedef enum StationaryStatus {
+    STATIONARY_CONVERGED,
+    // max_iterations were done, the distribution is the last iterate
+    STATIONARY_NOT_CONVERGED,
+    // allocation or thread creation error, the distribution is not set
+    STATIONARY_ERROR
+} StationaryStatus;
+
+/**
+ * Compute the stationary distribution of the chain: the long run share of
+ * time spent in each state when sequences are generated one after the
+ * other. A walk that reaches a last state, or a state with no next state,
+ * restarts at a uniformly drawn start state (any state if the chain has
+ * none). Uses power iteration on the transposed counter lists, with the
+ * states split between threads in ranges of equal edge counts. The
+ * iteration is lazy, x' = (x + P^T x) / 2: the lazy chain has the same
+ * stationary distribution, and also converges when the chain is periodic.
+ * @param markov_chain the chain, only read
+ * @param tolerance stop once an iteration changes the distribution by less
+ * than that in L1 norm
+ * @param max_iterations maximal number of iterations
+ * @param thread_count number of threads to use, positive
+ * @param distribution set to the probability of each state, by id. Must
+ * hold the chain's number of states.
+ * @param iterations set to the number of iterations done, may be NULL
+ * @return STATIONARY_CONVERGED, STATIONARY_NOT_CONVERGED if the iteration
+ * did not converge within max_iterations, or STATIONARY_ERROR
+ */
+StationaryStatus compute_stationary_distribution(
+    const MarkovChain *markov_chain, double tolerance, size_t max_iterations,
+    size_t thread_count, double *distribution, size_t *iterations);
+
+#endif //_MARKOV_ANALYSIS_H_
@@ -1,47 +1,107 @@
 #include "markov_chain.h"
 #include <string.h>
 
+#define MIN_COUNTER_LIST_CAPACITY 4
+// counter lists longer than this get a counter_index
+#define COUNTER_INDEX_MIN_SIZE 8
+
 /**
-* Get random number between 0 and max_number [0, max_number).
-* @param max_number maximal number to return (not including)
-* @return Random number
-*/
-int get_random_number(int max_number)
+ * Allocate memory for the chain's nodes, from its arena if it has one.
+ * @param markov_chain the chain the memory belongs to.
+ * @param size number of bytes to allocate.
+ * @return pointer to the memory, NULL in case of allocation error.
+ */
+static void *chain_alloc(MarkovChain *markov_chain, size_t size)
 {
-  return rand() % max_number;
+  MARKOV_STATS_ADD (markov_chain, bytes_allocated, size);
+  if (markov_chain->arena) return arena_alloc (markov_chain->arena, size);
+  return malloc (size);
 }
 
 /**
- * Helper function for the main "get_first_random_node".
- * Helps to search the needed MarkovNode.
- * Validate that it is not an end word.
- * @param markov_chain the chain we work with.
- * @param r_number random number that indicate the place of the MarkovNode.
- * @return MarkovNode.
+ * Resize memory allocated by chain_alloc. In arena mode the old memory is
+ * left to the arena, which is fine for the geometric growth done here.
+ * @param markov_chain the chain the memory belongs to.
+ * @param ptr memory to resize, may be NULL.
+ * @param old_size the size ptr was allocated with.
+ * @param size the new size, bigger than old_size.
+ * @return pointer to the memory, NULL in case of allocation error, in which
+ * case ptr is left untouched.
  */
-MarkovNode *get_first_random_node_helper(MarkovChain *markov_chain,
-                                         int r_number){
-  Node *p = markov_chain->database->first;
-  for (int i = 0 ; i < r_number; ++i){
-    p = p->next;
-  }
-  return p->data;
+static void *chain_realloc(MarkovChain *markov_chain, void *ptr,
+                           size_t old_size, size_t size)
+{
+  MARKOV_STATS_ADD (markov_chain, bytes_allocated, size);
+  if (!markov_chain->arena) return realloc (ptr, size);
+  void *new_ptr = arena_alloc (markov_chain->arena, size);
+  if (new_ptr && ptr) memcpy (new_ptr, ptr, old_size);
+  return new_ptr;
 }
 
-MarkovNode *get_first_random_node (MarkovChain *markov_chain)
+/**
+ * Free memory allocated by chain_alloc. Nothing to do in arena mode.
+ * @param markov_chain the chain the memory belongs to.
+ * @param ptr memory to free, may be NULL.
+ */
+static void chain_free(MarkovChain *markov_chain, void *ptr)
 {
-  MarkovNode *p = get_first_random_node_helper (markov_chain,
-          get_random_number (markov_chain->database->size));
-  return p;
+  if (!markov_chain->arena) free (ptr);
+}
+
+/**
+ * Check if the chain's state payloads are copied into its arena, in which
+ * case they are released with the arena and not with free_data.
+ * @param markov_chain the chain to check.
+ * @return true if payloads live in the arena.
+ */
+static bool data_in_arena(MarkovChain *markov_chain)
+{
+  return markov_chain->arena && markov_chain->arena_copy;
+}
+
+MarkovNode *get_first_random_node (MarkovChain *markov_chain, Rng *rng)
+{
+  return markov_chain->states[rng_below
+      (rng, (uint64_t) markov_chain->database->size)];
+}
+
+MarkovNode *get_random_start_node (MarkovChain *markov_chain, Rng *rng)
+{
+  if (markov_chain->start_states_size == 0) return NULL;
+  return markov_chain->start_states[rng_below
+      (rng, markov_chain->start_states_size)];
+}
+
+/**
+ * Draw a position in the counter list an alias table was built for.
+ * @return the position, chosen with probability frequency / sum
+ */
+static size_t alias_draw(const AliasTable *alias, Rng *rng)
+{
+  const AliasEntry *column = alias->entries + rng_below (rng, alias->size);
+  if (rng_below (rng, alias->sum) >= column->threshold)
+  {
+    return column->alias;
+  }
+  return (size_t) (column - alias->entries);
 }
 
-MarkovNode *get_next_random_node (MarkovNode *state_struct_ptr)
+MarkovNode *get_next_random_node (MarkovNode *state_struct_ptr, Rng *rng)
 {
-  int r_size = get_random_number
-      ((int)state_struct_ptr->counter_list_sum);
+  AliasTable *alias = state_struct_ptr->alias;
+  MARKOV_STATS_ADD (state_struct_ptr->chain, next_node_draws, 1);
+  if (alias && alias->sum == state_struct_ptr->counter_list_sum)
+  {
+    MARKOV_STATS_ADD (state_struct_ptr->chain, alias_draws, 1);
+    return state_struct_ptr->chain->states
+        [state_struct_ptr->counter_list[alias_draw (alias, rng)].next_id];
+  }
+
+  uint64_t r_size = rng_below (rng, state_struct_ptr->counter_list_sum);
   NextNodeCounter *p = state_struct_ptr->counter_list;
-  int sum = 0, i = 0;
-  while (i < (int)state_struct_ptr->counter_list_size)
+  uint64_t sum = 0;
+  size_t i = 0;
+  while (i < state_struct_ptr->counter_list_size)
   {
     sum += p->frequency;
     if (sum > r_size)
@@ -51,24 +111,226 @@ MarkovNode *get_next_random_node (MarkovNode *state_struct_ptr)
     i++;
     p++;
   }
-  return p->next_word;
+  MARKOV_STATS_ADD (state_struct_ptr->chain, counter_scan_length, i + 1);
+  return state_struct_ptr->chain->states[p->next_id];
+}
+
+/**
+ * Build the alias table of a single node with Vose's method, on integer
+ * weights scaled by the list size so that the table is exact.
+ * @param markov_chain the chain the node belongs to
+ * @param node the node to build the table for, with at least one next state
+ * @param small scratch stack with room for counter_list_size indices
+ * @param large scratch stack with room for counter_list_size indices
+ * @return true on success, false in case of allocation error
+ */
+static bool build_alias_table(MarkovChain *markov_chain, MarkovNode *node,
+                              size_t *small, size_t *large)
+{
+  size_t n = node->counter_list_size, sum = node->counter_list_sum;
+  size_t old_n = node->alias ? node->alias->size : 0;
+  AliasTable *table = chain_realloc (markov_chain, node->alias,
+                                     sizeof (AliasTable)
+                                     + old_n * sizeof (AliasEntry),
+                                     sizeof (AliasTable)
+                                     + n * sizeof (AliasEntry));
+  if (!table) return false;
+  node->alias = table;
+  table->sum = sum;
+  table->size = n;
+
+  size_t small_size = 0, large_size = 0;
+  for (size_t i = 0; i < n; ++i)
+  {
+    // scaled weights average to exactly sum
+    table->entries[i].threshold = (size_t) node->counter_list[i].frequency * n;
+    table->entries[i].alias = i;
+    if (table->entries[i].threshold < sum) small[small_size++] = i;
+    else large[large_size++] = i;
+  }
+  while (small_size && large_size)
+  {
+    size_t s = small[--small_size], l = large[large_size - 1];
+    table->entries[s].alias = l;
+    table->entries[l].threshold -= sum - table->entries[s].threshold;
+    if (table->entries[l].threshold < sum)
+    {
+      large_size--;
+      small[small_size++] = l;
+    }
+  }
+  while (large_size)
+  {
+    table->entries[large[--large_size]].threshold = sum;
+  }
+  return true;
+}
+
+bool freeze_sampling(MarkovChain *markov_chain)
+{
+  size_t max_size = 0;
+  for (int i = 0; i < markov_chain->database->size; ++i)
+  {
+    if (markov_chain->states[i]->counter_list_size > max_size)
+    {
+      max_size = markov_chain->states[i]->counter_list_size;
+    }
+  }
+
+  size_t *scratch = malloc (2 * max_size * sizeof (size_t) + 1);
+  if (!scratch)
+  {
+    fprintf (stderr, ALLOCATION_ERROR_MASSAGE);
+    return false;
+  }
+  for (int i = 0; i < markov_chain->database->size; ++i)
+  {
+    MarkovNode *node = markov_chain->states[i];
+    if (node->counter_list_size == 0
+        || (node->alias && node->alias->sum == node->counter_list_sum))
+    {
+      continue;
+    }
+    if (!build_alias_table (markov_chain, node, scratch, scratch + max_size))
+    {
+      fprintf (stderr, ALLOCATION_ERROR_MASSAGE);
+      free (scratch);
+      return false;
+    }
+  }
+  free (scratch);
+  return true;
+}
+
+/**
+ * Free a frozen chain and its arrays.
+ * @param frozen pointer to the frozen chain to free, set to NULL.
+ */
+static void free_frozen_chain(FrozenChain **frozen)
+{
+  if (frozen && *frozen)
+  {
+    free ((*frozen)->states);
+    free ((*frozen)->offsets);
+    free ((*frozen)->next_ids);
+    free ((*frozen)->cumulative);
+    free ((*frozen)->is_last);
+    free ((*frozen)->start_ids);
+    free (*frozen);
+    *frozen = NULL;
+  }
+}
+
+bool freeze_markov_chain(MarkovChain *markov_chain)
+{
+  size_t n = (size_t) markov_chain->database->size, e = 0;
+  for (size_t i = 0; i < n; ++i)
+  {
+    e += markov_chain->states[i]->counter_list_size;
+  }
+
+  FrozenChain *frozen = calloc (1, sizeof (FrozenChain));
+  if (frozen)
+  {
+    frozen->states = malloc ((n + 1) * sizeof (MarkovNode *));
+    frozen->offsets = malloc ((n + 1) * sizeof (size_t));
+    frozen->next_ids = malloc ((e + 1) * sizeof (uint32_t));
+    frozen->cumulative = malloc ((e + 1) * sizeof (uint64_t));
+    frozen->is_last = malloc ((n + 1) * sizeof (bool));
+    frozen->start_ids = malloc ((markov_chain->start_states_size + 1)
+                                * sizeof (uint32_t));
+  }
+  if (!frozen || !frozen->states || !frozen->offsets || !frozen->next_ids
+      || !frozen->cumulative || !frozen->is_last || !frozen->start_ids)
+  {
+    fprintf (stderr, ALLOCATION_ERROR_MASSAGE);
+    free_frozen_chain (&frozen);
+    return false;
+  }
+
+  frozen->state_count = n;
+  e = 0;
+  for (size_t i = 0; i < n; ++i)
+  {
+    MarkovNode *node = markov_chain->states[i];
+    frozen->states[i] = node;
+    frozen->is_last[i] = markov_chain->is_last (node->data);
+    frozen->offsets[i] = e;
+    uint64_t sum = 0;
+    for (size_t j = 0; j < node->counter_list_size; ++j, ++e)
+    {
+      sum += (uint64_t) node->counter_list[j].frequency;
+      frozen->next_ids[e] = node->counter_list[j].next_id;
+      frozen->cumulative[e] = sum;
+    }
+  }
+  frozen->offsets[n] = e;
+  for (size_t i = 0; i < markov_chain->start_states_size; ++i)
+  {
+    frozen->start_ids[i] = (uint32_t) markov_chain->start_states[i]->id;
+  }
+  frozen->start_count = markov_chain->start_states_size;
+
+  free_frozen_chain (&markov_chain->frozen);
+  markov_chain->frozen = frozen;
+  return true;
+}
+
+size_t get_random_start_state(const FrozenChain *frozen, Rng *rng)
+{
+  return frozen->start_ids[rng_below (rng, frozen->start_count)];
+}
+
+size_t get_next_random_state(const FrozenChain *frozen, size_t state,
+                             Rng *rng)
+{
+  size_t low = frozen->offsets[state], high = frozen->offsets[state + 1];
+  // the row is the state's counter list at the freeze, so an alias table
+  // built for the same list draws its positions in the row
+  const AliasTable *alias = frozen->states[state]->alias;
+  if (alias && alias->size == high - low
+      && alias->sum == frozen->cumulative[high - 1])
+  {
+    return frozen->next_ids[low + alias_draw (alias, rng)];
+  }
+  uint64_t r = rng_below (rng, frozen->cumulative[high - 1]);
+  // first edge whose cumulative frequency is above r
+  while (low < high)
+  {
+    size_t middle = low + (high - low) / 2;
+    if (frozen->cumulative[middle] > r) high = middle;
+    else low = middle + 1;
+  }
+  return frozen->next_ids[low];
+}
+
+/**
+ * Print a state, or append it to the chain's output buffer if it has one.
+ * @return false in case of I/O or allocation error
+ */
+static bool emit_state(MarkovChain *markov_chain, void *data)
+{
+  if (markov_chain->output && markov_chain->append_func)
+  {
+    return markov_chain->append_func (data, markov_chain->output);
+  }
+  markov_chain->print_func (data);
+  return true;
 }
 
 void generate_random_sequence(MarkovChain *markov_chain, MarkovNode *
-first_node, int max_length)
+first_node, int max_length, Rng *rng)
 {
   int i = 0;
-  MarkovNode *p = first_node;
   if (first_node == NULL)
-    first_node = get_first_random_node (markov_chain);
-  else
-    p = first_node;
+    first_node = get_first_random_node (markov_chain, rng);
+  MarkovNode *p = first_node;
 
-  markov_chain->print_func(first_node->data);
-  while ((p->counter_list != NULL) && (i < max_length))
+  bool emitted = emit_state (markov_chain, first_node->data);
+  while (emitted && (p->counter_list_size > 0) && (i < max_length))
   {
-    p = get_next_random_node (p);
-    markov_chain->print_func(p->data);
+    p = get_next_random_node (p, rng);
+    emitted = emit_state (markov_chain, p->data);
     i++;
   }
 }
@@ -79,6 +341,19 @@ void free_markov_chain(MarkovChain ** ptr_chain)
   {
     if (*ptr_chain)
     {
+      if ((*ptr_chain)->database && (*ptr_chain)->arena)
+      {
+        // nodes live in the arena, only payloads may need freeing
+        for (int i = 0; i < (*ptr_chain)->database->size
+                        && !data_in_arena (*ptr_chain); ++i)
+        {
+          (*ptr_chain)->free_data ((*ptr_chain)->states[i]->data);
+        }
+        (*ptr_chain)->database->first = NULL;
+        (*ptr_chain)->database->size = 0;
+      }
+      arena_free (&(*ptr_chain)->arena);
+      free_frozen_chain (&(*ptr_chain)->frozen);
       if ((*ptr_chain)->database)
       {
         Node *p = (*ptr_chain)->database->first;
@@ -96,6 +371,8 @@ void free_markov_chain(MarkovChain ** ptr_chain)
               free (p->data->counter_list);
               p->data->counter_list = NULL;
             }
+            free (p->data->alias);
+            free (p->data->counter_index);
             free (p->data);
             p->data = NULL;
           }
@@ -104,6 +381,11 @@ void free_markov_chain(MarkovChain ** ptr_chain)
           p = tmp;
         }
         p = NULL;
+        hash_index_free (&(*ptr_chain)->index);
+        free ((*ptr_chain)->states);
+        (*ptr_chain)->states = NULL;
+        free ((*ptr_chain)->start_states);
+        (*ptr_chain)->start_states = NULL;
         free ((*ptr_chain)->database);
         (*ptr_chain)->database = NULL;
       }
@@ -113,63 +395,652 @@ void free_markov_chain(MarkovChain ** ptr_chain)
   }
 }
 
+/**
+ * Make sure a growable array of MarkovNode pointers has room for one more
+ * element, doubling its capacity when it is full.
+ * @param array pointer to the array
+ * @param size number of elements in the array
+ * @param capacity pointer to the capacity of the array
+ * @return true on success, false in case of allocation error
+ */
+static bool reserve_node_slot(MarkovNode ***array, size_t size,
+                              size_t *capacity)
+{
+  if (size < *capacity) return true;
+  size_t new_capacity = *capacity ? *capacity * 2 : 16;
+  MarkovNode **tmp = realloc (*array, new_capacity * sizeof (MarkovNode *));
+  if (!tmp) return false;
+  *array = tmp;
+  *capacity = new_capacity;
+  return true;
+}
+
+/**
+ * Hash of a next state in a counter index. Node ids are unique in a chain.
+ * @param id id of the next state.
+ * @return the hash.
+ */
+static size_t counter_index_hash(uint32_t id)
+{
+  return id * (size_t) 0x9E3779B97F4A7C15ULL;
+}
+
 /**
  * Check if the MarkovNode who needed to add to the counter list is already
  * exists in the list.If so, the function return pointer from type
  * NextNodeCounter of the MarkovNode.
  * Otherwise its return NULL.
+ * Nodes are unique in the database, so they are compared by id.
  * @param first_node The MarkovNode we use is counter list.
  * @param second_node The MarkovNode we check if he is already exists in list.
  * @return Pointer type NextNodeCounter \ NULL.
  */
-NextNodeCounter *node_in_counter_list(MarkovChain *markov_chain, MarkovNode
-*first_node, MarkovNode *second_node)
+static NextNodeCounter *node_in_counter_list(MarkovNode *first_node,
+                                             MarkovNode *second_node)
 {
-  NextNodeCounter *p = first_node->counter_list;
-  for (size_t i = 0; i < first_node->counter_list_size; ++i)
+  uint32_t id = (uint32_t) second_node->id;
+  if (!first_node->counter_index)
+  {
+    NextNodeCounter *p = first_node->counter_list;
+    for (size_t i = 0; i < first_node->counter_list_size; ++i)
+    {
+      if (p->next_id == id)
+      {
+        return p;
+      }
+      p++;
+    }
+    return NULL;
+  }
+
+  size_t mask = first_node->counter_index_capacity - 1;
+  size_t i = counter_index_hash (id) & mask;
+  while (first_node->counter_index[i])
   {
-    if (!markov_chain->comp_func (p->next_word->data, second_node->data))
+    NextNodeCounter *p = first_node->counter_list
+                         + first_node->counter_index[i] - 1;
+    if (p->next_id == id)
     {
       return p;
     }
-    p++;
+    i = (i + 1) & mask;
   }
   return NULL;
 }
 
-bool add_node_to_counter_list (MarkovNode *first_node, MarkovNode
-*second_node, MarkovChain *markov_chain)
+/**
+ * Put the counter at the given position of counter_list in the first free
+ * slot of its probe sequence in the counter index.
+ * @param node the node owning the counter list and index.
+ * @param position position of the counter in counter_list.
+ */
+static void counter_index_place(MarkovNode *node, size_t position)
+{
+  size_t mask = node->counter_index_capacity - 1;
+  size_t i = counter_index_hash (node->counter_list[position].next_id)
+             & mask;
+  while (node->counter_index[i])
+  {
+    i = (i + 1) & mask;
+  }
+  node->counter_index[i] = (uint32_t) (position + 1);
+}
+
+/**
+ * (Re)build the counter index of a node with at least twice as many slots
+ * as its counter list capacity, so it stays at most half full. The slot
+ * count is a power of two, which loaded counter list capacities need not be.
+ * @param markov_chain the chain the node belongs to.
+ * @param node the node to index.
+ * @return true on success, false in case of allocation error
+ */
+static bool build_counter_index(MarkovChain *markov_chain, MarkovNode *node)
+{
+  size_t capacity = 2 * MIN_COUNTER_LIST_CAPACITY;
+  while (capacity < 2 * node->counter_list_capacity) capacity *= 2;
+  uint32_t *index = chain_alloc (markov_chain, capacity * sizeof (uint32_t));
+  if (!index) return false;
+  MARKOV_STATS_ADD (markov_chain, counter_index_builds, 1);
+  memset (index, 0, capacity * sizeof (uint32_t));
+  chain_free (markov_chain, node->counter_index);
+  node->counter_index = index;
+  node->counter_index_capacity = capacity;
+  for (size_t i = 0; i < node->counter_list_size; ++i)
+  {
+    counter_index_place (node, i);
+  }
+  return true;
+}
+
+/**
+ * Double the capacity of a node's counter list.
+ * @param markov_chain the chain the node belongs to.
+ * @param node the node whose counter list grows.
+ * @return true on success, false in case of allocation error
+ */
+static bool grow_counter_list(MarkovChain *markov_chain, MarkovNode *node)
+{
+  size_t new_capacity = node->counter_list_capacity
+                        ? node->counter_list_capacity * 2
+                        : MIN_COUNTER_LIST_CAPACITY;
+  NextNodeCounter *tmp = chain_realloc (markov_chain, node->counter_list,
+                                        sizeof (NextNodeCounter)
+                                        * node->counter_list_capacity,
+                                        sizeof (NextNodeCounter)
+                                        * new_capacity);
+  if (!tmp) return false;
+  MARKOV_STATS_ADD (markov_chain, counter_list_reallocs, 1);
+  node->counter_list = tmp;
+  node->counter_list_capacity = new_capacity;
+  return true;
+}
+
+/**
+ * Weighted version of add_node_to_counter_list, adding frequency
+ * occurrences of the transition at once.
+ */
+static bool add_counter(MarkovNode *first_node, MarkovNode *second_node,
+                        MarkovChain *markov_chain, uint32_t frequency)
 {
-  NextNodeCounter *p = node_in_counter_list(markov_chain, first_node,
-                                            second_node);
+  NextNodeCounter *p = node_in_counter_list(first_node, second_node);
   if (p)
   {
-    p->frequency++;
-    first_node->counter_list_sum++;
+    p->frequency += frequency;
+    first_node->counter_list_sum += (size_t) frequency;
     return true;
   }
 
-  NextNodeCounter *tmp = realloc (first_node->counter_list,
-                                  sizeof (NextNodeCounter) *
-                                  (first_node->counter_list_size + 1));
-  if (!tmp)
+  bool first_next = first_node->counter_list_size == 0
+      && !markov_chain->is_last (first_node->data);
+  if (first_next && !reserve_node_slot (&markov_chain->start_states,
+                                        markov_chain->start_states_size,
+                                        &markov_chain->start_states_capacity))
+  {
+    fprintf (stderr, ALLOCATION_ERROR_MASSAGE);
+    return false;
+  }
+
+  if (first_node->counter_list_size == first_node->counter_list_capacity
+      && !grow_counter_list (markov_chain, first_node))
+  {
+    fprintf (stderr, ALLOCATION_ERROR_MASSAGE);
+    return false;
+  }
+
+  // the index is (re)built before the counter is added, so a failure
+  // leaves the list and its index as they were
+  size_t position = first_node->counter_list_size;
+  bool indexed = position + 1 > COUNTER_INDEX_MIN_SIZE;
+  if (indexed && first_node->counter_index_capacity
+                 < 2 * first_node->counter_list_capacity
+      && !build_counter_index (markov_chain, first_node))
   {
     fprintf (stderr, ALLOCATION_ERROR_MASSAGE);
     return false;
   }
 
-  first_node->counter_list = tmp;
-  first_node->counter_list[first_node->counter_list_size].next_word
-      = second_node;
-  first_node->counter_list[first_node->counter_list_size].frequency = 1;
+  first_node->counter_list[position].next_id = (uint32_t) second_node->id;
+  first_node->counter_list[position].frequency = frequency;
   first_node->counter_list_size++;
-  first_node->counter_list_sum++;
+  first_node->counter_list_sum += (size_t) frequency;
+  if (first_next)
+  {
+    markov_chain->start_states[markov_chain->start_states_size++] =
+        first_node;
+  }
+
+  if (indexed) counter_index_place (first_node, position);
+  return true;
+}
+
+bool add_node_to_counter_list (MarkovNode *first_node, MarkovNode
+*second_node, MarkovChain *markov_chain)
+{
+  return add_counter (first_node, second_node, markov_chain, 1);
+}
+
+/**
+ * Add the counter list of a node of another chain to the node it was
+ * merged to. Transitions with no frequency or to a state that was not
+ * merged are skipped.
+ * @param merged the nodes of markov_chain, by id in the other chain, NULL
+ * for the states that were not merged.
+ * @param frequencies the frequencies to add, in counter list order, NULL
+ * to add the counters' own.
+ * @return true on success, false in case of allocation error
+ */
+static bool merge_counter_list(MarkovChain *markov_chain, MarkovNode **merged,
+                               MarkovNode *node, const uint32_t *frequencies)
+{
+  for (size_t i = 0; i < node->counter_list_size; ++i)
+  {
+    NextNodeCounter *counter = node->counter_list + i;
+    uint32_t frequency = frequencies ? frequencies[i] : counter->frequency;
+    if (frequency == 0 || !merged[counter->next_id]) continue;
+    if (!add_counter (merged[node->id], merged[counter->next_id],
+                      markov_chain, frequency))
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+ * Add the counters of another chain to the chain's, so that the chain of
+ * merged shards reports the work of their training. The timers are left
+ * to the user, who runs them around the whole training.
+ */
+static void merge_stats(MarkovChain *markov_chain, const MarkovChain *other)
+{
+#ifdef MARKOV_STATS
+  MarkovStats stats, *total = &markov_chain->stats;
+  markov_chain_stats (other, &stats);
+  total->comp_calls += stats.comp_calls;
+  total->database_lookups += stats.database_lookups;
+  total->database_scan_length += stats.database_scan_length;
+  total->next_node_draws += stats.next_node_draws;
+  total->alias_draws += stats.alias_draws;
+  total->counter_scan_length += stats.counter_scan_length;
+  total->counter_list_reallocs += stats.counter_list_reallocs;
+  total->counter_index_builds += stats.counter_index_builds;
+  total->bytes_allocated += stats.bytes_allocated;
+#else
+  (void) markov_chain;
+  (void) other;
+#endif
+}
 
+bool merge_markov_chain(MarkovChain *markov_chain, MarkovChain *other,
+                        Translate_Func translate, void *context)
+{
+  size_t size = (size_t) other->database->size;
+  MarkovNode **merged = malloc ((size ? size : 1) * sizeof (MarkovNode *));
+  if (!merged)
+  {
+    fprintf (stderr, ALLOCATION_ERROR_MASSAGE);
+    return false;
+  }
+
+  bool success = true;
+  for (size_t i = 0; success && i < size; ++i)
+  {
+    void *data = other->states[i]->data;
+    if (translate) data = translate (data, context);
+    Node *node = data ? add_to_database (markov_chain, data) : NULL;
+    success = node != NULL;
+    if (node) merged[i] = node->data;
+  }
+  // start states first, in the order they got their first next state, so
+  // new start states are appended in the order training would give them
+  for (size_t i = 0; success && i < other->start_states_size; ++i)
+  {
+    success = merge_counter_list (markov_chain, merged,
+                                  other->start_states[i], NULL);
+  }
+  for (size_t i = 0; success && i < size; ++i)
+  {
+    if (other->is_last (other->states[i]->data))
+    {
+      success = merge_counter_list (markov_chain, merged, other->states[i],
+                                    NULL);
+    }
+  }
+  free (merged);
+  if (success) merge_stats (markov_chain, other);
+  return success;
+}
+
+/**
+ * Copy the frequencies of all the chain's transitions, so they can be
+ * changed without touching the chain until it is rebuilt.
+ * @param offsets set to an array where the frequencies of state i start at
+ * offsets[i], to free along with the frequencies.
+ * @return the frequencies in id and counter list order, NULL in case of
+ * allocation error.
+ */
+static uint32_t *copy_frequencies(const MarkovChain *markov_chain,
+                                  size_t **offsets)
+{
+  size_t size = (size_t) markov_chain->database->size, edges = 0;
+  *offsets = malloc ((size + 1) * sizeof (size_t));
+  if (!*offsets) return NULL;
+  for (size_t i = 0; i < size; ++i)
+  {
+    (*offsets)[i] = edges;
+    edges += markov_chain->states[i]->counter_list_size;
+  }
+  (*offsets)[size] = edges;
+  uint32_t *frequencies = malloc ((edges ? edges : 1) * sizeof (uint32_t));
+  if (!frequencies)
+  {
+    free (*offsets);
+    *offsets = NULL;
+    return NULL;
+  }
+  for (size_t i = 0; i < size; ++i)
+  {
+    const MarkovNode *node = markov_chain->states[i];
+    for (size_t j = 0; j < node->counter_list_size; ++j)
+    {
+      frequencies[(*offsets)[i] + j] = node->counter_list[j].frequency;
+    }
+  }
+  return frequencies;
+}
+
+/**
+ * Rebuild the chain with only the kept states, and the transitions between
+ * them left with a frequency, in a new database, index and arena.
+ * @param keep keep[i] is true if the state with id i is kept.
+ * @param frequencies new frequency of each transition, as given by
+ * copy_frequencies: frequencies[offsets[i] + j] for the j-th counter of
+ * state i.
+ * @param translate optional translation of the kept states, as in
+ * merge_markov_chain.
+ * @return true on success, false in case of allocation error, in which case
+ * the chain is left as it was.
+ */
+static bool compact_markov_chain(MarkovChain *markov_chain, const bool *keep,
+                                 const uint32_t *frequencies,
+                                 const size_t *offsets,
+                                 Translate_Func translate, void *context)
+{
+  size_t size = (size_t) markov_chain->database->size;
+  MarkovChain compact = *markov_chain;
+  compact.database = calloc (1, sizeof (LinkedList));
+  compact.index = NULL;
+  compact.states = NULL;
+  compact.states_capacity = 0;
+  compact.start_states = NULL;
+  compact.start_states_size = 0;
+  compact.start_states_capacity = 0;
+  compact.frozen = NULL;
+  compact.arena = markov_chain->arena
+                  ? arena_create (markov_chain->arena->block_size) : NULL;
+  MarkovChain *old = malloc (sizeof (MarkovChain));
+  MarkovNode **kept = malloc ((size ? size : 1) * sizeof (MarkovNode *));
+  bool success = compact.database && old && kept
+                 && (compact.arena || !markov_chain->arena);
+  for (size_t i = 0; success && i < size; ++i)
+  {
+    kept[i] = NULL;
+    if (!keep[i]) continue;
+    void *data = markov_chain->states[i]->data;
+    if (translate) data = translate (data, context);
+    Node *node = data ? add_to_database (&compact, data) : NULL;
+    success = node != NULL;
+    if (node) kept[i] = node->data;
+  }
+  // counter lists get their exact size up front, instead of growing
+  for (size_t i = 0; success && i < size; ++i)
+  {
+    MarkovNode *node = markov_chain->states[i];
+    size_t count = 0;
+    for (size_t j = 0; keep[i] && j < node->counter_list_size; ++j)
+    {
+      count += frequencies[offsets[i] + j]
+               && keep[node->counter_list[j].next_id];
+    }
+    if (count == 0) continue;
+    kept[i]->counter_list = chain_alloc (&compact,
+                                         count * sizeof (NextNodeCounter));
+    success = kept[i]->counter_list != NULL;
+    if (success) kept[i]->counter_list_capacity = count;
+  }
+  // same order as merge_markov_chain, which keeps the start states in order
+  for (size_t i = 0; success && i < markov_chain->start_states_size; ++i)
+  {
+    MarkovNode *node = markov_chain->start_states[i];
+    if (keep[node->id])
+    {
+      success = merge_counter_list (&compact, kept, node,
+                                    frequencies + offsets[node->id]);
+    }
+  }
+  for (size_t i = 0; success && i < size; ++i)
+  {
+    MarkovNode *node = markov_chain->states[i];
+    if (keep[i] && markov_chain->is_last (node->data))
+    {
+      success = merge_counter_list (&compact, kept, node,
+                                    frequencies + offsets[i]);
+    }
+  }
+  free (kept);
+  if (!old)
+  {
+    // nothing was added without old, so only the empty shells are left
+    free (compact.database);
+    arena_free (&compact.arena);
+    fprintf (stderr, ALLOCATION_ERROR_MASSAGE);
+    return false;
+  }
+  if (!success)
+  {
+    *old = compact;
+    free_markov_chain (&old);
+    fprintf (stderr, ALLOCATION_ERROR_MASSAGE);
+    return false;
+  }
+  *old = *markov_chain;
+  free_markov_chain (&old);
+  *markov_chain = compact;
+  for (int i = 0; i < markov_chain->database->size; ++i)
+  {
+    markov_chain->states[i]->chain = markov_chain;
+  }
   return true;
 }
 
+/**
+ * Number of bytes held by the chain's nodes, counter lists, counter
+ * indices, alias tables and arrays, without the states' data. The memory
+ * of an arena chain is what its arena handed out, counter lists left
+ * behind by growth included.
+ */
+static size_t chain_footprint(const MarkovChain *markov_chain)
+{
+  size_t bytes = sizeof (LinkedList)
+                 + (markov_chain->states_capacity
+                    + markov_chain->start_states_capacity)
+                   * sizeof (MarkovNode *);
+  if (markov_chain->index)
+  {
+    bytes += sizeof (HashIndex) + markov_chain->index->capacity
+                                  * (sizeof (Node *) + sizeof (size_t));
+  }
+  if (markov_chain->arena)
+  {
+    return bytes + markov_chain->arena->bytes_allocated;
+  }
+  for (int i = 0; i < markov_chain->database->size; ++i)
+  {
+    const MarkovNode *node = markov_chain->states[i];
+    bytes += sizeof (Node) + sizeof (MarkovNode)
+             + node->counter_list_capacity * sizeof (NextNodeCounter)
+             + node->counter_index_capacity * sizeof (uint32_t);
+    if (node->alias)
+    {
+      bytes += sizeof (AliasTable) + node->alias->size * sizeof (AliasEntry);
+    }
+  }
+  return bytes;
+}
+
+bool decay_markov_chain(MarkovChain *markov_chain, unsigned shift,
+                        Translate_Func translate, void *context)
+{
+  size_t size = (size_t) markov_chain->database->size, *offsets = NULL;
+  bool *keep = calloc (size ? size : 1, sizeof (bool));
+  uint32_t *frequencies = copy_frequencies (markov_chain, &offsets);
+  if (!keep || !frequencies)
+  {
+    free (keep);
+    free (frequencies);
+    free (offsets);
+    fprintf (stderr, ALLOCATION_ERROR_MASSAGE);
+    return false;
+  }
+  for (size_t i = 0; i < size; ++i)
+  {
+    MarkovNode *node = markov_chain->states[i];
+    for (size_t j = 0; j < node->counter_list_size; ++j)
+    {
+      uint32_t *frequency = frequencies + offsets[i] + j;
+      *frequency = shift < 32 ? *frequency >> shift : 0;
+      if (*frequency)
+      {
+        keep[i] = true;
+        keep[node->counter_list[j].next_id] = true;
+      }
+    }
+  }
+  bool success = compact_markov_chain (markov_chain, keep, frequencies,
+                                       offsets, translate, context);
+  free (keep);
+  free (frequencies);
+  free (offsets);
+  return success;
+}
+
+/**
+ * qsort order of frequencies, most frequent first.
+ */
+static int compare_frequencies(const void *first, const void *second)
+{
+  uint32_t a = *(const uint32_t *) first, b = *(const uint32_t *) second;
+  return (a < b) - (a > b);
+}
+
+/**
+ * Zero the frequencies of the transitions of a node that
+ * prune_markov_chain drops.
+ * @param frequencies copy of the node's frequencies, in counter list order.
+ * @param scratch room for counter_list_size frequencies.
+ */
+static void prune_counter_list(const MarkovNode *node, uint32_t *frequencies,
+                               uint32_t min_count, size_t top_k,
+                               uint32_t *scratch)
+{
+  size_t n = 0;
+  for (size_t j = 0; j < node->counter_list_size; ++j)
+  {
+    if (frequencies[j] < min_count) frequencies[j] = 0;
+    if (frequencies[j]) scratch[n++] = frequencies[j];
+  }
+  // the top_k most frequent are those above threshold, then the first
+  // ones equal to it
+  uint32_t threshold = 0;
+  size_t ties = 0;
+  if (top_k && n > top_k)
+  {
+    qsort (scratch, n, sizeof (uint32_t), compare_frequencies);
+    threshold = scratch[top_k - 1];
+    for (size_t j = 0; j < top_k; ++j)
+    {
+      ties += scratch[j] == threshold;
+    }
+  }
+  for (size_t j = 0; j < node->counter_list_size; ++j)
+  {
+    if (frequencies[j] < threshold) frequencies[j] = 0;
+    else if (frequencies[j] == threshold && threshold)
+    {
+      if (ties) ties--;
+      else frequencies[j] = 0;
+    }
+  }
+}
+
+bool prune_markov_chain(MarkovChain *markov_chain, uint32_t min_count,
+                        size_t top_k, size_t *bytes_reclaimed)
+{
+  size_t size = (size_t) markov_chain->database->size, max_size = 0;
+  for (size_t i = 0; i < size; ++i)
+  {
+    if (markov_chain->states[i]->counter_list_size > max_size)
+    {
+      max_size = markov_chain->states[i]->counter_list_size;
+    }
+  }
+  size_t *offsets = NULL;
+  bool *keep = calloc (size ? size : 1, sizeof (bool));
+  size_t *stack = malloc ((size ? size : 1) * sizeof (size_t));
+  uint32_t *scratch = malloc ((max_size ? max_size : 1) * sizeof (uint32_t));
+  uint32_t *frequencies = copy_frequencies (markov_chain, &offsets);
+  if (!keep || !stack || !scratch || !frequencies)
+  {
+    free (keep);
+    free (stack);
+    free (scratch);
+    free (frequencies);
+    free (offsets);
+    fprintf (stderr, ALLOCATION_ERROR_MASSAGE);
+    return false;
+  }
+  for (size_t i = 0; i < size; ++i)
+  {
+    prune_counter_list (markov_chain->states[i], frequencies + offsets[i],
+                        min_count, top_k, scratch);
+  }
+  free (scratch);
+
+  // depth first search from the start states left with a transition
+  size_t stack_size = 0;
+  for (size_t i = 0; i < markov_chain->start_states_size; ++i)
+  {
+    size_t id = markov_chain->start_states[i]->id;
+    for (size_t k = offsets[id]; !keep[id] && k < offsets[id + 1]; ++k)
+    {
+      if (frequencies[k])
+      {
+        keep[id] = true;
+        stack[stack_size++] = id;
+      }
+    }
+  }
+  while (stack_size)
+  {
+    size_t id = stack[--stack_size];
+    MarkovNode *node = markov_chain->states[id];
+    for (size_t j = 0; j < node->counter_list_size; ++j)
+    {
+      size_t next_id = node->counter_list[j].next_id;
+      if (frequencies[offsets[id] + j] && !keep[next_id])
+      {
+        keep[next_id] = true;
+        stack[stack_size++] = next_id;
+      }
+    }
+  }
+  free (stack);
+
+  size_t before = chain_footprint (markov_chain);
+  bool success = compact_markov_chain (markov_chain, keep, frequencies,
+                                       offsets, NULL, NULL);
+  free (keep);
+  free (frequencies);
+  free (offsets);
+  if (success && bytes_reclaimed)
+  {
+    size_t after = chain_footprint (markov_chain);
+    *bytes_reclaimed = before > after ? before - after : 0;
+  }
+  return success;
+}
+
 Node* get_node_from_database(MarkovChain *markov_chain, void *data_ptr)
 {
+  MARKOV_STATS_ADD (markov_chain, database_lookups, 1);
+  if (markov_chain->hash_func)
+  {
+    if (!markov_chain->index) return NULL;
+    return hash_index_find (markov_chain->index,
+                            markov_chain->hash_func (data_ptr), data_ptr,
+                            markov_chain->comp_func);
+  }
+
   void *data = (void *) markov_chain->copy_func (data_ptr);
   if (!data)
   {
@@ -181,6 +1052,8 @@ Node* get_node_from_database(MarkovChain *markov_chain, void *data_ptr)
   Node *result = NULL;
   for (int i = 0; i < markov_chain->database->size; ++i)
   {
+    MARKOV_STATS_ADD (markov_chain, database_scan_length, 1);
+    MARKOV_STATS_ADD (markov_chain, comp_calls, 1);
     if (!markov_chain->comp_func (p->data->data, data))
     {
       result = p;
@@ -195,31 +1068,33 @@ Node* get_node_from_database(MarkovChain *markov_chain, void *data_ptr)
 
 /**
  * Create new node from type Node and initialize it.
- * Create the node by using malloc.
- * Create new markovnode from type MarkovNode using malloc.
- * Create new data from type char using malloc.
+ * The Node, the MarkovNode and the copy of the data are allocated with
+ * chain_alloc, so they come from the chain's arena if it has one.
  * @param data the data of the markovnode inside the node.
  * @return Pointer to the new node.
  */
 Node *create_new_node(MarkovChain *markov_chain, void *data)
 {
-  Node *new_node = malloc (sizeof(Node));
+  Node *new_node = chain_alloc (markov_chain, sizeof(Node));
   if (!new_node) return NULL;
 
-  MarkovNode *new_markov_node = malloc (sizeof(MarkovNode));
+  MarkovNode *new_markov_node = chain_alloc (markov_chain,
+                                             sizeof(MarkovNode));
   if (!new_markov_node)
   {
-    free (new_node);
+    chain_free (markov_chain, new_node);
     new_node = NULL;
     return NULL;
   }
 
-  void *new_data = markov_chain->copy_func (data);
+  void *new_data = data_in_arena (markov_chain)
+                   ? markov_chain->arena_copy (data, markov_chain->arena)
+                   : markov_chain->copy_func (data);
   if (!new_data)
   {
-    free (new_node);
+    chain_free (markov_chain, new_node);
     new_node = NULL;
-    free (new_markov_node);
+    chain_free (markov_chain, new_markov_node);
     new_markov_node = NULL;
     return NULL;
   }
@@ -228,13 +1103,115 @@ Node *create_new_node(MarkovChain *markov_chain, void *data)
   new_markov_node->counter_list = NULL;
   new_markov_node->counter_list_size = 0;
   new_markov_node->counter_list_sum = 0;
+  new_markov_node->id = 0;
+  new_markov_node->chain = markov_chain;
+  new_markov_node->alias = NULL;
+  new_markov_node->snapshot = NULL;
+  new_markov_node->counter_list_capacity = 0;
+  new_markov_node->counter_index = NULL;
+  new_markov_node->counter_index_capacity = 0;
   new_node->data = new_markov_node;
   new_node->next = NULL;
   return new_node;
 }
 
+/**
+ * Free a node that was created by create_new_node and its content.
+ * @param markov_chain the chain the node belongs to.
+ * @param node the node to free.
+ */
+static void free_node(MarkovChain *markov_chain, Node *node)
+{
+  if (!data_in_arena (markov_chain))
+  {
+    markov_chain->free_data (node->data->data);
+  }
+  chain_free (markov_chain, node->data->counter_list);
+  chain_free (markov_chain, node->data->alias);
+  chain_free (markov_chain, node->data->counter_index);
+  chain_free (markov_chain, node->data);
+  chain_free (markov_chain, node);
+}
+
+/**
+ * Append a new node to the end of the database linked list and the states
+ * array. The states array must have room for it (see reserve_node_slot).
+ * @param markov_chain the chain whose database we append to.
+ * @param new_node the node to append.
+ */
+static void append_to_database(MarkovChain *markov_chain, Node *new_node)
+{
+  LinkedList *database = markov_chain->database;
+  new_node->data->id = (size_t) database->size;
+  markov_chain->states[database->size] = new_node->data;
+  if (database->size == 0)
+  {
+    database->first = new_node;
+  }
+  else
+  {
+    database->last->next = new_node;
+  }
+  database->last = new_node;
+  database->size++;
+}
+
+/**
+ * Hash indexed version of add_to_database. Look the state up in the index
+ * and insert a new node to both the index and the database if missing.
+ * @param markov_chain the chain to look in its database
+ * @param data_ptr the state to look for
+ * @return node wrapping given data_ptr, NULL in case of allocation error
+ */
+static Node *add_to_indexed_database(MarkovChain *markov_chain,
+                                     void *data_ptr)
+{
+  if (!markov_chain->index)
+  {
+    markov_chain->index = hash_index_create (0);
+    if (!markov_chain->index)
+    {
+      fprintf (stderr, ALLOCATION_ERROR_MASSAGE);
+      return NULL;
+    }
+  }
+
+  size_t hash = markov_chain->hash_func (data_ptr);
+  Node *p = hash_index_find (markov_chain->index, hash, data_ptr,
+                             markov_chain->comp_func);
+  if (p) return p;
+
+  if (!reserve_node_slot (&markov_chain->states,
+                          (size_t) markov_chain->database->size,
+                          &markov_chain->states_capacity))
+  {
+    fprintf (stderr, ALLOCATION_ERROR_MASSAGE);
+    return NULL;
+  }
+  Node *new_node = create_new_node (markov_chain, data_ptr);
+  if (!new_node)
+  {
+    fprintf (stderr, ALLOCATION_ERROR_MASSAGE);
+    return NULL;
+  }
+  if (hash_index_insert (markov_chain->index, hash, new_node))
+  {
+    fprintf (stderr, ALLOCATION_ERROR_MASSAGE);
+    free_node (markov_chain, new_node);
+    return NULL;
+  }
+  append_to_database (markov_chain, new_node);
+  return new_node;
+}
+
 Node* add_to_database(MarkovChain *markov_chain, void *data_ptr)
 {
+  MARKOV_STATS_ADD (markov_chain, database_lookups, 1);
+  if (markov_chain->hash_func)
+  {
+    return add_to_indexed_database (markov_chain, data_ptr);
+  }
+
   void *data = (void *) markov_chain->copy_func (data_ptr);
   if (!data)
   {
@@ -245,6 +1222,8 @@ Node* add_to_database(MarkovChain *markov_chain, void *data_ptr)
   Node *p = markov_chain->database->first;
   for (int i = 0; i < markov_chain->database->size; ++i)
   {
+    MARKOV_STATS_ADD (markov_chain, database_scan_length, 1);
+    MARKOV_STATS_ADD (markov_chain, comp_calls, 1);
     if (!markov_chain->comp_func (p->data->data, data))
     {
       free (data);
@@ -254,18 +1233,16 @@ Node* add_to_database(MarkovChain *markov_chain, void *data_ptr)
     if (p->next != NULL) p = p->next;
   }
 
-  Node *new_node = create_new_node (markov_chain, data);
+  Node *new_node = NULL;
+  if (reserve_node_slot (&markov_chain->states,
+                         (size_t) markov_chain->database->size,
+                         &markov_chain->states_capacity))
+  {
+    new_node = create_new_node (markov_chain, data);
+  }
   free (data);
   data = NULL;
   if (!new_node) return NULL;
-  if (markov_chain->database->size == 0)
-  {
-    markov_chain->database->first = new_node;
-  }
-  else
-  {
-    p->next = new_node;
-  }
-  markov_chain->database->size++;
+  append_to_database (markov_chain, new_node);
   return new_node;
-}
\ No newline at end of file
+}
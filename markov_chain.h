@@ -2,9 +2,14 @@
 #define _MARKOV_CHAIN_H
 
 #include "linked_list.h"
+#include "hash_index.h"
+#include "arena.h"
+#include "rng.h"
+#include "output_buffer.h"
 #include <stdio.h>  // For printf(), sscanf()
 #include <stdlib.h> // For exit(), malloc()
 #include <stdbool.h> // for bool
+#include <stdint.h> // for uint32_t
 
 #define ALLOCATION_ERROR_MASSAGE \
 "Allocation failure: Failed to allocate new memory\n"
@@ -23,31 +28,168 @@
 /*        STRUCTS          */
 /***************************/
 typedef void (*Print_Func) (void *);
+typedef bool (*Append_Func) (void *, OutputBuffer *);
 typedef int (*Comp_Func) (void *, void *);
+typedef size_t (*Hash_Func) (void *);
 typedef void (*Free_Data) (void *);
 typedef void *(*Copy_Func) (void *);
+typedef void *(*Arena_Copy_Func) (void *, Arena *);
 typedef bool (*Is_Last) (void *);
+typedef size_t (*Serialize_Func) (void *, unsigned char *, size_t);
+typedef void *(*Deserialize_Func) (const unsigned char *, size_t, Arena *);
+typedef void *(*Translate_Func) (void *, void *);
+
+/**
+ * Timers of MarkovStats, started and stopped by the chain's user around
+ * its phases with markov_chain_timer_start and markov_chain_timer_stop.
+ */
+typedef enum MarkovTimer {
+    MARKOV_TIMER_TRAINING,
+    MARKOV_TIMER_GENERATION,
+    MARKOV_TIMER_COUNT
+} MarkovTimer;
+
+/**
+ * Hot path counters and phase timers of a chain. They are only updated when
+ * the library is built with MARKOV_STATS defined (make STATS=1), and cost
+ * nothing otherwise. They are not atomic: a chain read by several threads
+ * at once loses counts.
+ */
+typedef struct MarkovStats {
+    uint64_t comp_calls; // comp_func calls of database lookups
+    uint64_t database_lookups; // calls to get_node_from_database or
+                               // add_to_database
+    uint64_t database_scan_length; // nodes or index slots they looked at
+    uint64_t next_node_draws; // calls to get_next_random_node
+    uint64_t alias_draws; // of them, the ones drawn from an alias table
+    uint64_t counter_scan_length; // counters scanned by the other ones
+    uint64_t counter_list_reallocs; // counter list growths
+    uint64_t counter_index_builds;
+    uint64_t bytes_allocated; // for nodes, counter lists, counter indices
+                              // and alias tables
+    uint64_t timer_ns[MARKOV_TIMER_COUNT]; // time spent in each phase
+    uint64_t timer_started_ns[MARKOV_TIMER_COUNT];
+} MarkovStats;
+
+#ifdef MARKOV_STATS
+#define MARKOV_STATS_ADD(markov_chain, counter, amount) \
+((markov_chain)->stats.counter += (uint64_t) (amount))
+#else
+#define MARKOV_STATS_ADD(markov_chain, counter, amount) ((void) 0)
+#endif
+
+typedef struct AliasEntry {
+    size_t threshold; // draws below it keep the column, others take alias
+    size_t alias;
+} AliasEntry;
+
+/**
+ * Walker/Vose alias table over a counter list, for O(1) next state draws.
+ * Column i is chosen uniformly, then kept with probability threshold / sum.
+ */
+typedef struct AliasTable {
+    size_t sum; // the counter_list_sum the table was built for
+    size_t size;
+    AliasEntry entries[];
+} AliasTable;
 
 typedef struct MarkovNode {
     void *data;
     struct NextNodeCounter *counter_list;
     size_t counter_list_size;
     size_t counter_list_sum;
+    size_t id; // position of the node in the chain's states array
+
+    // the chain the node belongs to, whose states array resolves the ids in
+    // counter_list
+    struct MarkovChain *chain;
+
+    // number of NextNodeCounter slots allocated for counter_list, grows
+    // geometrically.
+    size_t counter_list_capacity;
+
+    // open addressing index from next state to its position in counter_list
+    // plus one (0 marks an empty slot). Built only for high fanout nodes,
+    // NULL while the counter list is short enough to scan.
+    uint32_t *counter_index;
+    size_t counter_index_capacity;
+
+    // alias table built by freeze_sampling, NULL if never built. It is used
+    // only while its sum matches counter_list_sum, i.e. while the counter
+    // list did not change since the last freeze.
+    AliasTable *alias;
+
+    // copy of the counter list published to the readers of an OnlineChain,
+    // NULL if none
+    struct NodeSnapshot *snapshot;
 } MarkovNode;
 
+/**
+ * A transition in a counter list: the id of the next state, i.e. its
+ * position in the chain's states array, and how many times it was seen.
+ */
 typedef struct NextNodeCounter {
-    struct MarkovNode *next_word;
-    int frequency;
+    uint32_t next_id;
+    uint32_t frequency;
 } NextNodeCounter;
 
+/**
+ * Read only compressed sparse row form of a trained chain, built by
+ * freeze_markov_chain. States are identified by their ids, the next states
+ * of state i are next_ids[offsets[i]] .. next_ids[offsets[i + 1] - 1], and
+ * cumulative holds the running sum of their frequencies within the row.
+ */
+typedef struct FrozenChain {
+    size_t state_count;
+    MarkovNode **states; // states[i] is the MarkovNode with id i
+    size_t *offsets; // state_count + 1 row offsets
+    uint32_t *next_ids;
+    uint64_t *cumulative;
+    bool *is_last; // is_last[i] caches the chain's is_last of state i
+    uint32_t *start_ids; // ids of the chain's start states
+    size_t start_count;
+} FrozenChain;
+
 /* DO NOT ADD or CHANGE variable names in this struct */
+/* The course fields (database, print_func, comp_func, free_data, copy_func
+ * and is_last) keep their names and meaning. The other fields are
+ * additions of this library on top of that contract, and code written
+ * against the course struct must not depend on them. */
 typedef struct MarkovChain {
     LinkedList *database;
 
+    // hash index over the database nodes, maintained by add_to_database when
+    // hash_func is set. NULL until the first state is added.
+    HashIndex *index;
+
+    // contiguous array of all the database states, in insertion order.
+    // states[i] is the MarkovNode of the i'th database node.
+    MarkovNode **states;
+    size_t states_capacity;
+
+    // states that are valid sequence starts: not last and with at least one
+    // next state. A node joins when it gets its first next state.
+    MarkovNode **start_states;
+    size_t start_states_size;
+    size_t start_states_capacity;
+
+    // CSR form of the chain built by freeze_markov_chain, NULL if it was
+    // never frozen. It does not follow updates made after the freeze.
+    FrozenChain *frozen;
+
     // pointer to a func that receives data from a generic type and prints it
     // returns void.
     Print_Func print_func;
 
+    // optional pointer to a func that appends the same text print_func
+    // prints to an output buffer. returns false in case of I/O or
+    // allocation error.
+    Append_Func append_func;
+
+    // buffer generate_random_sequence appends to through append_func
+    // instead of printing, NULL to print. Owned by the caller.
+    OutputBuffer *output;
+
     // pointer to a func that gets 2 pointers of generic data type(same one)
     // and compare between them */
     // returns: - a positive value if the first is bigger
@@ -55,6 +197,11 @@ typedef struct MarkovChain {
     //          - 0 if equal
     Comp_Func comp_func;
 
+    // optional pointer to a func that gets a pointer of generic data type and
+    // returns its hash. Equal data (by comp_func) must have equal hashes.
+    // If NULL, the database is searched linearly.
+    Hash_Func hash_func;
+
     // a pointer to a function that gets a pointer of generic data type and
     // frees it.
     // returns void.
@@ -70,32 +217,113 @@ typedef struct MarkovChain {
     //      - true if it's the last state.
     //      - false otherwise.
     Is_Last is_last;
+
+    // optional arena that nodes, counter lists, counter indices and alias
+    // tables are allocated from, released at once by free_markov_chain.
+    // If NULL, everything is allocated on the heap one by one.
+    Arena *arena;
+
+    // optional pointer to a function that gets a pointer of generic data
+    // type and an arena and returns a copy of it allocated from the arena.
+    // Used instead of copy_func when the chain has an arena, in which case
+    // free_data is not called on the copies.
+    Arena_Copy_Func arena_copy;
+
+    // optional pointer to a function that gets a pointer of generic data
+    // type, a buffer and its capacity, writes the data's bytes to the buffer
+    // if they fit and returns their number. Used by save_markov_chain.
+    Serialize_Func serialize;
+
+    // optional pointer to a function that gets bytes written by serialize,
+    // their number and the chain's arena, and returns the data they encode,
+    // owned like the copies of arena_copy (or copy_func if arena_copy is
+    // NULL). Used by load_markov_chain.
+    Deserialize_Func deserialize;
+
+    // counters and timers, zeroed when the chain is created and read with
+    // markov_chain_stats
+    MarkovStats stats;
 } MarkovChain;
 
 /**
  * Get one random state from the given markov_chain's database.
  * @param markov_chain
+ * @param rng generator to draw from
  * @return
  */
-MarkovNode* get_first_random_node(MarkovChain *markov_chain);
+MarkovNode* get_first_random_node(MarkovChain *markov_chain, Rng *rng);
+
+/**
+ * Get one random state out of the states that can start a sequence, i.e.
+ * not last states that have at least one next state.
+ * @param markov_chain
+ * @param rng generator to draw from
+ * @return MarkovNode of the chosen state, NULL if the chain has no such
+ * state
+ */
+MarkovNode* get_random_start_node(MarkovChain *markov_chain, Rng *rng);
 
 /**
  * Choose randomly the next state, depend on it's occurrence frequency.
  * @param state_struct_ptr MarkovNode to choose from
+ * @param rng generator to draw from
  * @return MarkovNode of the chosen state
  */
-MarkovNode* get_next_random_node(MarkovNode *state_struct_ptr);
+MarkovNode* get_next_random_node(MarkovNode *state_struct_ptr, Rng *rng);
+
+/**
+ * Build alias tables for every node whose counter list changed since the
+ * last freeze, so that get_next_random_node and get_next_random_state draw
+ * in O(1) for them. Nodes updated after the call fall back to a linear
+ * scan, or a binary search, until the next freeze.
+ * @param markov_chain
+ * @return true on success, false in case of allocation error
+ */
+bool freeze_sampling(MarkovChain *markov_chain);
+
+/**
+ * Compact the chain into its CSR form in markov_chain->frozen, replacing a
+ * previous one. The mutable API keeps working for more training, after
+ * which the chain should be frozen again.
+ * @param markov_chain
+ * @return true on success, false in case of allocation error
+ */
+bool freeze_markov_chain(MarkovChain *markov_chain);
+
+/**
+ * Get the id of a random start state of a frozen chain.
+ * @param frozen frozen chain with at least one start state
+ * @param rng generator to draw from
+ * @return id of the chosen state
+ */
+size_t get_random_start_state(const FrozenChain *frozen, Rng *rng);
+
+/**
+ * Choose randomly the next state of a frozen chain, depend on it's
+ * occurrence frequency. Drawn from the state's alias table if
+ * freeze_sampling built one for the frozen counter list, by binary search
+ * in the cumulative frequencies otherwise.
+ * @param frozen the frozen chain
+ * @param state id of a state with at least one next state
+ * @param rng generator to draw from
+ * @return id of the chosen state
+ */
+size_t get_next_random_state(const FrozenChain *frozen, size_t state,
+                             Rng *rng);
 
 /**
  * Receive markov_chain, generate and print random sentence out of it. The
- * sentence most have at least 2 words in it.
+ * sentence most have at least 2 words in it. If the chain has an output
+ * buffer and an append_func, the sentence is appended to the buffer
+ * instead.
  * @param markov_chain
  * @param first_node markov_node to start with, if NULL- choose
  * a random markov_node
  * @param  max_length maximum length of chain to generate
+ * @param rng generator to draw from
  */
 void generate_random_sequence(MarkovChain *markov_chain, MarkovNode *
-first_node, int max_length);
+first_node, int max_length, Rng *rng);
 
 /**
  * Free markov_chain and all of it's content from memory
@@ -115,6 +343,67 @@ void free_markov_chain(MarkovChain **markov_chain);
 bool add_node_to_counter_list(MarkovNode *first_node, MarkovNode
 *second_node, MarkovChain *markov_chain);
 
+/**
+ * Add all the states and transitions of another chain to the chain,
+ * summing the frequencies of transitions both have. States new to the
+ * chain are appended in the other chain's order, so merging the chains of
+ * consecutive parts of a corpus in order gives the chain of the whole
+ * corpus, up to the transitions between the parts.
+ * @param markov_chain the chain to merge into
+ * @param other the chain to merge, left unchanged
+ * @param translate pointer to a func that gets a state of other and the
+ * context and returns the equal state to look up in markov_chain, NULL to
+ * use the states of other as they are
+ * @param context passed to translate
+ * @return true on success, false in case of allocation error
+ */
+bool merge_markov_chain(MarkovChain *markov_chain, MarkovChain *other,
+                        Translate_Func translate, void *context);
+
+/**
+ * Age the chain's counts: shift every transition frequency right by shift
+ * bits, which drops the transitions seen fewer than 2^shift times, then
+ * rebuild the chain without the states left with no transition in or out.
+ * The kept states keep their order, in a new database, index and arena, so
+ * the memory of the dropped ones is given back. Run repeatedly on a chain
+ * trained on an endless stream, it bounds the chain's size while recent
+ * transitions outweigh old ones. Nodes, frozen forms and snapshots of the
+ * chain taken before the call are no longer valid after it.
+ * @param markov_chain the chain to decay
+ * @param shift number of bits to shift the frequencies by
+ * @param translate pointer to a func that gets a kept state and the context
+ * and returns the state to store in the rebuilt chain, NULL to keep the
+ * states as they are
+ * @param context passed to translate
+ * @return true on success, false in case of allocation error, in which case
+ * the chain is left as it was
+ */
+bool decay_markov_chain(MarkovChain *markov_chain, unsigned shift,
+                        Translate_Func translate, void *context);
+
+/**
+ * Drop the rare transitions of the chain and the states no walk can reach
+ * anymore, trading a little fidelity for memory and faster next state
+ * draws. A node keeps its transitions seen at least min_count times, and
+ * of those only the top_k most frequent, ties going to the ones seen
+ * first. The kept states are those reachable from a start state that still
+ * has a transition. The chain is rebuilt as by decay_markov_chain, with
+ * counter lists allocated to their exact size and their sums recomputed.
+ * Nodes, frozen forms and snapshots of the chain taken before the call are
+ * no longer valid after it.
+ * @param markov_chain the chain to prune
+ * @param min_count least frequency of a kept transition, 0 or 1 to keep
+ * them all
+ * @param top_k most transitions kept per node, 0 for no limit
+ * @param bytes_reclaimed if not NULL, set to the number of bytes of nodes,
+ * counter lists, indices and tables the pruning gave back, not counting
+ * the states' data
+ * @return true on success, false in case of allocation error, in which case
+ * the chain is left as it was
+ */
+bool prune_markov_chain(MarkovChain *markov_chain, uint32_t min_count,
+                        size_t top_k, size_t *bytes_reclaimed);
+
 /**
 * Check if data_ptr is in database. If so, return the markov_node
  * wrapping it in
@@ -135,4 +424,60 @@ Node* get_node_from_database(MarkovChain *markov_chain, void *data_ptr);
  */
 Node* add_to_database(MarkovChain *markov_chain, void *data_ptr);
 
+/**
+ * Write the chain to a binary snapshot file: a versioned header, CSR style
+ * next state offsets, next state ids and frequencies, the start states and
+ * the states' data written by the chain's serialize function.
+ * @param markov_chain the chain to save, with a serialize function
+ * @param path path of the snapshot file to write
+ * @return true on success, false in case of I/O or allocation error
+ */
+bool save_markov_chain(MarkovChain *markov_chain, const char *path);
+
+/**
+ * Load a snapshot written by save_markov_chain into an empty chain that has
+ * its callbacks set, including deserialize. The file is memory mapped and
+ * all the nodes and counter lists are carved out of the chain's arena in
+ * bulk, creating the arena if the chain has none.
+ * @param markov_chain the empty chain to load into
+ * @param path path of the snapshot file to read
+ * @return true on success, false if the file is not a valid snapshot or in
+ * case of I/O or allocation error
+ */
+bool load_markov_chain(MarkovChain *markov_chain, const char *path);
+
+/**
+ * Get the counters and timers of the chain, including the probes of its
+ * hash index.
+ * @param markov_chain the chain
+ * @param stats set to the chain's statistics, zeroed if they are disabled
+ * @return true if the library was built with MARKOV_STATS, false otherwise
+ */
+bool markov_chain_stats(const MarkovChain *markov_chain, MarkovStats *stats);
+
+/**
+ * Print the statistics of markov_chain_stats one per line, as name and
+ * value, or a note if they are disabled.
+ * @param markov_chain the chain
+ * @param stream stream to print to
+ */
+void print_markov_chain_stats(const MarkovChain *markov_chain,
+                              FILE *stream);
+
+/**
+ * Start timing a phase of the chain's use. Does nothing without
+ * MARKOV_STATS.
+ * @param markov_chain the chain
+ * @param timer the phase
+ */
+void markov_chain_timer_start(MarkovChain *markov_chain, MarkovTimer timer);
+
+/**
+ * Add the time since the matching markov_chain_timer_start to the phase's
+ * timer. Does nothing without MARKOV_STATS.
+ * @param markov_chain the chain
+ * @param timer the phase
+ */
+void markov_chain_timer_stop(MarkovChain *markov_chain, MarkovTimer timer);
+
 #endif /* MARKOV_CHAIN_H */
\ No newline at end of file
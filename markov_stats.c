@@ -0,0 +1,84 @@
+#define _POSIX_C_SOURCE 200809L // For clock_gettime()
+#include "markov_chain.h"
+#include <string.h> // For memset()
+#include <time.h>
+
+#ifdef MARKOV_STATS
+static uint64_t now_ns(void)
+{
+  struct timespec time;
+  clock_gettime (CLOCK_MONOTONIC, &time);
+  return (uint64_t) time.tv_sec * 1000000000ULL + (uint64_t) time.tv_nsec;
+}
+#endif
+
+bool markov_chain_stats(const MarkovChain *markov_chain, MarkovStats *stats)
+{
+#ifdef MARKOV_STATS
+  *stats = markov_chain->stats;
+  if (markov_chain->index)
+  {
+    stats->database_scan_length += markov_chain->index->probes;
+    stats->comp_calls += markov_chain->index->comparisons;
+  }
+  return true;
+#else
+  (void) markov_chain;
+  memset (stats, 0, sizeof (MarkovStats));
+  return false;
+#endif
+}
+
+void print_markov_chain_stats(const MarkovChain *markov_chain,
+                              FILE *stream)
+{
+  MarkovStats stats;
+  if (!markov_chain_stats (markov_chain, &stats))
+  {
+    fprintf (stream, "Statistics are disabled, build with STATS=1.\n");
+    return;
+  }
+  fprintf (stream, "comp_calls %llu\n"
+                   "database_lookups %llu\n"
+                   "database_scan_length %llu\n"
+                   "next_node_draws %llu\n"
+                   "alias_draws %llu\n"
+                   "counter_scan_length %llu\n"
+                   "counter_list_reallocs %llu\n"
+                   "counter_index_builds %llu\n"
+                   "bytes_allocated %llu\n"
+                   "training_ns %llu\n"
+                   "generation_ns %llu\n",
+           (unsigned long long) stats.comp_calls,
+           (unsigned long long) stats.database_lookups,
+           (unsigned long long) stats.database_scan_length,
+           (unsigned long long) stats.next_node_draws,
+           (unsigned long long) stats.alias_draws,
+           (unsigned long long) stats.counter_scan_length,
+           (unsigned long long) stats.counter_list_reallocs,
+           (unsigned long long) stats.counter_index_builds,
+           (unsigned long long) stats.bytes_allocated,
+           (unsigned long long) stats.timer_ns[MARKOV_TIMER_TRAINING],
+           (unsigned long long) stats.timer_ns[MARKOV_TIMER_GENERATION]);
+}
+
+void markov_chain_timer_start(MarkovChain *markov_chain, MarkovTimer timer)
+{
+#ifdef MARKOV_STATS
+  markov_chain->stats.timer_started_ns[timer] = now_ns ();
+#else
+  (void) markov_chain;
+  (void) timer;
+#endif
+}
+
+void markov_chain_timer_stop(MarkovChain *markov_chain, MarkovTimer timer)
+{
+#ifdef MARKOV_STATS
+  markov_chain->stats.timer_ns[timer] +=
+      now_ns () - markov_chain->stats.timer_started_ns[timer];
+#else
+  (void) markov_chain;
+  (void) timer;
+#endif
+}
@@ -0,0 +1,311 @@
+#include "online_chain.h"
+#include <string.h> // For memcpy()
+
+#define MIN_ARRAY_CAPACITY 64
+
+/* Shared words are read and written with the GCC atomic builtins: a
+ * release store publishes everything written before it to the acquire
+ * loads that see the stored value. */
+#define LOAD_ACQUIRE(pointer) __atomic_load_n (pointer, __ATOMIC_ACQUIRE)
+#define STORE_RELEASE(pointer, value) \
+__atomic_store_n (pointer, value, __ATOMIC_RELEASE)
+#define FULL_FENCE() __atomic_thread_fence (__ATOMIC_SEQ_CST)
+
+/**
+ * Make room for one more element in a growable array.
+ * @return false in case of allocation error
+ */
+static bool reserve(void **array, size_t size, size_t *capacity,
+                    size_t element_size)
+{
+  if (size < *capacity) return true;
+  size_t new_capacity = *capacity ? *capacity * 2 : MIN_ARRAY_CAPACITY;
+  void *tmp = realloc (*array, new_capacity * element_size);
+  if (!tmp) return false;
+  *array = tmp;
+  *capacity = new_capacity;
+  return true;
+}
+
+/**
+ * Copy the counter list of a node into a new snapshot.
+ * @return the snapshot, NULL in case of allocation error
+ */
+static NodeSnapshot *take_snapshot(MarkovChain *markov_chain,
+                                   MarkovNode *node)
+{
+  NodeSnapshot *snapshot = malloc (sizeof (NodeSnapshot)
+                                   + node->counter_list_size
+                                     * sizeof (SnapshotEntry));
+  if (!snapshot) return NULL;
+  uint64_t cumulative = 0;
+  for (size_t i = 0; i < node->counter_list_size; ++i)
+  {
+    cumulative += node->counter_list[i].frequency;
+    snapshot->entries[i].next =
+        markov_chain->states[node->counter_list[i].next_id];
+    snapshot->entries[i].cumulative = cumulative;
+  }
+  snapshot->size = node->counter_list_size;
+  snapshot->sum = cumulative;
+  return snapshot;
+}
+
+/**
+ * Queue memory replaced in the current epoch to be freed later.
+ * @return false in case of allocation error
+ */
+static bool retire(OnlineChain *online, void *memory)
+{
+  if (!memory) return true;
+  if (!reserve ((void **) &online->retired, online->retired_size,
+                &online->retired_capacity, sizeof (Retired)))
+  {
+    return false;
+  }
+  online->retired[online->retired_size++] = (Retired) {memory,
+                                                       online->epoch};
+  return true;
+}
+
+/**
+ * Start a new epoch and free the retired memory of the epochs no reader is
+ * in anymore. A reader that entered in an older epoch may still hold it,
+ * while one that entered later only sees what was published before.
+ */
+static void reclaim(OnlineChain *online)
+{
+  // the fence orders the publishing stores before the epoch change and the
+  // reads of the reader epochs, against the fence of online_read_begin
+  FULL_FENCE ();
+  STORE_RELEASE (&online->epoch, online->epoch + 1);
+  FULL_FENCE ();
+  uint64_t oldest = ONLINE_IDLE;
+  size_t readers = LOAD_ACQUIRE (&online->reader_count);
+  for (size_t i = 0; i < readers && i < online->reader_capacity; ++i)
+  {
+    uint64_t epoch = LOAD_ACQUIRE (online->reader_epochs + i);
+    if (epoch < oldest) oldest = epoch;
+  }
+  size_t kept = 0;
+  for (size_t i = 0; i < online->retired_size; ++i)
+  {
+    if (online->retired[i].epoch < oldest) free (online->retired[i].memory);
+    else online->retired[kept++] = online->retired[i];
+  }
+  online->retired_size = kept;
+}
+
+/**
+ * Publish the start states the chain got since the last publish.
+ * @return false in case of allocation error
+ */
+static bool publish_starts(OnlineChain *online)
+{
+  MarkovChain *markov_chain = online->markov_chain;
+  StartSnapshot *starts = online->starts;
+  size_t size = markov_chain->start_states_size;
+  if (starts && size <= starts->size) return true;
+  if (starts && size <= starts->capacity)
+  {
+    memcpy (starts->nodes + starts->size,
+            markov_chain->start_states + starts->size,
+            (size - starts->size) * sizeof (MarkovNode *));
+    STORE_RELEASE (&starts->size, size);
+    return true;
+  }
+
+  size_t capacity = starts ? starts->capacity : MIN_ARRAY_CAPACITY;
+  while (capacity < size) capacity *= 2;
+  StartSnapshot *copy = malloc (sizeof (StartSnapshot)
+                                + capacity * sizeof (MarkovNode *));
+  if (!copy || !retire (online, starts))
+  {
+    free (copy);
+    return false;
+  }
+  if (size)
+  {
+    memcpy (copy->nodes, markov_chain->start_states,
+            size * sizeof (MarkovNode *));
+  }
+  copy->size = size;
+  copy->capacity = capacity;
+  STORE_RELEASE (&online->starts, copy);
+  return true;
+}
+
+/**
+ * Publish the dirty nodes and the start states, with the writer lock held.
+ * @return false in case of allocation error
+ */
+static bool publish_locked(OnlineChain *online)
+{
+  bool success = true;
+  for (size_t i = 0; success && i < online->dirty_size; ++i)
+  {
+    MarkovNode *node = online->dirty[i];
+    NodeSnapshot *old = node->snapshot;
+    if (old && old->sum == node->counter_list_sum) continue;
+    NodeSnapshot *snapshot = take_snapshot (online->markov_chain, node);
+    success = snapshot && retire (online, old);
+    if (success) STORE_RELEASE (&node->snapshot, snapshot);
+    else free (snapshot);
+  }
+  // on failure the published nodes are skipped by the next publish
+  if (success) online->dirty_size = 0;
+  success = success && publish_starts (online);
+  reclaim (online);
+  return success;
+}
+
+/**
+ * Remember that the counter list of a node changed.
+ * @return false in case of allocation error
+ */
+static bool mark_dirty(OnlineChain *online, MarkovNode *node)
+{
+  if (!reserve ((void **) &online->dirty, online->dirty_size,
+                &online->dirty_capacity, sizeof (MarkovNode *)))
+  {
+    return false;
+  }
+  online->dirty[online->dirty_size++] = node;
+  return true;
+}
+
+bool online_chain_init(OnlineChain *online, MarkovChain *markov_chain,
+                       size_t max_readers)
+{
+  memset (online, 0, sizeof (OnlineChain));
+  online->markov_chain = markov_chain;
+  online->reader_capacity = max_readers;
+  online->reader_epochs = malloc ((max_readers + 1) * sizeof (uint64_t));
+  if (!online->reader_epochs || pthread_mutex_init (&online->writer_lock,
+                                                    NULL))
+  {
+    free (online->reader_epochs);
+    fprintf (stderr, ALLOCATION_ERROR_MASSAGE);
+    return false;
+  }
+  for (size_t i = 0; i < max_readers; ++i)
+  {
+    online->reader_epochs[i] = ONLINE_IDLE;
+  }
+  bool success = true;
+  for (int i = 0; success && i < markov_chain->database->size; ++i)
+  {
+    if (markov_chain->states[i]->counter_list_size > 0)
+    {
+      success = mark_dirty (online, markov_chain->states[i]);
+    }
+  }
+  if (!success || !publish_locked (online))
+  {
+    fprintf (stderr, ALLOCATION_ERROR_MASSAGE);
+    online_chain_free (online);
+    return false;
+  }
+  return true;
+}
+
+bool online_chain_append(OnlineChain *online, void **states, size_t count)
+{
+  MarkovChain *markov_chain = online->markov_chain;
+  pthread_mutex_lock (&online->writer_lock);
+  bool success = true;
+  MarkovNode *previous = NULL;
+  for (size_t i = 0; success && i < count; ++i)
+  {
+    Node *node = add_to_database (markov_chain, states[i]);
+    success = node != NULL;
+    if (success && previous)
+    {
+      success = add_node_to_counter_list (previous, node->data, markov_chain)
+                && mark_dirty (online, previous);
+    }
+    if (success)
+    {
+      previous = markov_chain->is_last (node->data->data) ? NULL
+                                                           : node->data;
+    }
+  }
+  pthread_mutex_unlock (&online->writer_lock);
+  if (!success) fprintf (stderr, ALLOCATION_ERROR_MASSAGE);
+  return success;
+}
+
+bool online_chain_publish(OnlineChain *online)
+{
+  pthread_mutex_lock (&online->writer_lock);
+  bool success = publish_locked (online);
+  pthread_mutex_unlock (&online->writer_lock);
+  if (!success) fprintf (stderr, ALLOCATION_ERROR_MASSAGE);
+  return success;
+}
+
+bool online_chain_register_reader(OnlineChain *online, size_t *reader)
+{
+  size_t id = __atomic_fetch_add (&online->reader_count, 1,
+                                  __ATOMIC_ACQ_REL);
+  if (id >= online->reader_capacity) return false;
+  *reader = id;
+  return true;
+}
+
+void online_read_begin(OnlineChain *online, size_t reader)
+{
+  __atomic_store_n (online->reader_epochs + reader,
+                    LOAD_ACQUIRE (&online->epoch), __ATOMIC_RELAXED);
+  // the reader's epoch must be visible before it reads any snapshot
+  FULL_FENCE ();
+}
+
+void online_read_end(OnlineChain *online, size_t reader)
+{
+  STORE_RELEASE (online->reader_epochs + reader, ONLINE_IDLE);
+}
+
+MarkovNode *online_get_start_node(OnlineChain *online, Rng *rng)
+{
+  StartSnapshot *starts = LOAD_ACQUIRE (&online->starts);
+  size_t size = starts ? LOAD_ACQUIRE (&starts->size) : 0;
+  if (size == 0) return NULL;
+  return starts->nodes[rng_below (rng, size)];
+}
+
+MarkovNode *online_get_next_node(MarkovNode *node, Rng *rng)
+{
+  NodeSnapshot *snapshot = LOAD_ACQUIRE (&node->snapshot);
+  if (!snapshot || snapshot->size == 0) return NULL;
+  uint64_t r = rng_below (rng, snapshot->sum);
+  // first entry whose cumulative frequency is above r
+  size_t low = 0, high = snapshot->size - 1;
+  while (low < high)
+  {
+    size_t middle = low + (high - low) / 2;
+    if (snapshot->entries[middle].cumulative > r) high = middle;
+    else low = middle + 1;
+  }
+  return snapshot->entries[low].next;
+}
+
+void online_chain_free(OnlineChain *online)
+{
+  MarkovChain *markov_chain = online->markov_chain;
+  for (int i = 0; markov_chain && i < markov_chain->database->size; ++i)
+  {
+    free (markov_chain->states[i]->snapshot);
+    markov_chain->states[i]->snapshot = NULL;
+  }
+  for (size_t i = 0; i < online->retired_size; ++i)
+  {
+    free (online->retired[i].memory);
+  }
+  free (online->retired);
+  free (online->starts);
+  free (online->dirty);
+  free (online->reader_epochs);
+  pthread_mutex_destroy (&online->writer_lock);
+  memset (online, 0, sizeof (OnlineChain));
+}
@@ -0,0 +1,158 @@
+#ifndef _ONLINE_CHAIN_H_
+#define _ONLINE_CHAIN_H_
+#include "markov_chain.h"
+#include <pthread.h>
+
+/**
+ * A next state of a NodeSnapshot, with the running sum of the frequencies
+ * up to it.
+ */
+typedef struct SnapshotEntry {
+    MarkovNode *next;
+    uint64_t cumulative;
+} SnapshotEntry;
+
+/**
+ * Immutable copy of a node's counter list, published to readers. A new copy
+ * replaces it whenever the list changes, and it is freed once no reader
+ * can hold it anymore.
+ */
+typedef struct NodeSnapshot {
+    size_t size;
+    uint64_t sum;
+    SnapshotEntry entries[];
+} NodeSnapshot;
+
+/**
+ * The start states published to readers. Entries below size never change,
+ * so new start states are written past it and size is raised after them,
+ * until a bigger copy replaces the whole array.
+ */
+typedef struct StartSnapshot {
+    size_t size;
+    size_t capacity;
+    MarkovNode *nodes[];
+} StartSnapshot;
+
+/**
+ * Memory a writer replaced, waiting for the readers that may see it.
+ */
+typedef struct Retired {
+    void *memory;
+    uint64_t epoch; // the epoch it was replaced in
+} Retired;
+
+/**
+ * A chain trained and sampled at the same time. Writers add states and
+ * transitions to the chain under a lock, and publish copies of the
+ * changed counter lists. Readers never lock: they sample the published
+ * copies, which never change, inside read sections that keep the copies
+ * they may hold from being freed (epoch based reclamation).
+ */
+typedef struct OnlineChain {
+    MarkovChain *markov_chain; // only used under writer_lock
+    pthread_mutex_t writer_lock;
+
+    // nodes whose counter list changed since the last publish, possibly
+    // more than once
+    MarkovNode **dirty;
+    size_t dirty_size;
+    size_t dirty_capacity;
+
+    StartSnapshot *starts;
+
+    // incremented by each publish. reader_epochs[i] is the epoch reader i
+    // entered its read section in, or ONLINE_IDLE out of it.
+    uint64_t epoch;
+    uint64_t *reader_epochs;
+    size_t reader_capacity;
+    size_t reader_count;
+
+    Retired *retired;
+    size_t retired_size;
+    size_t retired_capacity;
+} OnlineChain;
+
+#define ONLINE_IDLE UINT64_MAX
+
+/**
+ * Start online use of a chain and publish its current state. The chain
+ * must not be used directly until online_chain_free.
+ * @param online the online chain to initialize
+ * @param markov_chain the chain, possibly trained already
+ * @param max_readers number of reader threads that may register
+ * @return true on success, false in case of allocation error
+ */
+bool online_chain_init(OnlineChain *online, MarkovChain *markov_chain,
+                       size_t max_readers);
+
+/**
+ * Add a sequence of states to the chain, and the transitions between
+ * consecutive ones, except after last states. Readers see them after the
+ * next online_chain_publish. May be called by several writers.
+ * @param online the online chain
+ * @param states the states, looked up and copied like add_to_database
+ * @param count number of states
+ * @return true on success, false in case of allocation error
+ */
+bool online_chain_append(OnlineChain *online, void **states, size_t count);
+
+/**
+ * Publish the changes appended since the last publish to the readers, and
+ * free the copies no reader can hold anymore.
+ * @param online the online chain
+ * @return true on success, false in case of allocation error, in which case
+ * the readers keep the previous state of the changed nodes
+ */
+bool online_chain_publish(OnlineChain *online);
+
+/**
+ * Register a reader thread.
+ * @param online the online chain
+ * @param reader set to the id of the reader, for its read sections
+ * @return false if max_readers readers are registered already
+ */
+bool online_chain_register_reader(OnlineChain *online, size_t *reader);
+
+/**
+ * Enter a read section. Nodes and states got inside it may only be used
+ * inside it.
+ * @param online the online chain
+ * @param reader id of the reader
+ */
+void online_read_begin(OnlineChain *online, size_t reader);
+
+/**
+ * Leave a read section.
+ * @param online the online chain
+ * @param reader id of the reader
+ */
+void online_read_end(OnlineChain *online, size_t reader);
+
+/**
+ * Get a random published start state, inside a read section.
+ * @param online the online chain
+ * @param rng generator to draw from
+ * @return node of the state, NULL if no start state was published. Only
+ * its data may be read.
+ */
+MarkovNode *online_get_start_node(OnlineChain *online, Rng *rng);
+
+/**
+ * Choose randomly the next state of a node from its published counter
+ * list, inside a read section.
+ * @param node node got inside the read section
+ * @param rng generator to draw from
+ * @return node of the chosen state, NULL if the node has no published
+ * next state. Only its data may be read.
+ */
+MarkovNode *online_get_next_node(MarkovNode *node, Rng *rng);
+
+/**
+ * Free the published copies and the online state, once no reader is in a
+ * read section. The chain itself is left to the caller.
+ * @param online the online chain
+ */
+void online_chain_free(OnlineChain *online);
+
+#endif //_ONLINE_CHAIN_H_
@@ -0,0 +1,101 @@
+#define _POSIX_C_SOURCE 200809L // For write()
+#include "output_buffer.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h> // For write()
+
+#define MIN_CAPACITY 64
+
+/**
+ * Write all the given bytes, retrying on short writes and interrupts.
+ * @return true on success, false in case of I/O error
+ */
+static bool write_all (int fd, const char *bytes, size_t length)
+{
+  while (length > 0)
+  {
+    ssize_t written = write (fd, bytes, length);
+    if (written < 0)
+    {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    bytes += written;
+    length -= (size_t) written;
+  }
+  return true;
+}
+
+bool output_buffer_init (OutputBuffer *out, int fd, size_t capacity)
+{
+  if (capacity < MIN_CAPACITY) capacity = MIN_CAPACITY;
+  out->data = malloc (capacity);
+  out->size = 0;
+  out->capacity = out->data ? capacity : 0;
+  out->fd = fd;
+  return out->data != NULL;
+}
+
+bool output_buffer_append (OutputBuffer *out, const char *bytes,
+                           size_t length)
+{
+  if (length > out->capacity - out->size)
+  {
+    if (out->fd >= 0)
+    {
+      if (!output_buffer_flush (out)) return false;
+      // too big to be worth a copy, write it directly
+      if (length > out->capacity) return write_all (out->fd, bytes, length);
+    }
+    else
+    {
+      size_t capacity = out->capacity;
+      while (length > capacity - out->size) capacity *= 2;
+      char *tmp = realloc (out->data, capacity);
+      if (!tmp) return false;
+      out->data = tmp;
+      out->capacity = capacity;
+    }
+  }
+  memcpy (out->data + out->size, bytes, length);
+  out->size += length;
+  return true;
+}
+
+bool output_buffer_append_string (OutputBuffer *out, const char *s)
+{
+  return output_buffer_append (out, s, strlen (s));
+}
+
+bool output_buffer_append_number (OutputBuffer *out, long number)
+{
+  char digits[24];
+  size_t start = sizeof (digits);
+  unsigned long value = number < 0 ? 0UL - (unsigned long) number
+                                   : (unsigned long) number;
+  do
+  {
+    digits[--start] = (char) ('0' + value % 10);
+    value /= 10;
+  }
+  while (value);
+  if (number < 0) digits[--start] = '-';
+  return output_buffer_append (out, digits + start, sizeof (digits) - start);
+}
+
+bool output_buffer_flush (OutputBuffer *out)
+{
+  if (out->fd < 0 || out->size == 0) return true;
+  bool success = write_all (out->fd, out->data, out->size);
+  out->size = 0;
+  return success;
+}
+
+void output_buffer_free (OutputBuffer *out)
+{
+  free (out->data);
+  out->data = NULL;
+  out->size = 0;
+  out->capacity = 0;
+}
@@ -0,0 +1,63 @@
+#ifndef _OUTPUT_BUFFER_H_
+#define _OUTPUT_BUFFER_H_
+#include <stdbool.h>
+#include <stddef.h> // For size_t
+
+/**
+ * Byte buffer generated text is appended to. With a file descriptor it is
+ * written out with a single write() whenever it fills up, otherwise it
+ * grows and keeps everything in memory.
+ */
+typedef struct OutputBuffer {
+    char *data;
+    size_t size; // bytes waiting in data
+    size_t capacity;
+    int fd; // descriptor to flush to, negative to collect in memory
+} OutputBuffer;
+
+/**
+ * Initialize an empty buffer.
+ * @param out buffer to initialize
+ * @param fd descriptor to flush to, negative to collect in memory
+ * @param capacity size of the blocks written to fd, or initial capacity
+ * @return true on success, false in case of allocation error
+ */
+bool output_buffer_init (OutputBuffer *out, int fd, size_t capacity);
+
+/**
+ * Append bytes to the buffer, flushing it first if they do not fit.
+ * @param out buffer to append to
+ * @param bytes bytes to append
+ * @param length number of bytes
+ * @return true on success, false in case of I/O or allocation error
+ */
+bool output_buffer_append (OutputBuffer *out, const char *bytes,
+                           size_t length);
+
+/**
+ * Append a null terminated string, without the terminator.
+ * @return true on success, false in case of I/O or allocation error
+ */
+bool output_buffer_append_string (OutputBuffer *out, const char *s);
+
+/**
+ * Append the decimal representation of a number.
+ * @return true on success, false in case of I/O or allocation error
+ */
+bool output_buffer_append_number (OutputBuffer *out, long number);
+
+/**
+ * Write the buffered bytes to the descriptor. Does nothing for an in
+ * memory buffer.
+ * @param out buffer to flush
+ * @return true on success, false in case of I/O error
+ */
+bool output_buffer_flush (OutputBuffer *out);
+
+/**
+ * Release the buffer's memory, without flushing it.
+ * @param out buffer to free
+ */
+void output_buffer_free (OutputBuffer *out);
+
+#endif //_OUTPUT_BUFFER_H_
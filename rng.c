@@ -0,0 +1,164 @@
+#include "rng.h"
+
+#define PCG_MULTIPLIER 6364136223846793005ULL
+#define PCG_JUMP_DRAWS (1ULL << 48)
+
+/**
+ * splitmix64 step, used to expand a seed into a full state.
+ */
+static uint64_t splitmix64 (uint64_t *x)
+{
+  uint64_t z = (*x += 0x9E3779B97F4A7C15ULL);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return z ^ (z >> 31);
+}
+
+static uint64_t rotl (uint64_t x, int k)
+{
+  return (x << k) | (x >> (64 - k));
+}
+
+static uint64_t xoshiro_next (Rng *rng)
+{
+  uint64_t *s = rng->state;
+  uint64_t result = rotl (s[1] * 5, 7) * 9;
+  uint64_t t = s[1] << 17;
+  s[2] ^= s[0];
+  s[3] ^= s[1];
+  s[1] ^= s[2];
+  s[0] ^= s[3];
+  s[2] ^= t;
+  s[3] = rotl (s[3], 45);
+  return result;
+}
+
+static void xoshiro_jump (Rng *rng)
+{
+  static const uint64_t jump[] = {0x180EC6D33CFD0ABAULL,
+                                  0xD5A61266F0C9392CULL,
+                                  0xA9582618E03FC9AAULL,
+                                  0x39ABDC4529B1661CULL};
+  uint64_t s[4] = {0, 0, 0, 0};
+  for (int i = 0; i < 4; ++i)
+  {
+    for (int b = 0; b < 64; ++b)
+    {
+      if (jump[i] & (1ULL << b))
+      {
+        for (int j = 0; j < 4; ++j) s[j] ^= rng->state[j];
+      }
+      xoshiro_next (rng);
+    }
+  }
+  for (int j = 0; j < 4; ++j) rng->state[j] = s[j];
+}
+
+/**
+ * One pcg32 XSH-RR step. state[0] is the LCG state, state[1] the odd
+ * increment.
+ */
+static uint32_t pcg32_next (Rng *rng)
+{
+  uint64_t old = rng->state[0];
+  rng->state[0] = old * PCG_MULTIPLIER + rng->state[1];
+  uint32_t xorshifted = (uint32_t) (((old >> 18) ^ old) >> 27);
+  uint32_t rot = (uint32_t) (old >> 59);
+  return (xorshifted >> rot) | (xorshifted << ((32 - rot) & 31));
+}
+
+static uint64_t pcg_next (Rng *rng)
+{
+  uint64_t high = pcg32_next (rng);
+  return (high << 32) | pcg32_next (rng);
+}
+
+/**
+ * Advance the LCG by PCG_JUMP_DRAWS draws in O(log) steps, composing the
+ * affine step with itself (Brown, "Random number generation with
+ * arbitrary strides").
+ */
+static void pcg_jump (Rng *rng)
+{
+  uint64_t delta = 2 * PCG_JUMP_DRAWS; // two steps per draw
+  uint64_t multiplier = PCG_MULTIPLIER, increment = rng->state[1];
+  uint64_t total_multiplier = 1, total_increment = 0;
+  while (delta)
+  {
+    if (delta & 1)
+    {
+      total_multiplier *= multiplier;
+      total_increment = total_increment * multiplier + increment;
+    }
+    increment = (multiplier + 1) * increment;
+    multiplier *= multiplier;
+    delta >>= 1;
+  }
+  rng->state[0] = total_multiplier * rng->state[0] + total_increment;
+}
+
+void rng_seed (Rng *rng, uint64_t seed)
+{
+  rng->next = xoshiro_next;
+  rng->jump = xoshiro_jump;
+  for (int i = 0; i < 4; ++i)
+  {
+    rng->state[i] = splitmix64 (&seed);
+  }
+}
+
+void rng_seed_pcg (Rng *rng, uint64_t seed)
+{
+  rng->next = pcg_next;
+  rng->jump = pcg_jump;
+  rng->state[0] = 0;
+  rng->state[1] = splitmix64 (&seed) | 1;
+  rng->state[2] = 0;
+  rng->state[3] = 0;
+  pcg32_next (rng);
+  rng->state[0] += splitmix64 (&seed);
+  pcg32_next (rng);
+}
+
+uint64_t rng_next (Rng *rng)
+{
+  return rng->next (rng);
+}
+
+void rng_jump (Rng *rng)
+{
+  rng->jump (rng);
+}
+
+/**
+ * Full 128 bit product of two 64 bit numbers, in 32 bit limbs to stay in
+ * standard C.
+ * @param low set to the low 64 bits of the product
+ * @return the high 64 bits of the product
+ */
+static uint64_t multiply_high (uint64_t a, uint64_t b, uint64_t *low)
+{
+  uint64_t a_low = (uint32_t) a, a_high = a >> 32;
+  uint64_t b_low = (uint32_t) b, b_high = b >> 32;
+  uint64_t low_low = a_low * b_low, high_low = a_high * b_low;
+  uint64_t low_high = a_low * b_high, high_high = a_high * b_high;
+  uint64_t middle = (low_low >> 32) + (uint32_t) high_low + low_high;
+  *low = (middle << 32) | (uint32_t) low_low;
+  return high_high + (high_low >> 32) + (middle >> 32);
+}
+
+uint64_t rng_below (Rng *rng, uint64_t max_number)
+{
+  uint64_t low;
+  uint64_t high = multiply_high (rng_next (rng), max_number, &low);
+  if (low < max_number)
+  {
+    // 2^64 mod max_number draws would make the low results more likely
+    uint64_t threshold = (0 - max_number) % max_number;
+    while (low < threshold)
+    {
+      high = multiply_high (rng_next (rng), max_number, &low);
+    }
+  }
+  return high;
+}
@@ -0,0 +1,66 @@
+#ifndef _RNG_H_
+#define _RNG_H_
+#include <stdint.h> // For uint64_t
+#include <stddef.h> // For size_t
+
+struct Rng;
+typedef uint64_t (*Rng_Next) (struct Rng *);
+typedef void (*Rng_Jump) (struct Rng *);
+
+/**
+ * Pseudo random generator context. Unlike rand() it is owned by its user,
+ * so every thread or walk can have its own reproducible stream. The
+ * generator is pluggable: any pair of step and jump functions over the
+ * state words can be used, rng_seed and rng_seed_pcg set up the built in
+ * ones.
+ */
+typedef struct Rng {
+    // pointer to a func that advances the state and returns 64 random bits
+    Rng_Next next;
+
+    // pointer to a func that advances the state as if next was called a
+    // huge fixed number of times, to split non overlapping streams
+    Rng_Jump jump;
+
+    uint64_t state[4];
+} Rng;
+
+/**
+ * Set up an xoshiro256** generator. Every seed gives a different, well
+ * mixed state. Jumps are 2^128 steps.
+ * @param rng generator to seed
+ * @param seed the seed
+ */
+void rng_seed (Rng *rng, uint64_t seed);
+
+/**
+ * Set up a PCG generator: two pcg32 (XSH-RR) outputs per draw. Jumps are
+ * 2^48 draws.
+ * @param rng generator to seed
+ * @param seed the seed
+ */
+void rng_seed_pcg (Rng *rng, uint64_t seed);
+
+/**
+ * @param rng generator to advance
+ * @return the next 64 random bits
+ */
+uint64_t rng_next (Rng *rng);
+
+/**
+ * Jump the generator ahead, so that a copy taken before the jump and the
+ * generator give non overlapping streams.
+ * @param rng generator to advance
+ */
+void rng_jump (Rng *rng);
+
+/**
+ * Get random number between 0 and max_number [0, max_number), without
+ * modulo bias, with Lemire's multiply and reject method.
+ * @param rng generator to draw from
+ * @param max_number maximal number to return (not including), positive
+ * @return Random number
+ */
+uint64_t rng_below (Rng *rng, uint64_t max_number);
+
+#endif //_RNG_H_
@@ -1,7 +1,13 @@
+#define _POSIX_C_SOURCE 200809L // For fileno()
 #include <string.h> // For strlen(), strcmp(), strcpy()
+#include <math.h> // For sqrt()
+#include <inttypes.h> // For PRIu64
+#include <pthread.h>
 #include "markov_chain.h"
+#include "markov_analysis.h"
 
 #define MAX(X, Y) (((X) < (Y)) ? (Y) : (X))
+#define MIN(X, Y) (((X) < (Y)) ? (X) : (Y))
 
 #define EMPTY -1
 #define BOARD_SIZE 100
@@ -9,6 +15,12 @@
 
 #define DICE_MAX 6
 #define NUM_OF_TRANSITIONS 20
+#define ARENA_BLOCK_SIZE 16384
+#define WALKS_PER_BATCH 65536
+#define OUTPUT_BLOCK_SIZE (1 << 16)
+#define ANALYSIS_MAX_MOVES 10000
+#define ANALYSIS_SHOWN_MASS 0.9999
+#define HISTOGRAM_SIZE 1024
 
 /**
  * represents the transitions by ladders and snakes in the game
@@ -47,100 +59,102 @@ typedef struct Cell {
     //both ladder_to and snake_to should be -1 if the Cell doesn't have them
 } Cell;
 
-/** Error handler **/
-static int handle_error(char *error_msg, MarkovChain **database)
-{
-  printf("%s", error_msg);
-  if (database != NULL)
-  {
-    free_markov_chain(database);
-  }
-  return EXIT_FAILURE;
-}
+/**
+ * A cell of the specialized board chain: its successors, drawn uniformly,
+ * by cell index (number - 1). A cell with a ladder or a snake has its end
+ * as single successor, and the last cell has none.
+ */
+typedef struct BoardCell {
+    uint8_t successor_count;
+    bool jump; // true if the cell has a ladder or a snake
+    uint8_t successors[DICE_MAX];
+} BoardCell;
 
+/**
+ * Fixed size chain of the board, built without allocating and small enough
+ * to stay in cache: the random walks and the games of the simulation walk
+ * it directly, and fill_database builds the generic chain from it for the
+ * analysis.
+ */
+typedef struct BoardChain {
+    BoardCell cells[BOARD_SIZE];
+} BoardChain;
 
-static int create_board(Cell *cells[BOARD_SIZE])
+/**
+ * Build the board chain from the transitions table.
+ * @param board the board to fill
+ */
+static void build_board(BoardChain *board)
 {
   for (int i = 0; i < BOARD_SIZE; i++)
   {
-    cells[i] = malloc(sizeof(Cell));
-    if (cells[i] == NULL)
+    BoardCell *cell = board->cells + i;
+    cell->successor_count = 0;
+    cell->jump = false;
+    for (int j = 1; j <= DICE_MAX && i + j < BOARD_SIZE; j++)
     {
-      for (int j = 0; j < i; j++) {
-        free(cells[j]);
-      }
-      handle_error(ALLOCATION_ERROR_MASSAGE,NULL);
-      return EXIT_FAILURE;
+      cell->successors[cell->successor_count++] = (uint8_t) (i + j);
     }
-    *(cells[i]) = (Cell) {i + 1, EMPTY, EMPTY};
   }
-
   for (int i = 0; i < NUM_OF_TRANSITIONS; i++)
   {
-    int from = transitions[i][0];
-    int to = transitions[i][1];
-    if (from < to)
-    {
-      cells[from - 1]->ladder_to = to;
-    }
-    else
-    {
-      cells[from - 1]->snake_to = to;
-    }
+    BoardCell *cell = board->cells + transitions[i][0] - 1;
+    cell->successor_count = 1;
+    cell->jump = true;
+    cell->successors[0] = (uint8_t) (transitions[i][1] - 1);
   }
-  return EXIT_SUCCESS;
 }
 
 /**
- * fills database
- * @param markov_chain
- * @return EXIT_SUCCESS or EXIT_FAILURE
+ * Get the Cell of a board cell.
+ * @param board the board
+ * @param index index of the cell, its number - 1
+ * @return the Cell
  */
-static int fill_database(MarkovChain *markov_chain)
+static Cell board_cell(const BoardChain *board, int index)
 {
-  Cell* cells[BOARD_SIZE];
-  if(create_board(cells) == EXIT_FAILURE)
+  Cell cell = {index + 1, EMPTY, EMPTY};
+  const BoardCell *board_cell = board->cells + index;
+  if (board_cell->jump && board_cell->successors[0] > index)
   {
-    return EXIT_FAILURE;
+    cell.ladder_to = board_cell->successors[0] + 1;
   }
-  MarkovNode *from_node = NULL, *to_node = NULL;
-  size_t index_to;
-  for (size_t i = 0; i < BOARD_SIZE; i++)
+  else if (board_cell->jump)
   {
-    add_to_database(markov_chain,cells[i]);
+    cell.snake_to = board_cell->successors[0] + 1;
   }
+  return cell;
+}
 
-  for (size_t i = 0; i < BOARD_SIZE; i++)
+/**
+ * fills database
+ * @param markov_chain
+ * @param board the board to build the chain of
+ * @return EXIT_SUCCESS or EXIT_FAILURE
+ */
+static int fill_database(MarkovChain *markov_chain, const BoardChain *board)
+{
+  MarkovNode *nodes[BOARD_SIZE];
+  for (int i = 0; i < BOARD_SIZE; i++)
   {
-    from_node = get_node_from_database(markov_chain,cells[i])->data;
+    Cell cell = board_cell (board, i);
+    Node *node = add_to_database (markov_chain, &cell);
+    if (!node) return EXIT_FAILURE;
+    nodes[i] = node->data;
+  }
 
-    if (cells[i]->snake_to != EMPTY || cells[i]->ladder_to != EMPTY)
-    {
-      index_to = MAX(cells[i]->snake_to,cells[i]->ladder_to) - 1;
-      to_node = get_node_from_database(markov_chain, cells[index_to])
-          ->data;
-      add_node_to_counter_list(from_node, to_node, markov_chain);
-    }
-    else
+  for (int i = 0; i < BOARD_SIZE; i++)
+  {
+    const BoardCell *cell = board->cells + i;
+    for (int j = 0; j < cell->successor_count; j++)
     {
-      for (int j = 1; j <= DICE_MAX; j++)
+      if (!add_node_to_counter_list (nodes[i], nodes[cell->successors[j]],
+                                     markov_chain))
       {
-        index_to = ((Cell*) (from_node->data))->number + j - 1;
-        if (index_to >= BOARD_SIZE)
-        {
-          break;
-        }
-        to_node = get_node_from_database(markov_chain, cells[index_to])
-            ->data;
-        add_node_to_counter_list(from_node, to_node, markov_chain);
+        return EXIT_FAILURE;
       }
     }
   }
-  // free temp arr
-  for (size_t i = 0; i < BOARD_SIZE; i++)
-  {
-    free(cells[i]);
-  }
   return EXIT_SUCCESS;
 }
 
@@ -163,11 +177,38 @@ static void print_func_cell(void *data)
   }
 }
 
+static bool append_func_cell(void *data, OutputBuffer *out)
+{
+  Cell *p = (Cell *) data;
+  bool success = output_buffer_append (out, "[", 1)
+                 && output_buffer_append_number (out, p->number);
+  if (success && p->ladder_to != EMPTY)
+  {
+    success = output_buffer_append_string (out, "]-ladder to ")
+              && output_buffer_append_number (out, p->ladder_to);
+  }
+  else if (success && p->snake_to != EMPTY)
+  {
+    success = output_buffer_append_string (out, "]-snake to ")
+              && output_buffer_append_number (out, p->snake_to);
+  }
+  else if (success)
+  {
+    success = output_buffer_append (out, "]", 1);
+  }
+  return success && output_buffer_append (out, " -> ", 4);
+}
+
 static int comp_func_cell (void *data_one, void *data_two)
 {
   return ((Cell *) data_one)->number - ((Cell *) data_two)->number;
 }
 
+static size_t hash_func_cell (void *data)
+{
+  return (size_t) ((Cell *) data)->number;
+}
+
 static void free_data_cell (void *data)
 {
   Cell *p = (Cell *) data;
@@ -186,6 +227,14 @@ static void *copy_func_cell (void *data)
   return p;
 }
 
+static void *arena_copy_cell (void *data, Arena *arena)
+{
+  Cell *p = arena_alloc (arena, sizeof (Cell));
+  if (!p) return NULL;
+  *p = *(Cell *) data;
+  return p;
+}
+
 static bool is_last_cell (void *data)
 {
   Cell *p = (Cell *) data;
@@ -195,9 +244,12 @@ static bool is_last_cell (void *data)
 
 static MarkovChain *initialize_markov_chain(
     Print_Func print_func,
+    Append_Func append_func,
     Comp_Func comp_func,
+    Hash_Func hash_func,
     Free_Data free_data,
     Copy_Func copy_func,
+    Arena_Copy_Func arena_copy,
     Is_Last is_last
 )
 {
@@ -212,77 +264,541 @@ static MarkovChain *initialize_markov_chain(
     return NULL;
   }
 
+  Arena *arena = arena_create (ARENA_BLOCK_SIZE);
+  if (!arena)
+  {
+    free (list);
+    list = NULL;
+    free (markov_chain);
+    markov_chain = NULL;
+    return NULL;
+  }
+
   list->first = NULL;
   list->last = NULL;
   list->size = 0;
   markov_chain->database = list;
+  markov_chain->index = NULL;
+  markov_chain->states = NULL;
+  markov_chain->states_capacity = 0;
+  markov_chain->start_states = NULL;
+  markov_chain->start_states_size = 0;
+  markov_chain->start_states_capacity = 0;
+  markov_chain->frozen = NULL;
   markov_chain->print_func = print_func;
+  markov_chain->append_func = append_func;
+  markov_chain->output = NULL;
   markov_chain->comp_func = comp_func;
+  markov_chain->hash_func = hash_func;
   markov_chain->free_data = free_data;
   markov_chain->copy_func = copy_func;
   markov_chain->is_last = is_last;
+  markov_chain->arena = arena;
+  markov_chain->arena_copy = arena_copy;
+  markov_chain->serialize = NULL;
+  markov_chain->deserialize = NULL;
+  memset (&markov_chain->stats, 0, sizeof (MarkovStats));
   return markov_chain;
 }
 
-void run_random_walk(MarkovChain *markov_chain)
+/**
+ * Work of one walk generation thread: a range of the walks of a batch. Walk
+ * i of the batch is stored at cells[i * MAX_GENERATION_LENGTH] as indices
+ * of board cells, and has lengths[i] cells.
+ */
+typedef struct WalkRange {
+    const BoardChain *board;
+    uint64_t seed;
+    size_t first_walk;
+    size_t walk_count;
+    uint8_t *cells;
+    uint8_t *lengths;
+} WalkRange;
+
+/**
+ * Thread entry point: generate the range's walks from the first cell on
+ * the board chain, drawing each move uniformly among the successors.
+ * @param arg the WalkRange
+ * @return NULL
+ */
+static void *run_walk_range(void *arg)
 {
-  MarkovNode *p = markov_chain->database->first->data;
-  for (int i = 0; i < MAX_GENERATION_LENGTH; ++i)
+  WalkRange *range = arg;
+  const BoardCell *cells = range->board->cells;
+  for (size_t walk = range->first_walk;
+       walk < range->first_walk + range->walk_count; ++walk)
+  {
+    Rng rng;
+    // one stream per walk, so the walks do not depend on the threads
+    rng_seed (&rng, range->seed ^ walk * 0xD1B54A32D192ED03ULL);
+    uint8_t *path = range->cells + walk * MAX_GENERATION_LENGTH;
+    uint8_t index = 0, length = 1;
+    path[0] = index;
+    while (cells[index].successor_count && length < MAX_GENERATION_LENGTH)
+    {
+      index = cells[index].successors[rng_below (
+          &rng, cells[index].successor_count)];
+      path[length++] = index;
+    }
+    range->lengths[walk] = length;
+  }
+  return NULL;
+}
+
+/**
+ * Generate a batch of walks on a pool of threads.
+ * @param board the board chain
+ * @param walk_count number of walks in the batch
+ * @param seed the seed of the batch
+ * @param thread_count number of threads to use, positive
+ * @param cells the walks' cells, of walk_count * MAX_GENERATION_LENGTH
+ * @param lengths the walks' lengths, of walk_count
+ * @return false in case of allocation or thread error
+ */
+static bool generate_walks(const BoardChain *board, size_t walk_count,
+                           uint64_t seed, size_t thread_count,
+                           uint8_t *cells, uint8_t *lengths)
+{
+  if (thread_count > walk_count) thread_count = walk_count;
+  if (thread_count == 0) thread_count = 1;
+  WalkRange *ranges = calloc (thread_count, sizeof (WalkRange));
+  pthread_t *threads = calloc (thread_count, sizeof (pthread_t));
+  bool success = ranges && threads;
+  size_t started = 0;
+  for (size_t t = 0; success && t < thread_count; ++t)
+  {
+    size_t first = walk_count * t / thread_count;
+    ranges[t] = (WalkRange) {board, seed, first,
+                             walk_count * (t + 1) / thread_count - first,
+                             cells, lengths};
+    success = !pthread_create (threads + t, NULL, run_walk_range,
+                               ranges + t);
+    if (success) started++;
+  }
+  for (size_t t = 0; t < started; ++t)
+  {
+    pthread_join (threads[t], NULL);
+  }
+  if (!success) fprintf (stdout, ALLOCATION_ERROR_MASSAGE);
+  free (ranges);
+  free (threads);
+  return success;
+}
+
+/**
+ * Append a walk of the board chain to an output buffer.
+ * @param board the board chain
+ * @param cells indices of the walk's cells
+ * @param length number of cells in the walk
+ * @param out the buffer to append to
+ * @return false in case of I/O or allocation error
+ */
+static bool append_walk(const BoardChain *board, const uint8_t *cells,
+                        size_t length, OutputBuffer *out)
+{
+  bool success = true;
+  for (size_t i = 0; success && i < length; ++i)
+  {
+    Cell cell = board_cell (board, cells[i]);
+    if (cell.number == BOARD_SIZE)
+    {
+      return output_buffer_append (out, "[", 1)
+             && output_buffer_append_number (out, cell.number)
+             && output_buffer_append (out, "]", 1);
+    }
+    success = append_func_cell (&cell, out);
+  }
+  return success;
+}
+
+/**
+ * Generate random walks from the first cell on the board chain, in batches
+ * spread over the given number of threads, and write them in order through
+ * an output buffer flushed in big blocks. The walks depend on the seed
+ * only.
+ * @param board the board chain
+ * @param num_of_walks number of walks to print
+ * @param seed the seed of the walks
+ * @param thread_count number of threads to generate with
+ * @return EXIT_SUCCESS or EXIT_FAILURE
+ */
+static int run_random_walks(const BoardChain *board, long num_of_walks,
+                            uint64_t seed, size_t thread_count)
+{
+  OutputBuffer out;
+  fflush (stdout);
+  if (!output_buffer_init (&out, fileno (stdout), OUTPUT_BLOCK_SIZE))
+  {
+    return EXIT_FAILURE;
+  }
+  size_t batch_size = num_of_walks < WALKS_PER_BATCH
+                      ? (size_t) MAX (num_of_walks, 1) : WALKS_PER_BATCH;
+  uint8_t *cells = malloc (batch_size * MAX_GENERATION_LENGTH);
+  uint8_t *lengths = malloc (batch_size);
+  bool success = cells && lengths;
+  for (long first = 0; success && first < num_of_walks;
+       first += WALKS_PER_BATCH)
   {
-    if (((Cell*)p->data)->number == BOARD_SIZE)
+    size_t count = num_of_walks - first < WALKS_PER_BATCH
+                   ? (size_t) (num_of_walks - first) : WALKS_PER_BATCH;
+    uint64_t batch_seed = seed ^ (uint64_t) first * 0x9E3779B97F4A7C15ULL;
+    success = generate_walks (board, count, batch_seed, thread_count, cells,
+                              lengths);
+    for (size_t i = 0; success && i < count; ++i)
     {
-      fprintf (stdout, "[%d]", ((Cell*)p->data)->number);
-      break;
+      success = output_buffer_append_string (&out, "Random Walk ")
+                && output_buffer_append_number (&out, first + (long) i + 1)
+                && output_buffer_append (&out, ": ", 2)
+                && append_walk (board, cells + i * MAX_GENERATION_LENGTH,
+                                lengths[i], &out)
+                && output_buffer_append (&out, "\n", 1);
     }
-    markov_chain->print_func(p->data);
-    p = get_next_random_node(p);
   }
+  if (!cells || !lengths) fprintf (stdout, ALLOCATION_ERROR_MASSAGE);
+  success = output_buffer_flush (&out) && success;
+  free (cells);
+  free (lengths);
+  output_buffer_free (&out);
+  return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+ * Print the exact statistics of the game from the first cell: the expected
+ * number of moves to the last cell from every cell, how often walks visit
+ * each cell, and the distribution of the number of moves of a game.
+ * Moves are chain moves, so taking a snake or a ladder is a move.
+ * @param markov_chain the chain of the board
+ * @return EXIT_SUCCESS or EXIT_FAILURE
+ */
+static int print_analysis(MarkovChain *markov_chain)
+{
+  AbsorbingAnalysis analysis;
+  if (!analyze_absorbing_chain (markov_chain, 0, ANALYSIS_MAX_MOVES,
+                                &analysis))
+  {
+    fprintf (stdout, ALLOCATION_ERROR_MASSAGE);
+    return EXIT_FAILURE;
+  }
+  fprintf (stdout, "Expected moves to reach %d from cell 1: %.4f\n\n",
+           BOARD_SIZE, analysis.expected_moves[0]);
+  fprintf (stdout, "Cell | Expected moves | Expected visits | "
+                   "Visit probability\n");
+  for (size_t i = 0; i < analysis.state_count; ++i)
+  {
+    Cell *cell = (Cell *) markov_chain->states[i]->data;
+    fprintf (stdout, "%d | %.4f | %.4f | %.4f\n", cell->number,
+             analysis.expected_moves[i], analysis.expected_visits[i],
+             analysis.visit_probability[i]);
+  }
+  fprintf (stdout, "\nMoves | Probability | Cumulative\n");
+  double cumulative = 0;
+  for (size_t n = 0; n < analysis.time_steps
+                     && cumulative < ANALYSIS_SHOWN_MASS; ++n)
+  {
+    cumulative += analysis.absorption_time[n];
+    if (analysis.absorption_time[n] > 0)
+    {
+      fprintf (stdout, "%zu | %.6f | %.6f\n", n, analysis.absorption_time[n],
+               cumulative);
+    }
+  }
+  free_absorbing_analysis (&analysis);
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Counters of simulated games. Each simulation thread fills its own, and
+ * they are summed at the end.
+ */
+typedef struct GameStats {
+    uint64_t games;
+    uint64_t moves; // sum of the game lengths
+    uint64_t squared_moves; // sum of the squared game lengths
+    uint64_t shortest;
+    uint64_t longest;
+
+    // histogram[n] counts the games of n moves, the last bucket the games
+    // of HISTOGRAM_SIZE - 1 moves or more
+    uint64_t histogram[HISTOGRAM_SIZE];
+
+    // hits[i] counts the times the snake or ladder of the cell with index i
+    // was taken
+    uint64_t hits[BOARD_SIZE];
+} GameStats;
+
+/**
+ * Work of one simulation thread: a range of games over the board chain.
+ */
+typedef struct Simulation {
+    const BoardChain *board;
+    uint64_t seed;
+    uint64_t first_game;
+    uint64_t game_count;
+    GameStats stats;
+} Simulation;
+
+/**
+ * Thread entry point: play the simulation's games from the first cell to
+ * the last one on the board chain.
+ * @param arg the Simulation
+ * @return NULL
+ */
+static void *run_simulation(void *arg)
+{
+  Simulation *simulation = arg;
+  const BoardCell *cells = simulation->board->cells;
+  GameStats *stats = &simulation->stats;
+  stats->shortest = UINT64_MAX;
+  for (uint64_t game = simulation->first_game;
+       game < simulation->first_game + simulation->game_count; ++game)
+  {
+    Rng rng;
+    // one stream per game, so the statistics do not depend on the threads
+    rng_seed (&rng, simulation->seed ^ game * 0xD1B54A32D192ED03ULL);
+    const BoardCell *cell = cells;
+    uint64_t moves = 0;
+    while (cell->successor_count)
+    {
+      stats->hits[cell - cells] += cell->jump;
+      cell = cells + cell->successors[rng_below (&rng,
+                                                 cell->successor_count)];
+      moves++;
+    }
+    stats->games++;
+    stats->moves += moves;
+    stats->squared_moves += moves * moves;
+    stats->shortest = moves < stats->shortest ? moves : stats->shortest;
+    stats->longest = moves > stats->longest ? moves : stats->longest;
+    stats->histogram[moves < HISTOGRAM_SIZE ? moves : HISTOGRAM_SIZE - 1]++;
+  }
+  return NULL;
+}
+
+/**
+ * Print the statistics of simulated games as tables.
+ * @param board the board chain
+ * @param stats the summed statistics of all the threads
+ */
+static void print_game_stats(const BoardChain *board, const GameStats *stats)
+{
+  double games = (double) stats->games;
+  double mean = (double) stats->moves / games;
+  double variance = stats->games < 2 ? 0
+                    : ((double) stats->squared_moves - mean * mean * games)
+                      / (games - 1);
+  fprintf (stdout, "Games: %" PRIu64 "\n", stats->games);
+  fprintf (stdout, "Moves: mean %.4f, variance %.4f, standard deviation "
+                   "%.4f, shortest %" PRIu64 ", longest %" PRIu64 "\n",
+           mean, variance, sqrt (variance), stats->shortest,
+           stats->longest);
+  fprintf (stdout, "\nMoves | Games | Share\n");
+  for (size_t n = 0; n < HISTOGRAM_SIZE; ++n)
+  {
+    if (stats->histogram[n] == 0) continue;
+    fprintf (stdout, "%zu%s | %" PRIu64 " | %.6f\n", n,
+             n == HISTOGRAM_SIZE - 1 ? "+" : "", stats->histogram[n],
+             (double) stats->histogram[n] / games);
+  }
+  fprintf (stdout, "\nCell | Jump | Hits | Hits per game\n");
+  for (int i = 0; i < BOARD_SIZE; ++i)
+  {
+    Cell cell = board_cell (board, i);
+    if (cell.ladder_to == EMPTY && cell.snake_to == EMPTY) continue;
+    fprintf (stdout, "%d | %s to %d | %" PRIu64 " | %.6f\n", cell.number,
+             cell.ladder_to != EMPTY ? "ladder" : "snake",
+             MAX (cell.ladder_to, cell.snake_to), stats->hits[i],
+             (double) stats->hits[i] / games);
+  }
+}
+
+/**
+ * Simulate games from the first cell to the last one on a pool of threads
+ * and print their statistics, without printing the games. Game i draws
+ * from its own generator seeded from seed and i, so the statistics depend
+ * on the seed only. Moves are chain moves, as in print_analysis.
+ * @param board the board chain
+ * @param game_count number of games to play
+ * @param seed the seed of the games
+ * @param thread_count number of threads to play on
+ * @return EXIT_SUCCESS or EXIT_FAILURE
+ */
+static int run_simulation_games(const BoardChain *board, uint64_t game_count,
+                                uint64_t seed, size_t thread_count)
+{
+  if (thread_count > game_count) thread_count = (size_t) game_count;
+  if (thread_count == 0) thread_count = 1;
+  Simulation *simulations = calloc (thread_count, sizeof (Simulation));
+  pthread_t *threads = calloc (thread_count, sizeof (pthread_t));
+  bool success = simulations && threads;
+  size_t started = 0;
+  for (size_t t = 0; success && t < thread_count; ++t)
+  {
+    Simulation *simulation = simulations + t;
+    simulation->board = board;
+    simulation->seed = seed;
+    simulation->first_game = game_count * t / thread_count;
+    simulation->game_count = game_count * (t + 1) / thread_count
+                             - simulation->first_game;
+    success = !pthread_create (threads + t, NULL, run_simulation, simulation);
+    if (success) started++;
+  }
+  for (size_t t = 0; t < started; ++t)
+  {
+    pthread_join (threads[t], NULL);
+  }
+
+  if (success)
+  {
+    GameStats *total = &simulations[0].stats;
+    for (size_t t = 1; t < thread_count; ++t)
+    {
+      const GameStats *stats = &simulations[t].stats;
+      total->games += stats->games;
+      total->moves += stats->moves;
+      total->squared_moves += stats->squared_moves;
+      total->shortest = MIN (total->shortest, stats->shortest);
+      total->longest = MAX (total->longest, stats->longest);
+      for (size_t n = 0; n < HISTOGRAM_SIZE; ++n)
+      {
+        total->histogram[n] += stats->histogram[n];
+      }
+      for (size_t i = 0; i < BOARD_SIZE; ++i)
+      {
+        total->hits[i] += stats->hits[i];
+      }
+    }
+    print_game_stats (board, total);
+  }
+  else
+  {
+    fprintf (stdout, ALLOCATION_ERROR_MASSAGE);
+  }
+  free (simulations);
+  free (threads);
+  return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+ * Command line flags, which may be given anywhere among the parameters.
+ */
+typedef struct Options {
+    size_t thread_count; // --threads=N: generate the walks on N threads
+    bool analyze; // --analyze: print exact statistics instead of walks
+    bool simulate; // --simulate: print statistics of the games instead
+} Options;
+
+/**
+ * Move the "--" flags out of argv into options, leaving the positional
+ * parameters in order.
+ * @param argc pointer to the number of arguments, updated.
+ * @param argv the arguments, compacted in place.
+ * @param options the options to fill.
+ * @return false if an unknown flag was given.
+ */
+static bool parse_options(int *argc, char *argv[], Options *options)
+{
+  int kept = 1;
+  *options = (Options) {1, false, false};
+  for (int i = 1; i < *argc; ++i)
+  {
+    if (strncmp (argv[i], "--", 2) != 0)
+    {
+      argv[kept++] = argv[i];
+    }
+    else if (!strncmp (argv[i], "--threads=", 10)
+             && strtol (argv[i] + 10, NULL, 10) > 0)
+    {
+      options->thread_count = (size_t) strtol (argv[i] + 10, NULL, 10);
+    }
+    else if (!strcmp (argv[i], "--analyze"))
+    {
+      options->analyze = true;
+    }
+    else if (!strcmp (argv[i], "--simulate"))
+    {
+      options->simulate = true;
+    }
+    else
+    {
+      return false;
+    }
+  }
+  argv[kept] = NULL;
+  *argc = kept;
+  return true;
 }
 
 /**
  * @param argc num of arguments
  * @param argv 1) Seed
  *             2) Number of sentences to generate
+ *             --threads=N anywhere to generate on N threads
+ *             --analyze instead of the parameters for exact statistics
+ *             --simulate to play the walks as games and print their
+ *             statistics instead of the walks
  * @return EXIT_SUCCESS or EXIT_FAILURE
  */
 int main(int argc, char *argv[])
 {
-  if (argc != 3)
+  Options options;
+  // a simulation needs at least one game to report on
+  if (!parse_options (&argc, argv, &options)
+      || (argc != 3 && !(options.analyze && argc == 1))
+      || (options.simulate && !options.analyze
+          && strtol (argv[2], NULL, 10) <= 0))
   {
     fprintf (stdout, "Usage:Something went wrong.\n"
                      "The parameters that needed:\n"
                      "1)Seed value.\n"
-                     "2)Number of sentences to generate.\n");
+                     "2)Number of sentences to generate.\n"
+                     "Flags:\n"
+                     "--threads=N Generate the walks on N threads.\n"
+                     "--analyze Print the exact game statistics instead, "
+                     "the parameters are optional.\n"
+                     "--simulate Play the walks as full games and print "
+                     "their statistics instead, for at least one game.\n");
     return EXIT_FAILURE;
   }
 
-  srand ((unsigned int)strtol(argv[1], NULL, 10));
+  BoardChain board;
+  build_board (&board);
+  if (options.simulate && !options.analyze)
+  {
+    return run_simulation_games (&board, strtoull (argv[2], NULL, 10),
+                                 (uint64_t) strtol (argv[1], NULL, 10),
+                                 options.thread_count);
+  }
+  if (!options.analyze)
+  {
+    return run_random_walks (&board, strtol (argv[2], NULL, 10),
+                             (uint64_t) strtol (argv[1], NULL, 10),
+                             options.thread_count);
+  }
 
+  // only the analysis needs the generic chain
   MarkovChain *markov_chain = initialize_markov_chain (
       print_func_cell,
+      append_func_cell,
       comp_func_cell,
+      hash_func_cell,
       free_data_cell,
       copy_func_cell,
+      arena_copy_cell,
       is_last_cell);
   if (!markov_chain)
   {
     fprintf (stdout, ALLOCATION_ERROR_MASSAGE);
     return EXIT_FAILURE;
   }
-
-  if (fill_database (markov_chain))
+  int status = fill_database (markov_chain, &board);
+  if (status)
   {
     fprintf (stdout, ALLOCATION_ERROR_MASSAGE);
-    return EXIT_FAILURE;
   }
-
-  for (int i = 1; i <= (int) strtol (argv[2], NULL, 10); ++i)
+  else
   {
-    fprintf (stdout, "Random Walk %d: ", i);
-    run_random_walk(markov_chain);
-    fprintf (stdout, "\n");
+    status = print_analysis (markov_chain);
   }
-
   free_markov_chain (&markov_chain);
-  return EXIT_SUCCESS;
+  return status;
 }
\ No newline at end of file
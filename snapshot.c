@@ -0,0 +1,400 @@
+#define _POSIX_C_SOURCE 200809L // For fileno(), mmap()
+#include "markov_chain.h"
+#include <string.h>
+#include <sys/mman.h> // For mmap()
+#include <sys/stat.h> // For fstat()
+
+#define SNAPSHOT_MAGIC "MKCH"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_ARENA_BLOCK_SIZE (1 << 20)
+#define MIN_PAYLOAD_BUFFER 256
+#define SNAPSHOT_FORMAT_ERROR "Invalid snapshot: %s\n"
+
+/**
+ * Snapshot layout, all numbers in native byte order:
+ *   SnapshotHeader
+ *   uint64_t edge_offsets[state_count + 1]     CSR row offsets
+ *   uint64_t payload_offsets[state_count + 1]  offsets in the payload bytes
+ *   uint32_t next_ids[edge_count]               next state of each edge
+ *   uint32_t frequencies[edge_count]            frequency of each edge
+ *   uint32_t start_ids[start_count]             the chain's start states
+ *   unsigned char payloads[payload_size]
+ * The 64 bit arrays come first so every array is naturally aligned.
+ */
+typedef struct SnapshotHeader {
+    char magic[4];
+    uint32_t version;
+    uint64_t state_count;
+    uint64_t edge_count;
+    uint64_t start_count;
+    uint64_t payload_size;
+} SnapshotHeader;
+
+/**
+ * Pointers to the arrays of a mapped snapshot.
+ */
+typedef struct SnapshotView {
+    const SnapshotHeader *header;
+    const uint64_t *edge_offsets;
+    const uint64_t *payload_offsets;
+    const uint32_t *next_ids;
+    const uint32_t *frequencies;
+    const uint32_t *start_ids;
+    const unsigned char *payloads;
+} SnapshotView;
+
+/**
+ * Write a whole array to the file.
+ * @return true on success, false in case of I/O error
+ */
+static bool write_all(FILE *fp, const void *data, size_t size)
+{
+  return size == 0 || fwrite (data, 1, size, fp) == size;
+}
+
+/**
+ * Serialize every state's data into one growing byte buffer.
+ * @param markov_chain the chain to serialize.
+ * @param offsets array of state count + 1 offsets to fill.
+ * @param size set to the number of bytes written.
+ * @return the buffer, NULL in case of allocation error
+ */
+static unsigned char *serialize_payloads(MarkovChain *markov_chain,
+                                         uint64_t *offsets, size_t *size)
+{
+  size_t capacity = MIN_PAYLOAD_BUFFER, used = 0;
+  unsigned char *buffer = malloc (capacity);
+  if (!buffer) return NULL;
+  for (int i = 0; i < markov_chain->database->size; ++i)
+  {
+    offsets[i] = used;
+    void *data = markov_chain->states[i]->data;
+    size_t needed = markov_chain->serialize (data, buffer + used,
+                                             capacity - used);
+    if (needed > capacity - used)
+    {
+      while (needed > capacity - used) capacity *= 2;
+      unsigned char *tmp = realloc (buffer, capacity);
+      if (!tmp)
+      {
+        free (buffer);
+        return NULL;
+      }
+      buffer = tmp;
+      markov_chain->serialize (data, buffer + used, capacity - used);
+    }
+    used += needed;
+  }
+  offsets[markov_chain->database->size] = used;
+  *size = used;
+  return buffer;
+}
+
+bool save_markov_chain(MarkovChain *markov_chain, const char *path)
+{
+  size_t state_count = (size_t) markov_chain->database->size;
+  size_t edge_count = 0;
+  for (size_t i = 0; i < state_count; ++i)
+  {
+    edge_count += markov_chain->states[i]->counter_list_size;
+  }
+  if (!markov_chain->serialize || state_count > UINT32_MAX)
+  {
+    return false;
+  }
+
+  uint64_t *edge_offsets = malloc ((state_count + 1) * sizeof (uint64_t));
+  uint64_t *payload_offsets = malloc ((state_count + 1) * sizeof (uint64_t));
+  uint32_t *edges = malloc ((2 * edge_count
+                             + markov_chain->start_states_size + 1)
+                            * sizeof (uint32_t));
+  size_t payload_size = 0;
+  unsigned char *payloads = NULL;
+  if (edge_offsets && payload_offsets && edges)
+  {
+    payloads = serialize_payloads (markov_chain, payload_offsets,
+                                   &payload_size);
+  }
+  if (!payloads)
+  {
+    fprintf (stderr, ALLOCATION_ERROR_MASSAGE);
+    free (edge_offsets);
+    free (payload_offsets);
+    free (edges);
+    return false;
+  }
+
+  uint32_t *next_ids = edges, *frequencies = edges + edge_count;
+  uint32_t *start_ids = frequencies + edge_count;
+  size_t e = 0;
+  for (size_t i = 0; i < state_count; ++i)
+  {
+    MarkovNode *node = markov_chain->states[i];
+    edge_offsets[i] = e;
+    for (size_t j = 0; j < node->counter_list_size; ++j, ++e)
+    {
+      next_ids[e] = node->counter_list[j].next_id;
+      frequencies[e] = node->counter_list[j].frequency;
+    }
+  }
+  edge_offsets[state_count] = e;
+  for (size_t i = 0; i < markov_chain->start_states_size; ++i)
+  {
+    start_ids[i] = (uint32_t) markov_chain->start_states[i]->id;
+  }
+
+  SnapshotHeader header = {SNAPSHOT_MAGIC, SNAPSHOT_VERSION, state_count,
+                           edge_count, markov_chain->start_states_size,
+                           payload_size};
+  FILE *fp = fopen (path, "wb");
+  bool success = fp
+      && write_all (fp, &header, sizeof (header))
+      && write_all (fp, edge_offsets, (state_count + 1) * sizeof (uint64_t))
+      && write_all (fp, payload_offsets,
+                    (state_count + 1) * sizeof (uint64_t))
+      && write_all (fp, edges, (2 * edge_count
+                                + markov_chain->start_states_size)
+                               * sizeof (uint32_t))
+      && write_all (fp, payloads, payload_size);
+  if (fp && fclose (fp)) success = false;
+
+  free (edge_offsets);
+  free (payload_offsets);
+  free (edges);
+  free (payloads);
+  return success;
+}
+
+/**
+ * Check that a mapped file is a valid snapshot and point the view to its
+ * arrays.
+ * @param bytes the mapped file.
+ * @param size the file size.
+ * @param view the view to fill.
+ * @return true if the snapshot is valid.
+ */
+static bool open_view(const unsigned char *bytes, size_t size,
+                      SnapshotView *view)
+{
+  if (size < sizeof (SnapshotHeader)) return false;
+  const SnapshotHeader *header = (const SnapshotHeader *) bytes;
+  if (memcmp (header->magic, SNAPSHOT_MAGIC, sizeof (header->magic))
+      || header->version != SNAPSHOT_VERSION
+      || header->state_count > UINT32_MAX
+      || header->start_count > header->state_count)
+  {
+    return false;
+  }
+
+  // bound every count by the bytes left for its array before multiplying,
+  // so a crafted header cannot wrap the size computations
+  uint64_t n = header->state_count, e = header->edge_count;
+  uint64_t left = size - sizeof (SnapshotHeader);
+  if (n + 1 > left / (2 * sizeof (uint64_t))) return false;
+  left -= 2 * (n + 1) * sizeof (uint64_t);
+  if (e > left / (2 * sizeof (uint32_t))) return false;
+  left -= 2 * e * sizeof (uint32_t);
+  if (header->start_count > left / sizeof (uint32_t)) return false;
+  left -= header->start_count * sizeof (uint32_t);
+  if (header->payload_size != left) return false;
+
+  view->header = header;
+  view->edge_offsets = (const uint64_t *) (header + 1);
+  view->payload_offsets = view->edge_offsets + n + 1;
+  view->next_ids = (const uint32_t *) (view->payload_offsets + n + 1);
+  view->frequencies = view->next_ids + e;
+  view->start_ids = view->frequencies + e;
+  view->payloads = (const unsigned char *) (view->start_ids
+                                            + header->start_count);
+
+  if (view->edge_offsets[0] != 0 || view->edge_offsets[n] != e
+      || view->payload_offsets[0] != 0
+      || view->payload_offsets[n] != header->payload_size)
+  {
+    return false;
+  }
+  for (uint64_t i = 0; i < n; ++i)
+  {
+    if (view->edge_offsets[i] > view->edge_offsets[i + 1]
+        || view->payload_offsets[i] > view->payload_offsets[i + 1])
+    {
+      return false;
+    }
+  }
+  for (uint64_t i = 0; i < e; ++i)
+  {
+    if (view->next_ids[i] >= n || view->frequencies[i] == 0) return false;
+  }
+  for (uint64_t i = 0; i < header->start_count; ++i)
+  {
+    if (view->start_ids[i] >= n) return false;
+  }
+  return true;
+}
+
+/**
+ * Free the data of the first count loaded states, unless it lives in the
+ * arena, and leave the chain empty.
+ */
+static void unload(MarkovChain *markov_chain, MarkovNode *nodes,
+                   size_t count)
+{
+  for (size_t i = 0; i < count && !markov_chain->arena_copy; ++i)
+  {
+    markov_chain->free_data (nodes[i].data);
+  }
+  hash_index_free (&markov_chain->index);
+  markov_chain->database->first = NULL;
+  markov_chain->database->last = NULL;
+  markov_chain->database->size = 0;
+  markov_chain->start_states_size = 0;
+}
+
+typedef enum BuildStatus {
+    BUILD_DONE,
+    BUILD_NO_MEMORY, // allocation error
+    BUILD_BAD_DATA // deserialize rejected a state's bytes
+} BuildStatus;
+
+/**
+ * Build the chain's nodes, counter lists, states and index from a valid
+ * snapshot view. The chain must be empty and have an arena.
+ * @return BUILD_DONE on success, BUILD_NO_MEMORY or BUILD_BAD_DATA
+ * otherwise, leaving the chain empty.
+ */
+static BuildStatus build_from_view(MarkovChain *markov_chain,
+                                   const SnapshotView *view)
+{
+  size_t n = view->header->state_count, e = view->header->edge_count;
+  size_t start_count = view->header->start_count;
+  Arena *arena = markov_chain->arena;
+  Node *nodes = arena_alloc (arena, n * sizeof (Node) + 1);
+  MarkovNode *markov_nodes = arena_alloc (arena,
+                                          n * sizeof (MarkovNode) + 1);
+  NextNodeCounter *counters = arena_alloc (arena,
+                                           e * sizeof (NextNodeCounter) + 1);
+  MarkovNode **states = realloc (markov_chain->states,
+                                 (n + 1) * sizeof (MarkovNode *));
+  if (states)
+  {
+    markov_chain->states = states;
+    markov_chain->states_capacity = n + 1;
+  }
+  MarkovNode **start_states = realloc (markov_chain->start_states,
+                                       (start_count + 1)
+                                       * sizeof (MarkovNode *));
+  if (start_states)
+  {
+    markov_chain->start_states = start_states;
+    markov_chain->start_states_capacity = start_count + 1;
+  }
+  if (markov_chain->hash_func)
+  {
+    markov_chain->index = hash_index_create (2 * n);
+  }
+  if (!nodes || !markov_nodes || !counters || !states || !start_states
+      || (markov_chain->hash_func && !markov_chain->index))
+  {
+    hash_index_free (&markov_chain->index);
+    return BUILD_NO_MEMORY;
+  }
+
+  for (size_t i = 0; i < n; ++i)
+  {
+    MarkovNode *node = markov_nodes + i;
+    uint64_t first = view->edge_offsets[i], last = view->edge_offsets[i + 1];
+    const unsigned char *payload = view->payloads + view->payload_offsets[i];
+    node->data = markov_chain->deserialize (payload,
+                                            view->payload_offsets[i + 1]
+                                            - view->payload_offsets[i],
+                                            arena);
+    if (!node->data)
+    {
+      // deserialize reports bad bytes, e.g. a state of another order, and
+      // allocation errors alike; the bytes are the likelier cause
+      unload (markov_chain, markov_nodes, i);
+      return BUILD_BAD_DATA;
+    }
+    node->counter_list = last > first ? counters + first : NULL;
+    node->counter_list_size = last - first;
+    node->counter_list_capacity = last - first;
+    node->counter_list_sum = 0;
+    for (uint64_t j = first; j < last; ++j)
+    {
+      counters[j].next_id = view->next_ids[j];
+      counters[j].frequency = view->frequencies[j];
+      node->counter_list_sum += view->frequencies[j];
+    }
+    node->id = i;
+    node->chain = markov_chain;
+    node->alias = NULL;
+    node->snapshot = NULL;
+    node->counter_index = NULL;
+    node->counter_index_capacity = 0;
+
+    nodes[i].data = node;
+    nodes[i].next = i + 1 < n ? nodes + i + 1 : NULL;
+    markov_chain->states[i] = node;
+    if (markov_chain->index
+        && hash_index_insert (markov_chain->index,
+                              markov_chain->hash_func (node->data),
+                              nodes + i))
+    {
+      unload (markov_chain, markov_nodes, i + 1);
+      return BUILD_NO_MEMORY;
+    }
+  }
+
+  for (size_t i = 0; i < start_count; ++i)
+  {
+    markov_chain->start_states[i] = markov_nodes + view->start_ids[i];
+  }
+  markov_chain->start_states_size = start_count;
+  markov_chain->database->first = n ? nodes : NULL;
+  markov_chain->database->last = n ? nodes + n - 1 : NULL;
+  markov_chain->database->size = (int) n;
+  return BUILD_DONE;
+}
+
+bool load_markov_chain(MarkovChain *markov_chain, const char *path)
+{
+  if (markov_chain->database->size != 0 || !markov_chain->deserialize)
+  {
+    return false;
+  }
+  FILE *fp = fopen (path, "rb");
+  if (!fp) return false;
+  struct stat file_stat;
+  if (fstat (fileno (fp), &file_stat) || file_stat.st_size == 0)
+  {
+    fclose (fp);
+    return false;
+  }
+  size_t size = (size_t) file_stat.st_size;
+  const unsigned char *bytes = mmap (NULL, size, PROT_READ, MAP_PRIVATE,
+                                     fileno (fp), 0);
+  fclose (fp);
+  if (bytes == MAP_FAILED) return false;
+
+  BuildStatus status = BUILD_BAD_DATA;
+  SnapshotView view;
+  if (open_view (bytes, size, &view))
+  {
+    if (!markov_chain->arena)
+    {
+      markov_chain->arena = arena_create (SNAPSHOT_ARENA_BLOCK_SIZE);
+    }
+    status = markov_chain->arena ? build_from_view (markov_chain, &view)
+                                 : BUILD_NO_MEMORY;
+  }
+  munmap ((void *) bytes, size);
+  if (status == BUILD_NO_MEMORY)
+  {
+    fprintf (stderr, ALLOCATION_ERROR_MASSAGE);
+  }
+  else if (status == BUILD_BAD_DATA)
+  {
+    fprintf (stderr, SNAPSHOT_FORMAT_ERROR, path);
+  }
+  return status == BUILD_DONE;
+}
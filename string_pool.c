@@ -0,0 +1,155 @@
+#include "string_pool.h"
+#include <string.h> // For strncmp(), memcpy()
+
+#define POOL_BLOCK_SIZE (1 << 20)
+#define MIN_CAPACITY 1024
+
+/**
+ * What the pool stores right before the characters of each string.
+ */
+typedef struct PoolHeader {
+    uint32_t id;
+    size_t hash;
+} PoolHeader;
+
+/**
+ * FNV-1a hash of a character range.
+ */
+static size_t hash_chars (const char *s, size_t length)
+{
+  size_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < length; ++i)
+  {
+    hash ^= (unsigned char) s[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+size_t string_pool_hash (const char *handle)
+{
+  return ((const PoolHeader *) handle)[-1].hash;
+}
+
+uint32_t string_pool_id (const char *handle)
+{
+  return ((const PoolHeader *) handle)[-1].id;
+}
+
+const char *string_pool_string (const StringPool *pool, uint32_t id)
+{
+  return pool->strings[id];
+}
+
+/**
+ * Put a handle in the first free slot of its probe sequence.
+ * The table must have at least one free slot.
+ */
+static void place (const char **slots, size_t capacity, const char *handle)
+{
+  size_t mask = capacity - 1;
+  size_t i = string_pool_hash (handle) & mask;
+  while (slots[i])
+  {
+    i = (i + 1) & mask;
+  }
+  slots[i] = handle;
+}
+
+/**
+ * Double the table and re-place every handle using its stored hash.
+ * @return 0 on success, 1 otherwise
+ */
+static int grow (StringPool *pool)
+{
+  size_t capacity = pool->capacity * 2;
+  const char **slots = calloc (capacity, sizeof (const char *));
+  if (!slots) return 1;
+  for (size_t i = 0; i < pool->capacity; ++i)
+  {
+    if (pool->slots[i])
+    {
+      place (slots, capacity, pool->slots[i]);
+    }
+  }
+  free (pool->slots);
+  pool->slots = slots;
+  pool->capacity = capacity;
+  return 0;
+}
+
+StringPool *string_pool_create (void)
+{
+  StringPool *pool = malloc (sizeof (StringPool));
+  if (!pool) return NULL;
+  pool->bytes = arena_create (POOL_BLOCK_SIZE);
+  pool->slots = calloc (MIN_CAPACITY, sizeof (const char *));
+  pool->strings = malloc (MIN_CAPACITY * sizeof (const char *));
+  if (!pool->bytes || !pool->slots || !pool->strings)
+  {
+    arena_free (&pool->bytes);
+    free (pool->slots);
+    free (pool->strings);
+    free (pool);
+    return NULL;
+  }
+  pool->capacity = MIN_CAPACITY;
+  pool->size = 0;
+  pool->strings_capacity = MIN_CAPACITY;
+  return pool;
+}
+
+const char *string_pool_intern (StringPool *pool, const char *s,
+                                size_t length)
+{
+  size_t hash = hash_chars (s, length);
+  size_t mask = pool->capacity - 1;
+  size_t i = hash & mask;
+  while (pool->slots[i])
+  {
+    const char *handle = pool->slots[i];
+    if (string_pool_hash (handle) == hash
+        && !strncmp (handle, s, length) && handle[length] == '\0')
+    {
+      return handle;
+    }
+    i = (i + 1) & mask;
+  }
+
+  if (((pool->size + 1) * 2 > pool->capacity && grow (pool))
+      || pool->size == UINT32_MAX)
+  {
+    return NULL;
+  }
+  if (pool->size == pool->strings_capacity)
+  {
+    const char **strings = realloc (pool->strings, 2 * pool->size
+                                                   * sizeof (const char *));
+    if (!strings) return NULL;
+    pool->strings = strings;
+    pool->strings_capacity *= 2;
+  }
+  PoolHeader *header = arena_alloc (pool->bytes,
+                                    sizeof (PoolHeader) + length + 1);
+  if (!header) return NULL;
+  header->id = (uint32_t) pool->size;
+  header->hash = hash;
+  char *handle = (char *) (header + 1);
+  memcpy (handle, s, length);
+  handle[length] = '\0';
+  place (pool->slots, pool->capacity, handle);
+  pool->strings[pool->size++] = handle;
+  return handle;
+}
+
+void string_pool_free (StringPool **pool)
+{
+  if (pool && *pool)
+  {
+    arena_free (&(*pool)->bytes);
+    free ((*pool)->slots);
+    free ((*pool)->strings);
+    free (*pool);
+    *pool = NULL;
+  }
+}
@@ -0,0 +1,67 @@
+#ifndef _STRING_POOL_H_
+#define _STRING_POOL_H_
+#include "arena.h"
+#include <stddef.h> // For size_t
+#include <stdint.h> // For uint32_t
+
+/**
+ * Set of interned strings. Each distinct string is stored once in the
+ * pool's arena, right after its id and hash, and is identified by a stable
+ * const char* handle: two handles are equal iff their strings are equal.
+ * Strings also get dense 32 bit ids, in the order they were interned.
+ */
+typedef struct StringPool {
+    Arena *bytes; // string storage
+    const char **slots; // open addressing table, NULL marks an empty slot
+    size_t capacity; // always a power of two
+    size_t size;
+    const char **strings; // handles by id
+    size_t strings_capacity;
+} StringPool;
+
+/**
+ * Create an empty string pool.
+ * @return pointer to the new pool, NULL in case of allocation error
+ */
+StringPool *string_pool_create (void);
+
+/**
+ * Get the handle of a string, adding it to the pool if it is not there.
+ * Known strings cost no allocation.
+ * @param pool pool to intern in
+ * @param s the characters of the string, not necessarily null terminated
+ * @param length number of characters in s
+ * @return null terminated handle, NULL in case of allocation error
+ */
+const char *string_pool_intern (StringPool *pool, const char *s,
+                                size_t length);
+
+/**
+ * Get the hash of an interned string without reading its characters.
+ * @param handle handle returned by string_pool_intern
+ * @return the hash of the string
+ */
+size_t string_pool_hash (const char *handle);
+
+/**
+ * Get the id of an interned string without reading its characters.
+ * @param handle handle returned by string_pool_intern
+ * @return the id of the string, below the pool's size
+ */
+uint32_t string_pool_id (const char *handle);
+
+/**
+ * Get the handle of the string with the given id.
+ * @param pool pool the string was interned in
+ * @param id id of the string, below the pool's size
+ * @return the handle
+ */
+const char *string_pool_string (const StringPool *pool, uint32_t id);
+
+/**
+ * Free the pool and all its strings. Handles become invalid.
+ * @param pool pool to free
+ */
+void string_pool_free (StringPool **pool);
+
+#endif //_STRING_POOL_H_
@@ -0,0 +1,129 @@
+#include "test_util.h"
+
+#define DRAWS 1000000
+#define LIST_COUNT 200
+#define MAX_LIST_SIZE 40
+// chi-square bound for at most 40 degrees of freedom, exceeded with
+// probability below 1e-6 when the draws follow the frequencies
+#define CHI_SQUARE_BOUND 110.0
+
+/**
+ * Check that a node's alias table gives every position exactly its share:
+ * column i keeps i with weight threshold_i and passes sum - threshold_i to
+ * its alias, and each position must get frequency * size in total.
+ */
+static void check_alias_table(const MarkovNode *node)
+{
+  const AliasTable *alias = node->alias;
+  if (!CHECK (alias != NULL)) return;
+  CHECK (alias->size == node->counter_list_size);
+  CHECK (alias->sum == node->counter_list_sum);
+  for (size_t i = 0; i < alias->size; ++i)
+  {
+    uint64_t share = alias->entries[i].threshold;
+    for (size_t c = 0; c < alias->size; ++c)
+    {
+      if (alias->entries[c].alias == i && c != i)
+      {
+        share += alias->sum - alias->entries[c].threshold;
+      }
+    }
+    CHECK (alias->entries[i].threshold <= alias->sum);
+    CHECK (share == (uint64_t) node->counter_list[i].frequency
+                    * alias->size);
+  }
+}
+
+/**
+ * Chi-square statistic of the draws of the node's next states against the
+ * node's frequencies.
+ */
+static double chi_square(const MarkovNode *node, const size_t *counts)
+{
+  double statistic = 0;
+  for (size_t i = 0; i < node->counter_list_size; ++i)
+  {
+    double expected = (double) DRAWS * node->counter_list[i].frequency
+                      / (double) node->counter_list_sum;
+    double difference = (double) counts[i] - expected;
+    statistic += difference * difference / expected;
+  }
+  return statistic;
+}
+
+/**
+ * Draw the next state of the first node many times, through the mutable
+ * and the frozen chain, and check both follow its frequencies.
+ */
+static void check_draws(MarkovChain *markov_chain, Rng *rng)
+{
+  MarkovNode *node = test_state (markov_chain, 0);
+  size_t node_counts[MAX_LIST_SIZE] = {0}, state_counts[MAX_LIST_SIZE] = {0};
+  for (size_t i = 0; i < DRAWS; ++i)
+  {
+    int next = test_value (get_next_random_node (node, rng));
+    size_t state = get_next_random_state (markov_chain->frozen, node->id,
+                                          rng);
+    node_counts[next - 1]++;
+    state_counts[test_value (markov_chain->states[state]) - 1]++;
+  }
+  CHECK (chi_square (node, node_counts) < CHI_SQUARE_BOUND);
+  CHECK (chi_square (node, state_counts) < CHI_SQUARE_BOUND);
+}
+
+/**
+ * A start state 0 whose next states 1..size have skewed frequencies.
+ */
+static MarkovChain *build_fanout(const uint32_t *frequencies, size_t size)
+{
+  MarkovChain *markov_chain = test_chain_create (true);
+  for (size_t i = 0; i < size; ++i)
+  {
+    test_transition (markov_chain, 0, (int) i + 1, frequencies[i]);
+  }
+  return markov_chain;
+}
+
+int main(void)
+{
+  Rng rng;
+  rng_seed (&rng, 1);
+
+  // exact tables over random lists, single next states included
+  for (size_t list = 0; list < LIST_COUNT; ++list)
+  {
+    uint32_t frequencies[MAX_LIST_SIZE];
+    size_t size = 1 + rng_below (&rng, MAX_LIST_SIZE);
+    for (size_t i = 0; i < size; ++i)
+    {
+      frequencies[i] = 1 + (uint32_t) rng_below (&rng, i % 7 ? 5 : 300);
+    }
+    MarkovChain *markov_chain = build_fanout (frequencies, size);
+    CHECK (freeze_sampling (markov_chain));
+    check_alias_table (test_state (markov_chain, 0));
+    free_markov_chain (&markov_chain);
+  }
+
+  // drawn distributions, by linear scan and binary search before
+  // freeze_sampling, by alias tables after it
+  uint32_t skewed[] = {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 500, 1, 1, 40};
+  size_t size = sizeof (skewed) / sizeof (skewed[0]);
+  MarkovChain *markov_chain = build_fanout (skewed, size);
+  CHECK (freeze_markov_chain (markov_chain));
+  check_draws (markov_chain, &rng);
+  CHECK (freeze_sampling (markov_chain));
+  check_draws (markov_chain, &rng);
+
+  // training after the freezes makes the tables stale, and draws go back
+  // to the scans
+  test_transition (markov_chain, 0, 3, 300);
+  CHECK (test_state (markov_chain, 0)->alias->sum
+         != test_state (markov_chain, 0)->counter_list_sum);
+  CHECK (freeze_markov_chain (markov_chain));
+  check_draws (markov_chain, &rng);
+  CHECK (freeze_sampling (markov_chain));
+  check_alias_table (test_state (markov_chain, 0));
+  check_draws (markov_chain, &rng);
+  free_markov_chain (&markov_chain);
+  return test_result ("test_alias");
+}
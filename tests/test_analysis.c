@@ -0,0 +1,185 @@
+#include "test_util.h"
+#include "markov_analysis.h"
+#include <math.h>
+
+#define TOLERANCE 1e-12
+#define MAX_ITERATIONS 100000
+#define EPSILON 1e-9
+#define MAX_MOVES 200
+
+/**
+ * Compute the stationary distribution of a chain on one and three threads,
+ * and check both against the expected one, given by state value.
+ */
+static void check_stationary(MarkovChain *markov_chain, const int *values,
+                             const double *expected, size_t count)
+{
+  CHECK ((size_t) markov_chain->database->size == count);
+  double distribution[8];
+  for (size_t threads = 1; threads <= 3; threads += 2)
+  {
+    size_t iterations = 0;
+    if (!CHECK (compute_stationary_distribution (markov_chain, TOLERANCE,
+                                                 MAX_ITERATIONS, threads,
+                                                 distribution, &iterations)
+                == STATIONARY_CONVERGED))
+    {
+      continue;
+    }
+    CHECK (iterations > 0 && iterations < MAX_ITERATIONS);
+    for (size_t i = 0; i < count; ++i)
+    {
+      size_t id = test_state (markov_chain, values[i])->id;
+      CHECK (fabs (distribution[id] - expected[i]) < EPSILON);
+    }
+  }
+}
+
+/**
+ * 0 -> 1, 1 -> 0 or 2 with weights 1 and 2, 2 -> 0. The walk never ends,
+ * and spends 3/8, 3/8 and 1/4 of its time in 0, 1 and 2.
+ */
+static void test_recurrent_chain(bool use_arena)
+{
+  MarkovChain *markov_chain = test_chain_create (use_arena);
+  test_transition (markov_chain, 0, 1, 1);
+  test_transition (markov_chain, 1, 0, 1);
+  test_transition (markov_chain, 1, 2, 2);
+  test_transition (markov_chain, 2, 0, 3);
+  const int values[] = {0, 1, 2};
+  const double expected[] = {3.0 / 8, 3.0 / 8, 1.0 / 4};
+  check_stationary (markov_chain, values, expected, 3);
+  free_markov_chain (&markov_chain);
+}
+
+/**
+ * 0 -> 1, 1 -> 0 or 2 with weights 1 and 3, 2 -> 1: a chain of period 2,
+ * on which the plain power iteration oscillates forever from the uniform
+ * distribution. The lazy one converges to 1/8, 1/2 and 3/8.
+ */
+static void test_periodic_chain(bool use_arena)
+{
+  MarkovChain *markov_chain = test_chain_create (use_arena);
+  test_transition (markov_chain, 0, 1, 1);
+  test_transition (markov_chain, 1, 0, 1);
+  test_transition (markov_chain, 1, 2, 3);
+  test_transition (markov_chain, 2, 1, 2);
+  const int values[] = {0, 1, 2};
+  const double expected[] = {1.0 / 8, 1.0 / 2, 3.0 / 8};
+  check_stationary (markov_chain, values, expected, 3);
+  free_markov_chain (&markov_chain);
+}
+
+/**
+ * A chain that needs more than max_iterations is reported as not converged,
+ * with its last iterate.
+ */
+static void test_not_converged(void)
+{
+  MarkovChain *markov_chain = test_chain_create (true);
+  test_transition (markov_chain, 0, 1, 1);
+  test_transition (markov_chain, 1, 0, 1);
+  double distribution[2];
+  size_t iterations = 0;
+  CHECK (compute_stationary_distribution (markov_chain, 0, 3, 1,
+                                          distribution, &iterations)
+         == STATIONARY_NOT_CONVERGED);
+  CHECK (iterations == 3);
+  CHECK (fabs (distribution[0] + distribution[1] - 1) < EPSILON);
+  free_markov_chain (&markov_chain);
+}
+
+/**
+ * 0 -> 1 -> -1 and 2 -> -1, where -1 is a last state. Every state with a
+ * next state is a start state, so a walk at -1 restarts at 0, 1 or 2 with
+ * probability 1/3 each: the shares are 1/7, 2/7, 1/7 and 3/7.
+ */
+static void test_restarting_chain(bool use_arena)
+{
+  MarkovChain *markov_chain = test_chain_create (use_arena);
+  test_transition (markov_chain, 0, 1, 4);
+  test_transition (markov_chain, 1, -1, 1);
+  test_transition (markov_chain, 2, -1, 2);
+  CHECK (markov_chain->start_states_size == 3);
+  const int values[] = {0, 1, 2, -1};
+  const double expected[] = {1.0 / 7, 2.0 / 7, 1.0 / 7, 3.0 / 7};
+  check_stationary (markov_chain, values, expected, 4);
+  free_markov_chain (&markov_chain);
+}
+
+/**
+ * 0 -> 1 or 2 with equal weights, 1 -> -1 and 2 -> 0. From 0 a game takes
+ * 2k moves with probability 2^-k, 4 moves on average, and visits 0 twice
+ * and 2 once on average.
+ */
+static void test_absorbing_chain(bool use_arena)
+{
+  MarkovChain *markov_chain = test_chain_create (use_arena);
+  test_transition (markov_chain, 0, 1, 3);
+  test_transition (markov_chain, 0, 2, 3);
+  test_transition (markov_chain, 1, -1, 1);
+  test_transition (markov_chain, 2, 0, 5);
+  size_t zero = test_state (markov_chain, 0)->id;
+  size_t one = test_state (markov_chain, 1)->id;
+  size_t two = test_state (markov_chain, 2)->id;
+  size_t end = test_state (markov_chain, -1)->id;
+  AbsorbingAnalysis analysis;
+  if (!CHECK (analyze_absorbing_chain (markov_chain, zero, MAX_MOVES,
+                                       &analysis)))
+  {
+    free_markov_chain (&markov_chain);
+    return;
+  }
+  CHECK (analysis.state_count == 4);
+  CHECK (fabs (analysis.expected_moves[zero] - 4) < EPSILON);
+  CHECK (fabs (analysis.expected_moves[one] - 1) < EPSILON);
+  CHECK (fabs (analysis.expected_moves[two] - 5) < EPSILON);
+  CHECK (analysis.expected_moves[end] == 0);
+  CHECK (fabs (analysis.expected_visits[zero] - 2) < EPSILON);
+  CHECK (fabs (analysis.expected_visits[one] - 1) < EPSILON);
+  CHECK (fabs (analysis.expected_visits[two] - 1) < EPSILON);
+  CHECK (analysis.expected_visits[end] == 0);
+  CHECK (fabs (analysis.visit_probability[zero] - 1) < EPSILON);
+  CHECK (fabs (analysis.visit_probability[one] - 1) < EPSILON);
+  CHECK (fabs (analysis.visit_probability[two] - 0.5) < EPSILON);
+  double mass = 0, mean = 0;
+  for (size_t n = 0; n < analysis.time_steps; ++n)
+  {
+    double expected = n > 0 && n % 2 == 0 ? ldexp (1, -(int) (n / 2)) : 0;
+    CHECK (fabs (analysis.absorption_time[n] - expected) < EPSILON);
+    mass += analysis.absorption_time[n];
+    mean += (double) n * analysis.absorption_time[n];
+  }
+  CHECK (fabs (mass - 1) < 1e-6);
+  CHECK (fabs (mean - 4) < 1e-4);
+  free_absorbing_analysis (&analysis);
+  free_markov_chain (&markov_chain);
+}
+
+/**
+ * A chain whose walks never end has no absorbing analysis.
+ */
+static void test_endless_chain(void)
+{
+  MarkovChain *markov_chain = test_chain_create (true);
+  test_transition (markov_chain, 0, 1, 1);
+  test_transition (markov_chain, 1, 0, 1);
+  AbsorbingAnalysis analysis;
+  CHECK (!analyze_absorbing_chain (markov_chain, 0, MAX_MOVES, &analysis));
+  free_markov_chain (&markov_chain);
+}
+
+int main(void)
+{
+  test_absorbing_chain (true);
+  test_absorbing_chain (false);
+  test_endless_chain ();
+  test_recurrent_chain (true);
+  test_recurrent_chain (false);
+  test_periodic_chain (true);
+  test_periodic_chain (false);
+  test_not_converged ();
+  test_restarting_chain (true);
+  test_restarting_chain (false);
+  return test_result ("test_analysis");
+}
@@ -0,0 +1,209 @@
+#include "test_util.h"
+#include "online_chain.h"
+
+#define STATE_COUNT 64
+#define SEQUENCES 20000
+#define MAX_SEQUENCE 12
+#define PUBLISH_EVERY 7
+#define READERS 4
+#define WALK_LENGTH 20
+// the only last state, ending every sequence
+#define END (-1)
+
+/* The writer only ever adds the transitions x -> step_one (x),
+ * x -> step_two (x) and x -> END, so readers can tell a valid walk from
+ * one that went through a torn or freed snapshot. */
+
+static int step_one(int value)
+{
+  return (value + 1) % STATE_COUNT;
+}
+
+static int step_two(int value)
+{
+  return (value * 3 + 1) % STATE_COUNT;
+}
+
+static bool valid_next(int from, int to)
+{
+  return to == step_one (from) || to == step_two (from) || to == END;
+}
+
+static OnlineChain online;
+static int writer_done = 0;
+static uint64_t transitions_added = 0;
+
+typedef struct ReaderResult {
+    uint64_t seed;
+    size_t errors;
+    bool registered;
+} ReaderResult;
+
+static void *write_sequences(void *arg)
+{
+  (void) arg;
+  Rng rng;
+  rng_seed (&rng, 9);
+  int values[MAX_SEQUENCE];
+  void *states[MAX_SEQUENCE];
+  for (int t = 0; t < SEQUENCES; ++t)
+  {
+    size_t count = 2 + rng_below (&rng, MAX_SEQUENCE - 1);
+    values[0] = (int) rng_below (&rng, STATE_COUNT);
+    for (size_t i = 1; i + 1 < count; ++i)
+    {
+      values[i] = rng_below (&rng, 2) ? step_one (values[i - 1])
+                                      : step_two (values[i - 1]);
+    }
+    values[count - 1] = END;
+    for (size_t i = 0; i < count; ++i)
+    {
+      states[i] = values + i;
+    }
+    if (!online_chain_append (&online, states, count)) break;
+    transitions_added += count - 1;
+    if (t % PUBLISH_EVERY == 0 && !online_chain_publish (&online)) break;
+  }
+  online_chain_publish (&online);
+  __atomic_store_n (&writer_done, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+/**
+ * Check a published snapshot of a node: its running sums must increase and
+ * end at its sum, its next states must be valid, and its sum must not be
+ * below the last one this reader saw for the node.
+ */
+static bool valid_snapshot(const MarkovNode *node, uint64_t *seen_sums)
+{
+  NodeSnapshot *snapshot = __atomic_load_n (&node->snapshot,
+                                            __ATOMIC_ACQUIRE);
+  if (!snapshot) return true;
+  int from = test_value (node);
+  uint64_t previous = 0;
+  for (size_t i = 0; i < snapshot->size; ++i)
+  {
+    if (snapshot->entries[i].cumulative <= previous
+        || !valid_next (from, test_value (snapshot->entries[i].next)))
+    {
+      return false;
+    }
+    previous = snapshot->entries[i].cumulative;
+  }
+  if (previous != snapshot->sum || snapshot->sum < seen_sums[from])
+  {
+    return false;
+  }
+  seen_sums[from] = snapshot->sum;
+  return true;
+}
+
+static void *read_walks(void *arg)
+{
+  ReaderResult *result = arg;
+  size_t reader;
+  result->registered = online_chain_register_reader (&online, &reader);
+  if (!result->registered) return NULL;
+  Rng rng;
+  rng_seed (&rng, result->seed);
+  uint64_t seen_sums[STATE_COUNT] = {0};
+  while (!__atomic_load_n (&writer_done, __ATOMIC_ACQUIRE))
+  {
+    online_read_begin (&online, reader);
+    MarkovNode *node = online_get_start_node (&online, &rng);
+    for (int k = 0; node && k < WALK_LENGTH; ++k)
+    {
+      int value = test_value (node);
+      if (value == END) break;
+      if (value < 0 || value >= STATE_COUNT
+          || !valid_snapshot (node, seen_sums))
+      {
+        result->errors++;
+        break;
+      }
+      MarkovNode *next = online_get_next_node (node, &rng);
+      if (next && !valid_next (value, test_value (next)))
+      {
+        result->errors++;
+        break;
+      }
+      node = next;
+    }
+    online_read_end (&online, reader);
+  }
+  return NULL;
+}
+
+/**
+ * Once the writer is done, every published snapshot must match its node's
+ * counter list.
+ */
+static void check_published(MarkovChain *markov_chain)
+{
+  uint64_t total = 0;
+  for (int i = 0; i < markov_chain->database->size; ++i)
+  {
+    const MarkovNode *node = markov_chain->states[i];
+    const NodeSnapshot *snapshot = node->snapshot;
+    if (node->counter_list_size == 0)
+    {
+      CHECK (!snapshot || snapshot->size == 0);
+      continue;
+    }
+    if (!CHECK (snapshot != NULL)) continue;
+    CHECK (snapshot->size == node->counter_list_size);
+    CHECK (snapshot->sum == node->counter_list_sum);
+    uint64_t cumulative = 0;
+    for (size_t j = 0; j < snapshot->size && j < node->counter_list_size;
+         ++j)
+    {
+      cumulative += node->counter_list[j].frequency;
+      CHECK (snapshot->entries[j].cumulative == cumulative);
+      CHECK (snapshot->entries[j].next
+             == markov_chain->states[node->counter_list[j].next_id]);
+    }
+    total += node->counter_list_sum;
+  }
+  CHECK (total == transitions_added);
+}
+
+static void test_concurrent_readers(bool use_arena)
+{
+  MarkovChain *markov_chain = test_chain_create (use_arena);
+  writer_done = 0;
+  transitions_added = 0;
+  if (!CHECK (online_chain_init (&online, markov_chain, READERS)))
+  {
+    free_markov_chain (&markov_chain);
+    return;
+  }
+  pthread_t writer, readers[READERS];
+  ReaderResult results[READERS] = {{0}};
+  for (int i = 0; i < READERS; ++i)
+  {
+    results[i].seed = (uint64_t) i + 1;
+    pthread_create (readers + i, NULL, read_walks, results + i);
+  }
+  pthread_create (&writer, NULL, write_sequences, NULL);
+  pthread_join (writer, NULL);
+  for (int i = 0; i < READERS; ++i)
+  {
+    pthread_join (readers[i], NULL);
+    CHECK (results[i].registered);
+    CHECK (results[i].errors == 0);
+  }
+  // one more reader than max_readers is refused
+  size_t reader;
+  CHECK (!online_chain_register_reader (&online, &reader));
+  CHECK (markov_chain->database->size == STATE_COUNT + 1);
+  check_published (markov_chain);
+  online_chain_free (&online);
+  free_markov_chain (&markov_chain);
+}
+
+int main(void)
+{
+  test_concurrent_readers (true);
+  test_concurrent_readers (false);
+  return test_result ("test_online_chain");
+}
@@ -0,0 +1,77 @@
+#include "test_util.h"
+#include <string.h>
+
+#define MAX_LENGTH 5
+#define SEQUENCES 100
+
+static bool append_int(void *data, OutputBuffer *out)
+{
+  return output_buffer_append_number (out, *(int *) data)
+         && output_buffer_append (out, " ", 1);
+}
+
+/**
+ * Generate into an in memory buffer and compare with the expected text.
+ */
+static void check_sequence(MarkovChain *markov_chain, int first,
+                           const char *expected)
+{
+  OutputBuffer out;
+  if (!CHECK (output_buffer_init (&out, -1, 4))) return;
+  markov_chain->output = &out;
+  Rng rng;
+  rng_seed (&rng, 1);
+  generate_random_sequence (markov_chain, test_state (markov_chain, first),
+                            MAX_LENGTH, &rng);
+  markov_chain->output = NULL;
+  CHECK (out.size == strlen (expected)
+         && !memcmp (out.data, expected, out.size));
+  output_buffer_free (&out);
+}
+
+/**
+ * generate_random_sequence appends to the chain's output buffer through
+ * append_func, instead of printing, and stops at a last state or after
+ * max_length moves.
+ */
+static void test_append(bool use_arena)
+{
+  MarkovChain *markov_chain = test_chain_create (use_arena);
+  markov_chain->append_func = append_int;
+  test_transition (markov_chain, 0, 1, 1);
+  test_transition (markov_chain, 1, 2, 1);
+  test_transition (markov_chain, 2, -1, 1);
+  test_transition (markov_chain, 7, 7, 1);
+  check_sequence (markov_chain, 0, "0 1 2 -1 ");
+  check_sequence (markov_chain, 7, "7 7 7 7 7 7 ");
+
+  // many sequences from random start states, collected in one buffer
+  OutputBuffer out;
+  if (CHECK (output_buffer_init (&out, -1, 16)))
+  {
+    markov_chain->output = &out;
+    Rng rng;
+    rng_seed (&rng, 2);
+    for (int i = 0; i < SEQUENCES; ++i)
+    {
+      generate_random_sequence (markov_chain, NULL, MAX_LENGTH, &rng);
+    }
+    markov_chain->output = NULL;
+    size_t spaces = 0;
+    for (size_t i = 0; i < out.size; ++i)
+    {
+      spaces += out.data[i] == ' ';
+    }
+    CHECK (spaces >= 2 * SEQUENCES);
+    CHECK (spaces <= (MAX_LENGTH + 1) * SEQUENCES);
+    output_buffer_free (&out);
+  }
+  free_markov_chain (&markov_chain);
+}
+
+int main(void)
+{
+  test_append (true);
+  test_append (false);
+  return test_result ("test_output");
+}
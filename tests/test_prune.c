@@ -0,0 +1,452 @@
+#define _POSIX_C_SOURCE 200809L // For dup() and dup2()
+#include "test_util.h"
+#include <fcntl.h>
+#include <unistd.h>
+
+#define STATE_COUNT 200
+#define TRANSITIONS 400
+#define MAX_TIMES 9
+#define LAST_PERIOD 10 // one state in that many is a last state
+#define MIN_COUNT 2
+#define TOP_K 2
+
+/* Allocations fail once failing_allocations reaches 0, counted down by the
+ * wrappers of the allocation functions, see the test_prune target of the
+ * makefile. */
+
+static long failing_allocations = -1;
+
+void *__real_malloc (size_t size);
+void *__real_calloc (size_t count, size_t size);
+void *__real_realloc (void *pointer, size_t size);
+
+static bool allocation_fails(void)
+{
+  return failing_allocations >= 0 && failing_allocations-- == 0;
+}
+
+void *__wrap_malloc (size_t size)
+{
+  return allocation_fails () ? NULL : __real_malloc (size);
+}
+
+void *__wrap_calloc (size_t count, size_t size)
+{
+  return allocation_fails () ? NULL : __real_calloc (count, size);
+}
+
+void *__wrap_realloc (void *pointer, size_t size)
+{
+  return allocation_fails () ? NULL : __real_realloc (pointer, size);
+}
+
+/**
+ * Send stderr to /dev/null, where the allocation errors of the failing
+ * calls are reported.
+ * @return the saved stderr, for restore_stderr
+ */
+static int silence_stderr(void)
+{
+  fflush (stderr);
+  int saved = dup (STDERR_FILENO);
+  int null = open ("/dev/null", O_WRONLY);
+  if (saved >= 0 && null >= 0) dup2 (null, STDERR_FILENO);
+  if (null >= 0) close (null);
+  return saved;
+}
+
+static void restore_stderr(int saved)
+{
+  fflush (stderr);
+  if (saved < 0) return;
+  dup2 (saved, STDERR_FILENO);
+  close (saved);
+}
+
+/**
+ * Value of the i'th state of the random chains, negative for last states.
+ */
+static int state_value(size_t i)
+{
+  return i % LAST_PERIOD == LAST_PERIOD - 1 ? -(int) i - 1 : (int) i;
+}
+
+/**
+ * Train a chain on random transitions, most seen once and one in four 1 to
+ * MAX_TIMES times, and build its alias tables and frozen form.
+ */
+static MarkovChain *random_chain(bool use_arena, Rng *rng)
+{
+  MarkovChain *markov_chain = test_chain_create (use_arena);
+  for (size_t t = 0; t < TRANSITIONS; ++t)
+  {
+    int from = state_value (rng_below (rng, STATE_COUNT));
+    if (from < 0) continue;
+    test_transition (markov_chain, from,
+                     state_value (rng_below (rng, STATE_COUNT)),
+                     rng_below (rng, 4)
+                     ? 1 : 1 + (uint32_t) rng_below (rng, MAX_TIMES));
+  }
+  if (!freeze_sampling (markov_chain) || !freeze_markov_chain (markov_chain))
+  {
+    exit (EXIT_FAILURE);
+  }
+  return markov_chain;
+}
+
+/**
+ * Frequency of the transition between two states of a chain, by value, 0
+ * if either state or the transition is missing.
+ */
+static uint32_t frequency_of(MarkovChain *markov_chain, int from, int to)
+{
+  Node *first = get_node_from_database (markov_chain, &from);
+  Node *second = get_node_from_database (markov_chain, &to);
+  return first && second ? test_frequency (first->data, second->data) : 0;
+}
+
+/**
+ * Check what every rebuilt chain must hold: ids are positions, nodes point
+ * to their chain, sums match the counter lists, no transition has a zero
+ * frequency, and every start state has a transition and is not last.
+ */
+static void check_rebuilt(MarkovChain *markov_chain)
+{
+  CHECK (markov_chain->frozen == NULL);
+  for (int i = 0; i < markov_chain->database->size; ++i)
+  {
+    const MarkovNode *node = markov_chain->states[i];
+    CHECK (node->id == (size_t) i);
+    CHECK (node->chain == markov_chain);
+    CHECK (node->alias == NULL);
+    CHECK (node->counter_list_size <= node->counter_list_capacity);
+    size_t sum = 0;
+    for (size_t j = 0; j < node->counter_list_size; ++j)
+    {
+      CHECK (node->counter_list[j].frequency > 0);
+      CHECK (node->counter_list[j].next_id
+             < (uint32_t) markov_chain->database->size);
+      sum += node->counter_list[j].frequency;
+    }
+    CHECK (node->counter_list_sum == sum);
+  }
+  for (size_t i = 0; i < markov_chain->start_states_size; ++i)
+  {
+    const MarkovNode *node = markov_chain->start_states[i];
+    CHECK (node->counter_list_sum > 0);
+    CHECK (test_value (node) >= 0);
+  }
+}
+
+/**
+ * Decaying by one bit halves every count, and keeps exactly the states with
+ * a transition left in or out, in their order.
+ */
+static void test_decay(bool use_arena)
+{
+  Rng rng;
+  rng_seed (&rng, 7);
+  MarkovChain *markov_chain = random_chain (use_arena, &rng);
+  rng_seed (&rng, 7);
+  MarkovChain *reference = random_chain (use_arena, &rng);
+  if (!CHECK (decay_markov_chain (markov_chain, 1, NULL, NULL)))
+  {
+    free_markov_chain (&markov_chain);
+    free_markov_chain (&reference);
+    return;
+  }
+  check_rebuilt (markov_chain);
+
+  int kept = 0, previous_id = -1;
+  bool in_order = true;
+  for (int i = 0; i < reference->database->size; ++i)
+  {
+    MarkovNode *node = reference->states[i];
+    int value = test_value (node);
+    bool alive = false;
+    for (size_t j = 0; j < node->counter_list_size; ++j)
+    {
+      int next = test_value (reference->states
+                             [node->counter_list[j].next_id]);
+      uint32_t halved = node->counter_list[j].frequency >> 1;
+      CHECK (frequency_of (markov_chain, value, next) == halved);
+      alive = alive || halved;
+    }
+    for (int k = 0; !alive && k < reference->database->size; ++k)
+    {
+      alive = test_frequency (reference->states[k], node) > 1;
+    }
+    Node *decayed = get_node_from_database (markov_chain, &value);
+    CHECK ((decayed != NULL) == alive);
+    if (decayed)
+    {
+      kept++;
+      in_order = in_order && (int) decayed->data->id > previous_id;
+      previous_id = (int) decayed->data->id;
+    }
+  }
+  CHECK (in_order);
+  CHECK (kept == markov_chain->database->size);
+  CHECK (kept < reference->database->size);
+
+  // decaying every count away leaves an empty chain
+  CHECK (decay_markov_chain (markov_chain, 32, NULL, NULL));
+  CHECK (markov_chain->database->size == 0);
+  CHECK (markov_chain->start_states_size == 0);
+  free_markov_chain (&markov_chain);
+  free_markov_chain (&reference);
+}
+
+/**
+ * Check that a chain is still the chain it was copied from, frozen form and
+ * alias tables included.
+ */
+static void check_unchanged(MarkovChain *markov_chain, MarkovChain *reference,
+                            const FrozenChain *frozen)
+{
+  CHECK (markov_chain->frozen == frozen);
+  if (!CHECK (markov_chain->database->size == reference->database->size))
+  {
+    return;
+  }
+  CHECK (markov_chain->start_states_size == reference->start_states_size);
+  for (int i = 0; i < markov_chain->database->size; ++i)
+  {
+    const MarkovNode *node = markov_chain->states[i];
+    const MarkovNode *original = reference->states[i];
+    CHECK (test_value (node) == test_value (original));
+    CHECK (node->chain == markov_chain);
+    CHECK (node->counter_list_sum == original->counter_list_sum);
+    if (!CHECK (node->counter_list_size == original->counter_list_size))
+    {
+      continue;
+    }
+    for (size_t j = 0; j < node->counter_list_size; ++j)
+    {
+      CHECK (node->counter_list[j].next_id
+             == original->counter_list[j].next_id);
+      CHECK (node->counter_list[j].frequency
+             == original->counter_list[j].frequency);
+    }
+    CHECK (!node->counter_list_size
+           || (node->alias && node->alias->sum == node->counter_list_sum));
+  }
+}
+
+/**
+ * Prune with MIN_COUNT and TOP_K: every kept transition keeps its count,
+ * was among the TOP_K most frequent of its node with at least MIN_COUNT,
+ * and every kept state is reachable from a start state.
+ */
+static void test_prune(bool use_arena)
+{
+  Rng rng;
+  rng_seed (&rng, 5);
+  MarkovChain *markov_chain = random_chain (use_arena, &rng);
+  rng_seed (&rng, 5);
+  MarkovChain *reference = random_chain (use_arena, &rng);
+  size_t reclaimed = 0;
+  if (!CHECK (prune_markov_chain (markov_chain, MIN_COUNT, TOP_K,
+                                  &reclaimed)))
+  {
+    free_markov_chain (&markov_chain);
+    free_markov_chain (&reference);
+    return;
+  }
+  check_rebuilt (markov_chain);
+  CHECK (reclaimed > 0);
+  CHECK (markov_chain->database->size > 0);
+  CHECK (markov_chain->database->size < reference->database->size);
+
+  for (int i = 0; i < markov_chain->database->size; ++i)
+  {
+    const MarkovNode *node = markov_chain->states[i];
+    int value = test_value (node);
+    const MarkovNode *original = get_node_from_database (reference,
+                                                         &value)->data;
+    CHECK (node->counter_list_size <= TOP_K);
+    for (size_t j = 0; j < node->counter_list_size; ++j)
+    {
+      const NextNodeCounter *counter = node->counter_list + j;
+      int next = test_value (markov_chain->states[counter->next_id]);
+      CHECK (counter->frequency >= MIN_COUNT);
+      CHECK (counter->frequency == frequency_of (reference, value, next));
+      // fewer than TOP_K transitions of the node were more frequent
+      size_t above = 0;
+      for (size_t k = 0; k < original->counter_list_size; ++k)
+      {
+        above += original->counter_list[k].frequency > counter->frequency;
+      }
+      CHECK (above < TOP_K);
+    }
+  }
+
+  // every kept state is reached from the start states
+  size_t size = (size_t) markov_chain->database->size, stack_size = 0;
+  bool *reached = calloc (size, sizeof (bool));
+  size_t *stack = malloc (size * sizeof (size_t));
+  if (!reached || !stack) exit (EXIT_FAILURE);
+  for (size_t i = 0; i < markov_chain->start_states_size; ++i)
+  {
+    size_t id = markov_chain->start_states[i]->id;
+    if (!reached[id]) stack[stack_size++] = id;
+    reached[id] = true;
+  }
+  while (stack_size)
+  {
+    const MarkovNode *node = markov_chain->states[stack[--stack_size]];
+    for (size_t j = 0; j < node->counter_list_size; ++j)
+    {
+      size_t id = node->counter_list[j].next_id;
+      if (!reached[id]) stack[stack_size++] = id;
+      reached[id] = true;
+    }
+  }
+  for (size_t i = 0; i < size; ++i)
+  {
+    CHECK (reached[i]);
+  }
+  free (reached);
+  free (stack);
+  free_markov_chain (&markov_chain);
+  free_markov_chain (&reference);
+}
+
+/**
+ * Ties at the TOP_K'th frequency go to the transitions seen first, and the
+ * states no walk can reach anymore are dropped.
+ */
+static void test_prune_ties(bool use_arena)
+{
+  MarkovChain *markov_chain = test_chain_create (use_arena);
+  test_transition (markov_chain, 0, 1, 3);
+  test_transition (markov_chain, 0, 2, 2);
+  test_transition (markov_chain, 0, 3, 2);
+  test_transition (markov_chain, 0, 4, 2);
+  test_transition (markov_chain, 1, -1, 1);
+  test_transition (markov_chain, 2, -1, 1);
+  if (!CHECK (prune_markov_chain (markov_chain, 0, TOP_K, NULL)))
+  {
+    free_markov_chain (&markov_chain);
+    return;
+  }
+  check_rebuilt (markov_chain);
+  CHECK (markov_chain->database->size == 4);
+  CHECK (frequency_of (markov_chain, 0, 1) == 3);
+  CHECK (frequency_of (markov_chain, 0, 2) == 2);
+  int dropped = 3;
+  CHECK (get_node_from_database (markov_chain, &dropped) == NULL);
+  dropped = 4;
+  CHECK (get_node_from_database (markov_chain, &dropped) == NULL);
+  CHECK (frequency_of (markov_chain, 2, -1) == 1);
+  free_markov_chain (&markov_chain);
+}
+
+static bool decay_by_one_bit(MarkovChain *markov_chain)
+{
+  return decay_markov_chain (markov_chain, 1, NULL, NULL);
+}
+
+static bool prune(MarkovChain *markov_chain)
+{
+  return prune_markov_chain (markov_chain, MIN_COUNT, TOP_K, NULL);
+}
+
+/**
+ * Make each allocation of a rebuild fail in turn: the chain must come out
+ * exactly as it was, until the rebuild gets all its memory and succeeds.
+ * @param rebuild decay or prune the chain, false if it failed
+ */
+static void test_rebuild_failure(bool use_arena,
+                                 bool (*rebuild)(MarkovChain *))
+{
+  Rng rng;
+  rng_seed (&rng, 11);
+  MarkovChain *markov_chain = random_chain (use_arena, &rng);
+  rng_seed (&rng, 11);
+  MarkovChain *reference = random_chain (use_arena, &rng);
+  bool rebuilt = false;
+  long failures = 0;
+  int saved_stderr = silence_stderr ();
+  for (long n = 0; !rebuilt; ++n)
+  {
+    const FrozenChain *frozen = markov_chain->frozen;
+    failing_allocations = n;
+    rebuilt = rebuild (markov_chain);
+    failing_allocations = -1;
+    if (!rebuilt)
+    {
+      failures++;
+      check_unchanged (markov_chain, reference, frozen);
+    }
+  }
+  restore_stderr (saved_stderr);
+  CHECK (failures > 3);
+  check_rebuilt (markov_chain);
+  free_markov_chain (&markov_chain);
+  free_markov_chain (&reference);
+}
+
+/**
+ * Make each allocation of adding new next states to a node fail in turn,
+ * while its counter list grows past the size that gets a counter index:
+ * a failed add must leave the node as it was, and adding the same next
+ * states again must find them instead of duplicating them.
+ */
+static void test_counter_index_failure(void)
+{
+  const int next_count = 40;
+  MarkovChain *markov_chain = test_chain_create (false);
+  MarkovNode *first = test_state (markov_chain, 0);
+  for (int value = 1; value <= next_count; ++value)
+  {
+    test_state (markov_chain, value);
+  }
+  long failures = 0;
+  int saved_stderr = silence_stderr ();
+  for (int value = 1; value <= next_count; ++value)
+  {
+    MarkovNode *next = test_state (markov_chain, value);
+    bool added = false;
+    for (long n = 0; !added; ++n)
+    {
+      failing_allocations = n;
+      added = add_node_to_counter_list (first, next, markov_chain);
+      failing_allocations = -1;
+      if (!added)
+      {
+        failures++;
+        CHECK (first->counter_list_size == (size_t) value - 1);
+        CHECK (first->counter_list_sum == (size_t) value - 1);
+        CHECK (test_frequency (first, next) == 0);
+      }
+    }
+  }
+  restore_stderr (saved_stderr);
+  CHECK (failures > 3);
+  for (int value = 1; value <= next_count; ++value)
+  {
+    MarkovNode *next = test_state (markov_chain, value);
+    CHECK (add_node_to_counter_list (first, next, markov_chain));
+    CHECK (test_frequency (first, next) == 2);
+  }
+  CHECK (first->counter_list_size == (size_t) next_count);
+  CHECK (first->counter_list_sum == 2 * (size_t) next_count);
+  free_markov_chain (&markov_chain);
+}
+
+int main(void)
+{
+  test_decay (true);
+  test_decay (false);
+  test_prune (true);
+  test_prune (false);
+  test_prune_ties (true);
+  test_prune_ties (false);
+  test_rebuild_failure (true, decay_by_one_bit);
+  test_rebuild_failure (false, decay_by_one_bit);
+  test_rebuild_failure (true, prune);
+  test_rebuild_failure (false, prune);
+  test_counter_index_failure ();
+  return test_result ("test_prune");
+}
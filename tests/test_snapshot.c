@@ -0,0 +1,208 @@
+#define _POSIX_C_SOURCE 200809L // For mkstemp()
+#include "test_util.h"
+#include <string.h>
+#include <unistd.h> // For close(), unlink()
+
+#define FANOUT 12
+// offsets of the header fields of a snapshot file
+#define STATE_COUNT_OFFSET 8
+#define EDGE_COUNT_OFFSET 16
+#define PAYLOAD_SIZE_OFFSET 32
+#define HEADER_SIZE 40
+
+/**
+ * Build a chain with a start state of high fanout, whose counter list gets
+ * a counter index, a few chains of states and last states.
+ */
+static MarkovChain *build_chain(bool use_arena)
+{
+  MarkovChain *markov_chain = test_chain_create (use_arena);
+  for (int i = 1; i <= FANOUT; ++i)
+  {
+    test_transition (markov_chain, 0, i, (uint32_t) i);
+    test_transition (markov_chain, i, i % 3 ? i + 1 : -i, 2);
+  }
+  test_transition (markov_chain, -3, 7, 1);
+  return markov_chain;
+}
+
+/**
+ * Check that two chains have the same states, in the same order, with the
+ * same transitions and start states.
+ */
+static void check_same_chain(MarkovChain *loaded, MarkovChain *saved)
+{
+  if (!CHECK (loaded->database->size == saved->database->size)) return;
+  for (int i = 0; i < saved->database->size; ++i)
+  {
+    MarkovNode *a = loaded->states[i], *b = saved->states[i];
+    CHECK (test_value (a) == test_value (b));
+    CHECK (a->id == b->id);
+    CHECK (a->counter_list_sum == b->counter_list_sum);
+    if (!CHECK (a->counter_list_size == b->counter_list_size)) continue;
+    for (size_t j = 0; j < a->counter_list_size; ++j)
+    {
+      CHECK (a->counter_list[j].next_id == b->counter_list[j].next_id);
+      CHECK (a->counter_list[j].frequency == b->counter_list[j].frequency);
+    }
+  }
+  if (!CHECK (loaded->start_states_size == saved->start_states_size)) return;
+  for (size_t i = 0; i < saved->start_states_size; ++i)
+  {
+    CHECK (loaded->start_states[i]->id == saved->start_states[i]->id);
+  }
+}
+
+static unsigned char *read_file(const char *path, size_t *size)
+{
+  FILE *fp = fopen (path, "rb");
+  if (!fp) return NULL;
+  fseek (fp, 0, SEEK_END);
+  *size = (size_t) ftell (fp);
+  rewind (fp);
+  unsigned char *bytes = malloc (*size);
+  if (bytes && fread (bytes, 1, *size, fp) != *size)
+  {
+    free (bytes);
+    bytes = NULL;
+  }
+  fclose (fp);
+  return bytes;
+}
+
+static bool write_file(const char *path, const unsigned char *bytes,
+                       size_t size)
+{
+  FILE *fp = fopen (path, "wb");
+  if (!fp) return false;
+  bool success = fwrite (bytes, 1, size, fp) == size;
+  return !fclose (fp) && success;
+}
+
+/**
+ * Check that a modified copy of a snapshot is rejected and leaves the chain
+ * empty.
+ */
+static void check_rejected(const char *path, const unsigned char *bytes,
+                           size_t size)
+{
+  MarkovChain *markov_chain = test_chain_create (true);
+  CHECK (write_file (path, bytes, size));
+  CHECK (!load_markov_chain (markov_chain, path));
+  CHECK (markov_chain->database->size == 0);
+  CHECK (markov_chain->start_states_size == 0);
+  free_markov_chain (&markov_chain);
+}
+
+static void test_round_trip(const char *path, bool use_arena)
+{
+  MarkovChain *saved = build_chain (use_arena);
+  CHECK (save_markov_chain (saved, path));
+  MarkovChain *loaded = test_chain_create (use_arena);
+  CHECK (load_markov_chain (loaded, path));
+  check_same_chain (loaded, saved);
+
+  // loaded counter lists have exact capacities: growing them and their
+  // counter index must keep working
+  for (int i = 0; i < 4 * FANOUT; ++i)
+  {
+    test_transition (saved, 0, 100 + i, 1);
+    test_transition (loaded, 0, 100 + i, 1);
+  }
+  test_transition (loaded, 0, FANOUT, 1);
+  test_transition (saved, 0, FANOUT, 1);
+  check_same_chain (loaded, saved);
+  CHECK (test_frequency (test_state (loaded, 0), test_state (loaded, FANOUT))
+         == FANOUT + 1);
+  free_markov_chain (&saved);
+  free_markov_chain (&loaded);
+}
+
+static void test_corrupted(const char *path, const char *bad_path)
+{
+  MarkovChain *saved = build_chain (true);
+  CHECK (save_markov_chain (saved, path));
+  size_t size;
+  unsigned char *bytes = read_file (path, &size);
+  if (!CHECK (bytes != NULL)) return;
+  uint64_t n, e;
+  memcpy (&n, bytes + STATE_COUNT_OFFSET, sizeof (n));
+  memcpy (&e, bytes + EDGE_COUNT_OFFSET, sizeof (e));
+  CHECK (n == (uint64_t) saved->database->size);
+
+  check_rejected (bad_path, bytes, 0);
+  check_rejected (bad_path, bytes, HEADER_SIZE - 1);
+  check_rejected (bad_path, bytes, size - 1);
+
+  unsigned char *bad = malloc (size + 1);
+  if (!CHECK (bad != NULL)) return;
+  memcpy (bad, bytes, size);
+  bad[0] ^= 1; // magic
+  check_rejected (bad_path, bad, size);
+
+  // an edge count and payload size whose array sizes add up to the real
+  // file size once they wrap around 64 bits
+  size_t payload_offsets = HEADER_SIZE + (n + 1) * sizeof (uint64_t);
+  uint64_t payload_size;
+  memcpy (&payload_size, bytes + PAYLOAD_SIZE_OFFSET, sizeof (payload_size));
+  uint64_t wrapping = ((uint64_t) 1 << 61) - 1;
+  payload_size += 8 * e + 8;
+  memcpy (bad, bytes, size);
+  memcpy (bad + EDGE_COUNT_OFFSET, &wrapping, sizeof (wrapping));
+  memcpy (bad + HEADER_SIZE + n * sizeof (uint64_t), &wrapping,
+          sizeof (wrapping));
+  memcpy (bad + PAYLOAD_SIZE_OFFSET, &payload_size, sizeof (payload_size));
+  memcpy (bad + payload_offsets + n * sizeof (uint64_t), &payload_size,
+          sizeof (payload_size));
+  check_rejected (bad_path, bad, size);
+
+  memcpy (bad, bytes, size);
+  uint64_t huge = UINT64_MAX / 2;
+  memcpy (bad + STATE_COUNT_OFFSET, &huge, sizeof (huge));
+  check_rejected (bad_path, bad, size);
+
+  // the first next state id, out of range
+  size_t next_ids = HEADER_SIZE + 2 * (n + 1) * sizeof (uint64_t);
+  memcpy (bad, bytes, size);
+  uint32_t id = (uint32_t) n;
+  memcpy (bad + next_ids, &id, sizeof (id));
+  check_rejected (bad_path, bad, size);
+
+  // the first state's payload one byte short, which deserialize rejects
+  memcpy (bad, bytes, size);
+  uint64_t offset;
+  memcpy (&offset, bad + payload_offsets + sizeof (uint64_t), sizeof (offset));
+  offset--;
+  memcpy (bad + payload_offsets + sizeof (uint64_t), &offset, sizeof (offset));
+  check_rejected (bad_path, bad, size);
+
+  // the unmodified bytes still load
+  MarkovChain *loaded = test_chain_create (true);
+  CHECK (write_file (bad_path, bytes, size));
+  CHECK (load_markov_chain (loaded, bad_path));
+  check_same_chain (loaded, saved);
+  free_markov_chain (&loaded);
+  free_markov_chain (&saved);
+  free (bad);
+  free (bytes);
+}
+
+int main(void)
+{
+  char path[] = "/tmp/markov_snapshot_XXXXXX";
+  char bad_path[] = "/tmp/markov_snapshot_bad_XXXXXX";
+  int fd = mkstemp (path), bad_fd = mkstemp (bad_path);
+  if (fd < 0 || bad_fd < 0)
+  {
+    fprintf (stderr, "test_snapshot: cannot create temporary files\n");
+    return EXIT_FAILURE;
+  }
+  close (fd);
+  close (bad_fd);
+  test_round_trip (path, true);
+  test_round_trip (path, false);
+  test_corrupted (path, bad_path);
+  unlink (path);
+  unlink (bad_path);
+  return test_result ("test_snapshot");
+}
@@ -0,0 +1,157 @@
+#include "test_util.h"
+#include <string.h>
+
+#define TEST_ARENA_BLOCK_SIZE 4096
+
+static int checks = 0;
+static int failures = 0;
+
+bool test_check (bool passed, const char *expression, const char *file,
+                 int line)
+{
+  checks++;
+  if (!passed)
+  {
+    failures++;
+    fprintf (stderr, "%s:%d: check failed: %s\n", file, line, expression);
+  }
+  return passed;
+}
+
+int test_result (const char *name)
+{
+  fprintf (stderr, "%s: %d of %d checks failed\n", name, failures, checks);
+  return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static void print_int (void *data)
+{
+  fprintf (stdout, "%d ", *(int *) data);
+}
+
+static int comp_int (void *first, void *second)
+{
+  int a = *(int *) first, b = *(int *) second;
+  return (a > b) - (a < b);
+}
+
+static size_t hash_int (void *data)
+{
+  return (size_t) (unsigned) *(int *) data * (size_t) 0x9E3779B97F4A7C15ULL;
+}
+
+static void *copy_int (void *data)
+{
+  int *copy = malloc (sizeof (int));
+  if (copy) *copy = *(int *) data;
+  return copy;
+}
+
+static void *arena_copy_int (void *data, Arena *arena)
+{
+  int *copy = arena_alloc (arena, sizeof (int));
+  if (copy) *copy = *(int *) data;
+  return copy;
+}
+
+static bool is_last_int (void *data)
+{
+  return *(int *) data < 0;
+}
+
+static size_t serialize_int (void *data, unsigned char *buffer,
+                             size_t capacity)
+{
+  if (capacity >= sizeof (int)) memcpy (buffer, data, sizeof (int));
+  return sizeof (int);
+}
+
+/* Loaded data is owned like the chain's copies: in the arena if the chain
+ * has arena_copy, on the heap otherwise. */
+
+static void *deserialize_int (const unsigned char *bytes, size_t size,
+                              Arena *arena)
+{
+  if (size != sizeof (int)) return NULL;
+  int value;
+  memcpy (&value, bytes, sizeof (int));
+  return arena_copy_int (&value, arena);
+}
+
+static void *deserialize_int_heap (const unsigned char *bytes, size_t size,
+                                   Arena *arena)
+{
+  (void) arena;
+  if (size != sizeof (int)) return NULL;
+  int value;
+  memcpy (&value, bytes, sizeof (int));
+  return copy_int (&value);
+}
+
+MarkovChain *test_chain_create (bool use_arena)
+{
+  MarkovChain *markov_chain = calloc (1, sizeof (MarkovChain));
+  LinkedList *list = calloc (1, sizeof (LinkedList));
+  Arena *arena = use_arena ? arena_create (TEST_ARENA_BLOCK_SIZE) : NULL;
+  if (!markov_chain || !list || (use_arena && !arena))
+  {
+    fprintf (stderr, ALLOCATION_ERROR_MASSAGE);
+    exit (EXIT_FAILURE);
+  }
+  markov_chain->database = list;
+  markov_chain->print_func = print_int;
+  markov_chain->comp_func = comp_int;
+  markov_chain->hash_func = hash_int;
+  markov_chain->free_data = free;
+  markov_chain->copy_func = copy_int;
+  markov_chain->is_last = is_last_int;
+  markov_chain->arena = arena;
+  markov_chain->arena_copy = use_arena ? arena_copy_int : NULL;
+  markov_chain->serialize = serialize_int;
+  markov_chain->deserialize = use_arena ? deserialize_int
+                                        : deserialize_int_heap;
+  return markov_chain;
+}
+
+MarkovNode *test_state (MarkovChain *markov_chain, int value)
+{
+  Node *node = add_to_database (markov_chain, &value);
+  if (!node)
+  {
+    fprintf (stderr, ALLOCATION_ERROR_MASSAGE);
+    exit (EXIT_FAILURE);
+  }
+  return node->data;
+}
+
+MarkovNode *test_transition (MarkovChain *markov_chain, int from, int to,
+                             uint32_t times)
+{
+  MarkovNode *first = test_state (markov_chain, from);
+  MarkovNode *second = test_state (markov_chain, to);
+  for (uint32_t i = 0; i < times; ++i)
+  {
+    if (!add_node_to_counter_list (first, second, markov_chain))
+    {
+      exit (EXIT_FAILURE);
+    }
+  }
+  return first;
+}
+
+int test_value (const MarkovNode *node)
+{
+  return *(const int *) node->data;
+}
+
+uint32_t test_frequency (const MarkovNode *from, const MarkovNode *to)
+{
+  for (size_t i = 0; i < from->counter_list_size; ++i)
+  {
+    if (from->counter_list[i].next_id == to->id)
+    {
+      return from->counter_list[i].frequency;
+    }
+  }
+  return 0;
+}
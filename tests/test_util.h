@@ -0,0 +1,56 @@
+#ifndef _TEST_UTIL_H_
+#define _TEST_UTIL_H_
+#include "markov_chain.h"
+
+/**
+ * Record a failed check with its location, and go on with the test.
+ */
+#define CHECK(condition) \
+test_check ((condition), #condition, __FILE__, __LINE__)
+
+/**
+ * Record the result of a check, printing it to stderr if it failed.
+ * @return the result
+ */
+bool test_check (bool passed, const char *expression, const char *file,
+                 int line);
+
+/**
+ * Print the number of failed checks.
+ * @param name name of the test program
+ * @return EXIT_SUCCESS if no check failed, EXIT_FAILURE otherwise
+ */
+int test_result (const char *name);
+
+/**
+ * Create an empty chain whose states are ints. Negative ints are last
+ * states. The chain can save and load snapshots.
+ * @param use_arena true to allocate the nodes and ints from an arena
+ * @return the chain, exits in case of allocation error
+ */
+MarkovChain *test_chain_create (bool use_arena);
+
+/**
+ * Get the node of an int state of a test chain, adding it if needed.
+ * @return the node, exits in case of allocation error
+ */
+MarkovNode *test_state (MarkovChain *markov_chain, int value);
+
+/**
+ * Add a transition between two int states of a test chain some times.
+ * @return the node of the first state, exits in case of allocation error
+ */
+MarkovNode *test_transition (MarkovChain *markov_chain, int from, int to,
+                             uint32_t times);
+
+/**
+ * Get the int a node of a test chain holds.
+ */
+int test_value (const MarkovNode *node);
+
+/**
+ * Frequency of the transition between two nodes, 0 if there is none.
+ */
+uint32_t test_frequency (const MarkovNode *from, const MarkovNode *to);
+
+#endif //_TEST_UTIL_H_
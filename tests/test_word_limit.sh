@@ -0,0 +1,31 @@
+#!/bin/sh
+# Checks that the number of words to read counts the states of a loaded
+# snapshot: training stops once the chain holds that many states, even if
+# the snapshot already held more.
+set -e
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+fail() {
+  echo "test_word_limit: $1" >&2
+  exit 1
+}
+
+printf 'a b c d.\nb c a e.\n' > "$dir/first.txt"
+i=0
+while [ $i -lt 50 ]; do
+  echo "zz1 zz2 zz3 zz4." >> "$dir/second.txt"
+  i=$((i + 1))
+done
+./tweets_generator 1 1 "$dir/first.txt" --save="$dir/first.snap" > /dev/null
+
+# the snapshot holds 5 states: a limit of 7 adds zz1 and zz2 only
+./tweets_generator 1 300 "$dir/second.txt" 7 --load="$dir/first.snap" \
+  > "$dir/seven.txt"
+grep -q zz2 "$dir/seven.txt" || fail "a limit of 7 did not add zz2"
+grep -q zz3 "$dir/seven.txt" && fail "a limit of 7 added zz3"
+
+# a limit below the snapshot's size stops at the first word
+./tweets_generator 1 300 "$dir/second.txt" 3 --load="$dir/first.snap" \
+  > "$dir/three.txt"
+grep -q zz2 "$dir/three.txt" && fail "a limit of 3 added zz2"
+echo "test_word_limit: passed"
@@ -1,62 +1,134 @@
+#define _POSIX_C_SOURCE 200809L // For fileno(), mmap()
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <ctype.h>
 #include "markov_chain.h"
 #include "linked_list.h"
-#define MAX_LINE 1000
+#include "string_pool.h"
+#include "context_pool.h"
+#include "batch.h"
+#include <pthread.h>
+#include <sys/mman.h> // For mmap()
+#include <sys/stat.h> // For fstat()
+#define READ_BLOCK_SIZE (1 << 16)
 #define INPUT_1 5
 #define INPUT_2 4
+#define INPUT_3 3
 #define MAX_WORDS_IN_TWEET 20
+#define ARENA_BLOCK_SIZE (1 << 20)
+#define TWEETS_PER_BATCH 65536
+#define OUTPUT_BLOCK_SIZE (1 << 16)
+#define MAX_ORDER 8
+
+/**
+ * The pools the states of a chain are interned in. Words get 32 bit ids in
+ * a StringPool, and a state is the Context of the last order word ids.
+ */
+typedef struct Vocabulary {
+    StringPool *words;
+    ContextPool *contexts;
+} Vocabulary;
+
+/* States are interned Contexts, so equal states are equal pointers and all
+ * the callbacks below work on the pointers directly. A state prints as the
+ * last word of its context. */
 
 static void print_func_char(void *data)
 {
-  char *s = (char *) data;
+  const char *s = ((const Context *) data)->last;
   fprintf (stdout, "%s\n", s);
 }
 
+static bool append_func_char(void *data, OutputBuffer *out)
+{
+  return output_buffer_append_string (out, ((const Context *) data)->last)
+         && output_buffer_append (out, "\n", 1);
+}
+
 static int comp_func_char (void *data_one, void *data_two)
 {
-  return strcmp ((char *) data_one, (char *) data_two);
+  // relational operators are only defined on pointers into the same object
+  uintptr_t one = (uintptr_t) data_one, two = (uintptr_t) data_two;
+  return (one > two) - (one < two);
+}
+
+static size_t hash_func_char (void *data)
+{
+  return ((const Context *) data)->hash;
 }
 
 static void free_data_char (void *data)
 {
-  char *s = (char *) data;
-  free (s);
-  s = NULL;
+  // the string belongs to the pool
+  (void) data;
 }
 
-static size_t get_size (char *data_ptr)
+static void *copy_func_char (void *data)
 {
+  return data;
+}
 
+// the vocabulary of the chain that is saved or loaded, which snapshot
+// states are words of
+static Vocabulary *snapshot_vocabulary = NULL;
+
+/* A state is saved as the words of its context separated by spaces, so
+ * first order snapshots hold plain words. */
+
+static size_t serialize_char (void *data, unsigned char *buffer,
+                              size_t capacity)
+{
+  const Context *context = (const Context *) data;
   size_t size = 0;
-  while (strcmp (data_ptr, "\0") != 0)
+  for (size_t i = 0; i < snapshot_vocabulary->contexts->order; ++i)
   {
-    data_ptr++;
-    size++;
+    const char *word = string_pool_string (snapshot_vocabulary->words,
+                                           context->tokens[i]);
+    size_t length = strlen (word);
+    if (i > 0 && size < capacity) buffer[size] = ' ';
+    size += i > 0;
+    if (size + length <= capacity) memcpy (buffer + size, word, length);
+    size += length;
   }
-  size++;
   return size;
 }
 
-static void *copy_func_char (void *data)
+static void *deserialize_char (const unsigned char *bytes, size_t size,
+                               Arena *arena)
 {
-  char *s = (char *) data;
-  char *p = malloc (sizeof (char) * get_size(s));
-  if (!p) return NULL;
-  strcpy (p, s);
-  return p;
+  (void) arena;
+  const char *chars = (const char *) bytes;
+  size_t order = snapshot_vocabulary->contexts->order, count = 0, i = 0;
+  uint32_t tokens[MAX_ORDER];
+  const char *word = NULL;
+  while (i < size)
+  {
+    size_t start = i;
+    while (i < size && chars[i] != ' ') i++;
+    word = count < order ? string_pool_intern (snapshot_vocabulary->words,
+                                               chars + start, i - start)
+                         : NULL;
+    if (!word) return NULL; // allocation error or a different order
+    tokens[count++] = string_pool_id (word);
+    i++;
+  }
+  if (count != order) return NULL;
+  return (void *) context_pool_intern (snapshot_vocabulary->contexts, tokens,
+                                      word);
 }
 
-static bool is_last_char (void *data)
+static bool ends_sentence (const char *word)
 {
-  char *s = (char *) data;
-  if (!strcmp (s + strlen (s) - 1, "."))
+  if (!strcmp (word + strlen (word) - 1, "."))
     return true;
   return false;
 }
 
+static bool is_last_char (void *data)
+{
+  return ends_sentence (((const Context *) data)->last);
+}
+
 /**
  * Create and allocate new memory for markov chain and linked list.
  * Also initialize them.
@@ -64,9 +136,14 @@ static bool is_last_char (void *data)
  */
 static MarkovChain *initialize_markov_chain(
     Print_Func print_func,
+    Append_Func append_func,
     Comp_Func comp_func,
+    Hash_Func hash_func,
     Free_Data free_data,
     Copy_Func copy_func,
+    Arena_Copy_Func arena_copy,
+    Serialize_Func serialize,
+    Deserialize_Func deserialize,
     Is_Last is_last
 )
 {
@@ -81,197 +158,921 @@ static MarkovChain *initialize_markov_chain(
     return NULL;
   }
 
+  Arena *arena = arena_create (ARENA_BLOCK_SIZE);
+  if (!arena)
+  {
+    free (list);
+    list = NULL;
+    free (markov_chain);
+    markov_chain = NULL;
+    return NULL;
+  }
+
   list->first = NULL;
   list->last = NULL;
   list->size = 0;
   markov_chain->database = list;
+  markov_chain->index = NULL;
+  markov_chain->states = NULL;
+  markov_chain->states_capacity = 0;
+  markov_chain->start_states = NULL;
+  markov_chain->start_states_size = 0;
+  markov_chain->start_states_capacity = 0;
+  markov_chain->frozen = NULL;
   markov_chain->print_func = print_func;
+  markov_chain->append_func = append_func;
+  markov_chain->output = NULL;
   markov_chain->comp_func = comp_func;
+  markov_chain->hash_func = hash_func;
   markov_chain->free_data = free_data;
   markov_chain->copy_func = copy_func;
   markov_chain->is_last = is_last;
+  markov_chain->arena = arena;
+  markov_chain->arena_copy = arena_copy;
+  markov_chain->serialize = serialize;
+  markov_chain->deserialize = deserialize;
+  memset (&markov_chain->stats, 0, sizeof (MarkovStats));
   return markov_chain;
 }
 
 /**
- * Check if the word is already exist in the markov chain.
- * @param markov_chain the chain we search on.
- * @param word the word we search.
- * @return True \ False value.
+ * Create the empty pools of a vocabulary.
+ * @param vocabulary the vocabulary to fill.
+ * @param order number of words in a state.
+ * @return true on success, false in case of allocation error.
+ */
+static bool create_vocabulary(Vocabulary *vocabulary, size_t order)
+{
+  vocabulary->words = string_pool_create ();
+  vocabulary->contexts = context_pool_create (order);
+  return vocabulary->words && vocabulary->contexts;
+}
+
+static void free_vocabulary(Vocabulary *vocabulary)
+{
+  string_pool_free (&vocabulary->words);
+  context_pool_free (&vocabulary->contexts);
+}
+
+/**
+ * Tweets written from the chain trained so far while a corpus is still
+ * being read, to follow a stream.
+ */
+typedef struct Publisher {
+    size_t every; // number of blocks read between two publications
+    long num_of_tweets; // tweets per publication
+    uint64_t seed; // publication k is written with seed + k
+    size_t thread_count;
+    size_t count; // number of publications so far
+} Publisher;
+
+/**
+ * State of a training pass over a corpus, shared by the corpus readers.
+ */
+typedef struct Trainer {
+    MarkovChain *markov_chain;
+    Vocabulary *vocabulary; // the pools the chain's states are interned in
+    MarkovNode *prev; // the last state added, NULL at a sentence start
+    int words_to_read; // stop once the database holds that many states
+    uint32_t window[MAX_ORDER]; // ids of the last words of the sentence
+    size_t filled; // number of ids in window
+    size_t words_fed; // number of words fed so far
+    size_t word_limit; // stop once that many words were fed
+    size_t lead; // words fed until the first state, SIZE_MAX before it
+    size_t max_states; // decay the chain when it grows past that many
+                       // states, 0 for no limit
+    Publisher *publisher; // NULL to write no tweets while training
+} Trainer;
+
+/**
+ * Start a training pass on the chain.
+ */
+static void start_training(Trainer *trainer, MarkovChain *markov_chain,
+                           Vocabulary *vocabulary, int words_to_read)
+{
+  trainer->markov_chain = markov_chain;
+  trainer->vocabulary = vocabulary;
+  trainer->prev = NULL;
+  trainer->words_to_read = words_to_read;
+  trainer->filled = 0;
+  trainer->words_fed = 0;
+  trainer->word_limit = SIZE_MAX;
+  trainer->lead = SIZE_MAX;
+  trainer->max_states = 0;
+  trainer->publisher = NULL;
+}
+
+typedef enum TrainStatus {
+    TRAIN_ERROR, // allocation error
+    TRAIN_DONE, // the database is full
+    TRAIN_MORE // keep feeding words
+} TrainStatus;
+
+static bool is_separator(char c)
+{
+  return c == ' ' || c == '\n' || c == '\t' || c == '\r' || c == '\v'
+         || c == '\f';
+}
+
+/**
+ * Add one word to the chain. The word slides the window of the last order
+ * words of the sentence. Once the window is full, its context is looked up
+ * or inserted in the database in one step, with a transition from the
+ * previous state. A word ending a sentence empties the window.
+ * @param trainer the training state.
+ * @param word the characters of the word, not null terminated.
+ * @param length number of characters in word.
+ * @return TRAIN_MORE, TRAIN_DONE once the database is full or the word
+ * limit is reached, or TRAIN_ERROR.
  */
-static bool word_in_chain(MarkovChain *markov_chain, char *word)
+static TrainStatus add_word(Trainer *trainer, const char *word,
+                            size_t length)
 {
-  Node *p = markov_chain->database->first;
-  for (int i = 0; i < markov_chain->database->size; ++i)
+  MarkovChain *markov_chain = trainer->markov_chain;
+  Vocabulary *vocabulary = trainer->vocabulary;
+  size_t order = vocabulary->contexts->order;
+  const char *handle = string_pool_intern (vocabulary->words, word, length);
+  if (!handle) return TRAIN_ERROR;
+  trainer->words_fed++;
+  if (trainer->filled == order)
   {
-    if (!strcmp (word, (char *) p->data->data)) return true;
+    memmove (trainer->window, trainer->window + 1,
+             (order - 1) * sizeof (uint32_t));
+    trainer->filled--;
+  }
+  trainer->window[trainer->filled++] = string_pool_id (handle);
 
-    p = p->next;
+  if (trainer->filled == order)
+  {
+    const Context *context = context_pool_intern (vocabulary->contexts,
+                                                  trainer->window, handle);
+    if (!context) return TRAIN_ERROR;
+    Node *current = add_to_database (markov_chain, (void *) context);
+    if (!current) return TRAIN_ERROR;
+    if (trainer->prev && !add_node_to_counter_list (trainer->prev,
+                                                    current->data,
+                                                    markov_chain))
+    {
+      return TRAIN_ERROR;
+    }
+    trainer->prev = current->data;
+    if (trainer->lead == SIZE_MAX) trainer->lead = trainer->words_fed;
   }
-  return false;
+  if (ends_sentence (handle))
+  {
+    trainer->prev = NULL;
+    trainer->filled = 0;
+  }
+  // a loaded or decayed chain may already be past the target
+  if ((trainer->words_to_read >= 0
+       && markov_chain->database->size >= trainer->words_to_read)
+      || trainer->words_fed == trainer->word_limit)
+  {
+    return TRAIN_DONE;
+  }
+  return TRAIN_MORE;
+}
+
+/**
+ * Feed the whitespace separated words of a byte range to the trainer.
+ * @param trainer the training state.
+ * @param bytes the bytes to tokenize.
+ * @param length number of bytes.
+ * @param final true if no bytes follow, so a word running to the end of
+ * the range is complete.
+ * @param consumed set to the number of bytes fed, the rest being the start
+ * of a word that continues after the range.
+ * @return status of the last add_word, TRAIN_MORE if there was no word.
+ */
+static TrainStatus tokenize(Trainer *trainer, const char *bytes,
+                            size_t length, bool final, size_t *consumed)
+{
+  size_t i = 0;
+  TrainStatus status = TRAIN_MORE;
+  *consumed = 0;
+  while (status == TRAIN_MORE)
+  {
+    while (i < length && is_separator (bytes[i])) i++;
+    size_t start = i;
+    while (i < length && !is_separator (bytes[i])) i++;
+    if (i == start || (i == length && !final))
+    {
+      *consumed = start;
+      break;
+    }
+    status = add_word (trainer, bytes + start, i - start);
+    *consumed = i;
+  }
+  return status;
 }
 
+static int decay_chain(Trainer *trainer);
+static int publish_tweets(Trainer *trainer);
+
 /**
- * Remove spaces from the word and clean it from ' ' or '\n'.
- * @param word the word we want to remove spaces from her.
- * @return Pointer to the word after the removing.
+ * Read the corpus in big blocks and train the chain on it in one pass.
+ * A word cut by a block boundary is carried to the next block, and the
+ * buffer grows for words longer than a block, so lines of any length work.
+ * When the trainer has a state limit, the chain is decayed after each block
+ * that takes it past the limit, so an endless stream trains in bounded
+ * memory. When it has a publisher, tweets are written every so many
+ * blocks, so an endless stream gives output as it goes.
+ * @param fp the file to read, possibly a pipe.
+ * @param trainer the training state.
+ * @return 1 on success, 0 in case of allocation error.
  */
-static char *remove_spaces(char *word)
+static int fill_database(FILE *fp, Trainer *trainer)
 {
-  char *end;
-  while(isspace((unsigned char)*word))
+  size_t capacity = READ_BLOCK_SIZE, kept = 0, blocks = 0;
+  char *buffer = malloc (capacity);
+  if (!buffer) return 0;
+
+  TrainStatus status = TRAIN_MORE;
+  while (status == TRAIN_MORE)
   {
-    word++;
+    if (kept == capacity)
+    {
+      char *tmp = realloc (buffer, capacity * 2);
+      if (!tmp)
+      {
+        status = TRAIN_ERROR;
+        break;
+      }
+      buffer = tmp;
+      capacity *= 2;
+    }
+    size_t read = fread (buffer + kept, 1, capacity - kept, fp);
+    size_t end = kept + read, consumed;
+    status = tokenize (trainer, buffer, end, read == 0, &consumed);
+    if (status == TRAIN_MORE && trainer->max_states
+        && (size_t) trainer->markov_chain->database->size
+           > trainer->max_states
+        && !decay_chain (trainer))
+    {
+      status = TRAIN_ERROR;
+    }
+    if (status == TRAIN_MORE && read > 0 && trainer->publisher
+        && ++blocks % trainer->publisher->every == 0
+        && !publish_tweets (trainer))
+    {
+      status = TRAIN_ERROR;
+    }
+    if (read == 0) break;
+    kept = end - consumed;
+    memmove (buffer, buffer + consumed, kept);
   }
+  free (buffer);
+  return status != TRAIN_ERROR;
+}
 
-  if(*word == 0)
+/**
+ * Map the whole corpus read only, for one sequential pass.
+ * @param fp the file to map.
+ * @param size set to the number of bytes mapped.
+ * @return the mapped bytes, NULL if the file is empty or cannot be mapped,
+ * e.g. when it is a pipe.
+ */
+static const char *map_corpus(FILE *fp, size_t *size)
+{
+  struct stat file_stat;
+  if (fstat (fileno (fp), &file_stat) || !S_ISREG (file_stat.st_mode)
+      || file_stat.st_size == 0)
   {
-    return word;
+    return NULL;
   }
+  *size = (size_t) file_stat.st_size;
+  const char *bytes = mmap (NULL, *size, PROT_READ, MAP_PRIVATE,
+                            fileno (fp), 0);
+  if (bytes == MAP_FAILED) return NULL;
+  posix_madvise ((void *) bytes, *size, POSIX_MADV_SEQUENTIAL);
+  return bytes;
+}
 
-  end = word + strlen(word) - 1;
-  while(end > word && isspace((unsigned char)*end))
+/**
+ * Train the chain on the corpus through a read only memory mapping of the
+ * file, tokenizing the mapped bytes directly with no read buffer. Builds
+ * the same chain as fill_database. Falls back to it when the file cannot be
+ * mapped.
+ * @param fp the file to read.
+ * @param trainer the training state.
+ * @return 1 on success, 0 in case of allocation error.
+ */
+static int fill_database_mmap(FILE *fp, Trainer *trainer)
+{
+  size_t size;
+  const char *bytes = map_corpus (fp, &size);
+  if (!bytes)
   {
-    end--;
+    return fill_database (fp, trainer);
   }
+  size_t consumed;
+  TrainStatus status = tokenize (trainer, bytes, size, true, &consumed);
+  munmap ((void *) bytes, size);
+  return status != TRAIN_ERROR;
+}
+
+/**
+ * One byte range of the corpus, trained on its own thread into a chain and
+ * vocabulary of its own.
+ */
+typedef struct Shard {
+    Trainer trainer;
+    Vocabulary vocabulary;
+    const char *bytes;
+    size_t length;
+    TrainStatus status;
+} Shard;
 
-  end[1] = '\0';
-  return word;
+static void *train_shard(void *arg)
+{
+  Shard *shard = arg;
+  size_t consumed;
+  shard->status = tokenize (&shard->trainer, shard->bytes, shard->length,
+                            true, &consumed);
+  return NULL;
 }
 
+/**
+ * A pair of vocabularies to translate states between.
+ */
+typedef struct Translation {
+    const Vocabulary *from;
+    Vocabulary *to;
+} Translation;
+
+/**
+ * Translate a word id of one vocabulary to the id of the same word in
+ * another, interning it there if needed.
+ * @return the word in the target vocabulary, NULL in case of allocation
+ * error.
+ */
+static const char *translate_word(const Translation *translation,
+                                  uint32_t id)
+{
+  const char *word = string_pool_string (translation->from->words, id);
+  return string_pool_intern (translation->to->words, word, strlen (word));
+}
 
-static int fill_database(FILE *fp, int words_to_read,
-                         MarkovChain *markov_chain)
+/**
+ * Translate a state of a shard to the same state in the given vocabulary.
+ */
+static void *translate_context(void *data, void *context)
 {
-  Node *p;
-  Node *current;
-  Node *prev;
-  char line[MAX_LINE];
-  char *word;
+  const Translation *translation = context;
+  const Context *state = data;
+  uint32_t tokens[MAX_ORDER];
+  const char *word = NULL;
+  for (size_t i = 0; i < translation->to->contexts->order; ++i)
+  {
+    word = translate_word (translation, state->tokens[i]);
+    if (!word) return NULL;
+    tokens[i] = string_pool_id (word);
+  }
+  return (void *) context_pool_intern (translation->to->contexts, tokens,
+                                      word);
+}
 
-  while (fgets (line, MAX_LINE, fp))
+/**
+ * Halve the counts of the trainer's chain, dropping its rare states and
+ * transitions, until it holds at most half its state limit. Each round
+ * moves the chain into a new vocabulary that only holds the words of the
+ * kept states and of the trainer's window, so the pools shrink with the
+ * chain. The window goes on, and so does the last state if it was kept.
+ * @return 1 on success, 0 in case of allocation error.
+ */
+static int decay_chain(Trainer *trainer)
+{
+  MarkovChain *markov_chain = trainer->markov_chain;
+  while ((size_t) markov_chain->database->size > trainer->max_states / 2)
   {
-    word = strtok (line, " ");
-    while (word)
+    Vocabulary vocabulary;
+    if (!create_vocabulary (&vocabulary, trainer->vocabulary->contexts->order))
     {
-      word = remove_spaces (word);
-      if (markov_chain->database->size == 0)
-      {
-        add_to_database (markov_chain,
-                         (void *) word);
-        p = markov_chain->database->first;
-      }
-      else if (word_in_chain(markov_chain, word))
-      {
-        current = get_node_from_database (markov_chain, (void *) word);
-        if (p && !markov_chain->is_last ((void *) (prev->data->data)))
-        {
-          add_node_to_counter_list (prev->data,
-                                    current->data, markov_chain);
-        }
-        prev = current;
-        word = strtok (NULL, " ");
-        continue;
-      }
-      else
-      {
-        add_to_database (markov_chain, (void *) word);
-        p = p->next;
-        if (p && !markov_chain->is_last ((void *) (prev->data->data)))
-        {
-          add_node_to_counter_list (prev->data, p->data,
-                                    markov_chain);
-        }
-      }
+      free_vocabulary (&vocabulary);
+      return 0;
+    }
+    Translation translation = {trainer->vocabulary, &vocabulary};
+    uint32_t window[MAX_ORDER];
+    bool success = true;
+    for (size_t i = 0; success && i < trainer->filled; ++i)
+    {
+      const char *word = translate_word (&translation, trainer->window[i]);
+      success = word != NULL;
+      if (word) window[i] = string_pool_id (word);
+    }
+    void *prev = NULL;
+    if (success && trainer->prev)
+    {
+      prev = translate_context (trainer->prev->data, &translation);
+      success = prev != NULL;
+    }
+    if (!success || !decay_markov_chain (markov_chain, 1, translate_context,
+                                         &translation))
+    {
+      free_vocabulary (&vocabulary);
+      return 0;
+    }
+    free_vocabulary (trainer->vocabulary);
+    *trainer->vocabulary = vocabulary;
+    memcpy (trainer->window, window, trainer->filled * sizeof (uint32_t));
+    Node *node = prev ? get_node_from_database (markov_chain, prev) : NULL;
+    trainer->prev = node ? node->data : NULL;
+  }
+  return 1;
+}
 
-      if (!p)
-      {
-        return 0;
-      }
-      prev = p;
-      if (markov_chain->database->size == words_to_read)
-      {
-        return 1;
-      }
-      word = strtok (NULL, " ");
+/**
+ * Carry the trainer on from where a merged shard stopped: its window and
+ * its last state.
+ * @return 1 on success, 0 in case of allocation error.
+ */
+static int continue_from_shard(Trainer *trainer, Shard *shard)
+{
+  Translation translation = {&shard->vocabulary, trainer->vocabulary};
+  for (size_t i = 0; i < shard->trainer.filled; ++i)
+  {
+    const char *word = translate_word (&translation,
+                                       shard->trainer.window[i]);
+    if (!word) return 0;
+    trainer->window[i] = string_pool_id (word);
+  }
+  trainer->filled = shard->trainer.filled;
+  trainer->prev = NULL;
+  if (shard->trainer.prev)
+  {
+    void *state = translate_context (shard->trainer.prev->data,
+                                     &translation);
+    if (!state) return 0;
+    trainer->prev = get_node_from_database (trainer->markov_chain,
+                                            state)->data;
+  }
+  return 1;
+}
+
+/**
+ * Merge the trained shards into the trainer's chain, in corpus order. The
+ * words of each shard up to its first state are fed again through
+ * add_word, which adds the states and transitions that cross from the
+ * shard before it, so the result is the chain fill_database would build.
+ * @return 1 on success, 0 in case of allocation error.
+ */
+static int merge_shards(Trainer *trainer, Shard *shards, size_t shard_count)
+{
+  for (size_t i = 0; i < shard_count; ++i)
+  {
+    Shard *shard = shards + i;
+    MarkovChain *local = shard->trainer.markov_chain;
+    if (shard->status == TRAIN_ERROR) return 0;
+    size_t lead = shard->trainer.lead < shard->trainer.words_fed
+                  ? shard->trainer.lead : shard->trainer.words_fed;
+    if (lead > 0)
+    {
+      size_t consumed;
+      trainer->word_limit = trainer->words_fed + lead;
+      TrainStatus status = tokenize (trainer, shard->bytes, shard->length,
+                                     true, &consumed);
+      trainer->word_limit = SIZE_MAX;
+      if (status == TRAIN_ERROR) return 0;
+    }
+    if (local->database->size == 0) continue;
+
+    Translation translation = {&shard->vocabulary, trainer->vocabulary};
+    if (!merge_markov_chain (trainer->markov_chain, local,
+                             translate_context, &translation)
+        || !continue_from_shard (trainer, shard))
+    {
+      return 0;
     }
   }
   return 1;
 }
 
 /**
- * Write tweets function.
- * @param markov_chain the data struct we work on.
+ * Train the chain on the corpus on several threads. The mapped corpus is
+ * cut in byte ranges at whitespace, each range is trained into a chain of
+ * its own, and the shard chains are merged in order, so the result is the
+ * chain fill_database would build. Falls back to fill_database when the
+ * file cannot be mapped.
+ * @param fp the file to read.
+ * @param trainer the training state, reading the whole corpus.
+ * @param shard_count number of threads to train on.
+ * @return 1 on success, 0 in case of allocation or thread error.
+ */
+static int fill_database_sharded(FILE *fp, Trainer *trainer,
+                                 size_t shard_count)
+{
+  size_t size;
+  const char *bytes = map_corpus (fp, &size);
+  if (!bytes)
+  {
+    return fill_database (fp, trainer);
+  }
+
+  MarkovChain *chain = trainer->markov_chain;
+  Shard *shards = calloc (shard_count, sizeof (Shard));
+  pthread_t *threads = calloc (shard_count, sizeof (pthread_t));
+  bool success = shards && threads;
+  size_t started = 0, start = 0;
+  for (size_t i = 0; success && i < shard_count; ++i)
+  {
+    size_t end = size * (i + 1) / shard_count;
+    if (end < start) end = start;
+    while (end < size && !is_separator (bytes[end])) end++;
+    MarkovChain *local = initialize_markov_chain (
+        chain->print_func, chain->append_func, chain->comp_func,
+        chain->hash_func, chain->free_data, chain->copy_func,
+        chain->arena_copy, chain->serialize, chain->deserialize,
+        chain->is_last);
+    Shard *shard = shards + i;
+    shard->bytes = bytes + start;
+    shard->length = end - start;
+    shard->status = TRAIN_ERROR;
+    start = end;
+    success = local && create_vocabulary (&shard->vocabulary,
+                                          trainer->vocabulary->contexts
+                                              ->order);
+    start_training (&shard->trainer, local, &shard->vocabulary, -1);
+    success = success && !pthread_create (threads + i, NULL, train_shard,
+                                          shard);
+    if (success) started++;
+  }
+  for (size_t i = 0; i < started; ++i)
+  {
+    pthread_join (threads[i], NULL);
+  }
+
+  success = success && merge_shards (trainer, shards, shard_count);
+  for (size_t i = 0; shards && i < shard_count; ++i)
+  {
+    free_markov_chain (&shards[i].trainer.markov_chain);
+    free_vocabulary (&shards[i].vocabulary);
+  }
+  free (shards);
+  free (threads);
+  munmap ((void *) bytes, size);
+  return success;
+}
+
+/**
+ * Append one tweet line to the output buffer: all the words of the first
+ * state's context, then the last word of every following state.
+ * @param out the buffer to append to.
+ * @param frozen the frozen chain the tweet was generated on.
+ * @param vocabulary the vocabulary of the chain.
+ * @param number the number of the tweet.
+ * @param states ids of the tweet's states.
+ * @param length number of states, at least one.
+ * @return false in case of I/O or allocation error.
+ */
+static bool append_tweet(OutputBuffer *out, const FrozenChain *frozen,
+                         const Vocabulary *vocabulary, long number,
+                         const uint32_t *states, size_t length)
+{
+  bool success = output_buffer_append_string (out, "Tweet ")
+                 && output_buffer_append_number (out, number)
+                 && output_buffer_append (out, ": ", 2);
+  const Context *first = frozen->states[states[0]]->data;
+  for (size_t j = 0; success && j + 1 < vocabulary->contexts->order; ++j)
+  {
+    success = output_buffer_append_string
+                  (out, string_pool_string (vocabulary->words,
+                                            first->tokens[j]))
+              && output_buffer_append (out, " ", 1);
+  }
+  for (size_t j = 0; success && j < length; ++j)
+  {
+    const Context *state = frozen->states[states[j]]->data;
+    success = (j == 0 || output_buffer_append (out, " ", 1))
+              && output_buffer_append_string (out, state->last);
+  }
+  return success && output_buffer_append (out, "\n", 1);
+}
+
+/**
+ * Write tweets function. Tweets are generated on the frozen form of the
+ * chain in batches of independent walks, spread over the given number of
+ * threads, and written in order through an output buffer flushed in big
+ * blocks. The tweets depend on the seed only.
+ * @param markov_chain the data struct we work on, frozen.
+ * @param vocabulary the vocabulary of the chain.
  * @param num_of_tweets the number of tweets we want to write.
+ * @param seed the seed of the tweets.
+ * @param thread_count number of threads to generate with.
+ * @return 1 on success, 0 in case of allocation, thread or I/O error.
  */
-static void write_tweets(MarkovChain *markov_chain, long num_of_tweets)
+static int write_tweets(MarkovChain *markov_chain,
+                        const Vocabulary *vocabulary, long num_of_tweets,
+                        uint64_t seed, size_t thread_count)
 {
-  MarkovNode *word;
-  int num_of_words_in_tweet;
-  for (int i = 1; i <= num_of_tweets; ++i)
+  const FrozenChain *frozen = markov_chain->frozen;
+  // the first state holds order words
+  size_t max_length = MAX_WORDS_IN_TWEET + 1 - vocabulary->contexts->order;
+  OutputBuffer out;
+  fflush (stdout);
+  if (!output_buffer_init (&out, fileno (stdout), OUTPUT_BLOCK_SIZE))
+  {
+    return 0;
+  }
+  bool success = true;
+  Batch batch;
+  for (long first = 0; success && first < num_of_tweets;
+       first += TWEETS_PER_BATCH)
   {
-    do
+    size_t count = num_of_tweets - first < TWEETS_PER_BATCH
+                   ? (size_t) (num_of_tweets - first) : TWEETS_PER_BATCH;
+    uint64_t batch_seed = seed ^ (uint64_t) first * 0x9E3779B97F4A7C15ULL;
+    if (!generate_batch (frozen, count, max_length, -1, batch_seed,
+                         thread_count, &batch))
     {
-      word = get_first_random_node (markov_chain);
+      success = false;
+      break;
     }
-    while (markov_chain->is_last ((void *) (word->data)));
-    fprintf (stdout, "Tweet %d: %s", i, (char *) word->data);
-    num_of_words_in_tweet = 1;
-    while (!markov_chain->is_last ((void *) word->data) &&
-           num_of_words_in_tweet < MAX_WORDS_IN_TWEET)
+    for (size_t i = 0; success && i < count && frozen->start_count; ++i)
     {
-      word = get_next_random_node ((void *) word);
-      fprintf (stdout, " %s", (char *) word->data);
-      num_of_words_in_tweet++;
+      size_t length;
+      const uint32_t *states = batch_walk (&batch, i, &length);
+      success = append_tweet (&out, frozen, vocabulary, first + (long) i + 1,
+                              states, length);
     }
+    free_batch (&batch);
+  }
+  success = output_buffer_flush (&out) && success;
+  output_buffer_free (&out);
+  return success;
+}
+
+/**
+ * Write the trainer's publication of tweets, from a frozen copy of the
+ * chain trained so far. Training goes on on the chain afterwards.
+ * @return 1 on success, 0 in case of allocation, thread or I/O error.
+ */
+static int publish_tweets(Trainer *trainer)
+{
+  Publisher *publisher = trainer->publisher;
+  MarkovChain *markov_chain = trainer->markov_chain;
+  publisher->count++;
+  return freeze_sampling (markov_chain)
+         && freeze_markov_chain (markov_chain)
+         && write_tweets (markov_chain, trainer->vocabulary,
+                          publisher->num_of_tweets,
+                          publisher->seed + publisher->count,
+                          publisher->thread_count);
+}
 
-    fprintf (stdout, "\n");
+/**
+ * Command line flags, which may be given anywhere among the parameters.
+ */
+typedef struct Options {
+    bool use_mmap; // --mmap: read the corpus through a memory mapping
+    const char *load_path; // --load=PATH: start from a saved snapshot
+    const char *save_path; // --save=PATH: save the trained chain
+    size_t thread_count; // --threads=N: train and generate on N threads
+    size_t order; // --order=K: states are the last K words, up to MAX_ORDER
+    bool print_stats; // --stats: print the chain statistics to stderr
+    size_t max_states; // --max-states=N: decay the chain past N states
+    uint32_t min_count; // --min-count=N: prune transitions seen less often
+    size_t top_k; // --top-k=K: prune all but the K likeliest transitions
+    size_t publish_every; // --every=N: also write tweets every N blocks
+} Options;
+
+/**
+ * Move the "--" flags out of argv into options, leaving the positional
+ * parameters in order.
+ * @param argc pointer to the number of arguments, updated.
+ * @param argv the arguments, compacted in place.
+ * @param options the options to fill.
+ * @return false if an unknown flag was given.
+ */
+static bool parse_options(int *argc, char *argv[], Options *options)
+{
+  int kept = 1;
+  *options = (Options) {false, NULL, NULL, 1, 1, false, 0, 0, 0, 0};
+  for (int i = 1; i < *argc; ++i)
+  {
+    if (strncmp (argv[i], "--", 2) != 0)
+    {
+      argv[kept++] = argv[i];
+    }
+    else if (!strcmp (argv[i], "--mmap"))
+    {
+      options->use_mmap = true;
+    }
+    else if (!strncmp (argv[i], "--load=", 7))
+    {
+      options->load_path = argv[i] + 7;
+    }
+    else if (!strncmp (argv[i], "--save=", 7))
+    {
+      options->save_path = argv[i] + 7;
+    }
+    else if (!strncmp (argv[i], "--threads=", 10)
+             && strtol (argv[i] + 10, NULL, 10) > 0)
+    {
+      options->thread_count = (size_t) strtol (argv[i] + 10, NULL, 10);
+    }
+    else if (!strncmp (argv[i], "--order=", 8)
+             && strtol (argv[i] + 8, NULL, 10) > 0
+             && strtol (argv[i] + 8, NULL, 10) <= MAX_ORDER)
+    {
+      options->order = (size_t) strtol (argv[i] + 8, NULL, 10);
+    }
+    else if (!strcmp (argv[i], "--stats"))
+    {
+      options->print_stats = true;
+    }
+    else if (!strncmp (argv[i], "--max-states=", 13)
+             && strtol (argv[i] + 13, NULL, 10) > 0)
+    {
+      options->max_states = (size_t) strtol (argv[i] + 13, NULL, 10);
+    }
+    else if (!strncmp (argv[i], "--min-count=", 12)
+             && strtol (argv[i] + 12, NULL, 10) > 0
+             && strtol (argv[i] + 12, NULL, 10) <= UINT32_MAX)
+    {
+      options->min_count = (uint32_t) strtol (argv[i] + 12, NULL, 10);
+    }
+    else if (!strncmp (argv[i], "--top-k=", 8)
+             && strtol (argv[i] + 8, NULL, 10) > 0)
+    {
+      options->top_k = (size_t) strtol (argv[i] + 8, NULL, 10);
+    }
+    else if (!strncmp (argv[i], "--every=", 8)
+             && strtol (argv[i] + 8, NULL, 10) > 0)
+    {
+      options->publish_every = (size_t) strtol (argv[i] + 8, NULL, 10);
+    }
+    else
+    {
+      return false;
+    }
   }
+  argv[kept] = NULL;
+  *argc = kept;
+  return true;
+}
+
+/**
+ * Build the chain as the options ask: load a snapshot, train on the corpus
+ * if one was given, writing tweets as it goes if the trainer has a
+ * publisher, prune it, then save a snapshot.
+ * @param trainer the training state, holding the chain and its vocabulary.
+ * @param options the command line flags.
+ * @param fp the corpus, NULL if none was given.
+ * @return EXIT_SUCCESS or EXIT_FAILURE
+ */
+static int build_chain(Trainer *trainer, const Options *options, FILE *fp)
+{
+  snapshot_vocabulary = trainer->vocabulary;
+  if (options->load_path)
+  {
+    if (!load_markov_chain (trainer->markov_chain, options->load_path))
+    {
+      fprintf (stdout, "Error:Failed to load the snapshot.");
+      return EXIT_FAILURE;
+    }
+  }
+  int filled = 1;
+  markov_chain_timer_start (trainer->markov_chain, MARKOV_TIMER_TRAINING);
+  trainer->max_states = options->max_states;
+  if (fp && (options->max_states || trainer->publisher))
+  {
+    // only the block reader decays the chain and publishes as it goes
+    filled = fill_database (fp, trainer);
+  }
+  else if (fp && options->thread_count > 1 && trainer->words_to_read < 0)
+  {
+    filled = fill_database_sharded (fp, trainer, options->thread_count);
+  }
+  else if (fp)
+  {
+    filled = options->use_mmap ? fill_database_mmap (fp, trainer)
+                               : fill_database (fp, trainer);
+  }
+  markov_chain_timer_stop (trainer->markov_chain, MARKOV_TIMER_TRAINING);
+  if (!filled)
+  {
+    fprintf (stdout, ALLOCATION_ERROR_MASSAGE);
+    return EXIT_FAILURE;
+  }
+  if (options->min_count || options->top_k)
+  {
+    size_t reclaimed;
+    if (!prune_markov_chain (trainer->markov_chain, options->min_count,
+                             options->top_k, &reclaimed))
+    {
+      fprintf (stdout, ALLOCATION_ERROR_MASSAGE);
+      return EXIT_FAILURE;
+    }
+    fprintf (stderr, "Pruned the chain to %d states, reclaiming %zu "
+                     "bytes.\n", trainer->markov_chain->database->size,
+             reclaimed);
+  }
+  if (options->save_path
+      && !save_markov_chain (trainer->markov_chain, options->save_path))
+  {
+    fprintf (stdout, "Error:Failed to save the snapshot.");
+    return EXIT_FAILURE;
+  }
+  // the tweets draw from the alias tables of the frozen rows
+  if (!freeze_sampling (trainer->markov_chain)
+      || !freeze_markov_chain (trainer->markov_chain))
+  {
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
 }
 
 int main(int argc, char *argv[]){
-  if ((argc != INPUT_1) && (argc != INPUT_2))
+  Options options;
+  if (!parse_options (&argc, argv, &options)
+      || ((argc != INPUT_1) && (argc != INPUT_2)
+          && (argc != INPUT_3 || !options.load_path)))
   {
     fprintf (stdout, "Usage:Something went wrong.\n"
                      "The parameters that needed:\n"
                      "1)Seed value.\n"
                      "2)Num of tweets.\n"
-                     "3)Path file.\n"
-                     "4)Number of words to read from the path file.");
+                     "3)Path file, - for stdin, optional with --load.\n"
+                     "4)Number of words to read from the path file.\n"
+                     "Flags:\n"
+                     "--mmap Read the file through a memory mapping.\n"
+                     "--load=PATH Start from a saved chain snapshot.\n"
+                     "--save=PATH Save the chain snapshot after training.\n"
+                     "--threads=N Train and generate the tweets on N threads.\n"
+                     "--order=K Use the last K words as the state, K<=8.\n"
+                     "--stats Print the chain statistics to stderr, when "
+                     "built with STATS=1.\n"
+                     "--max-states=N Halve the counts and drop the rare "
+                     "states when there are more than N, to train on an "
+                     "endless stream in bounded memory.\n"
+                     "--min-count=N Prune the transitions seen less than N "
+                     "times.\n"
+                     "--top-k=K Prune all but the K likeliest transitions of "
+                     "each state.\n"
+                     "--every=N Also write the tweets every N blocks of 64KB "
+                     "read, from the chain trained so far, to follow a "
+                     "stream.");
     return EXIT_FAILURE;
   }
 
-  FILE *fp = fopen (argv[3], "r");
-  if (!fp)
+  FILE *fp = NULL;
+  if (argc > INPUT_3)
   {
-    fprintf (stdout, "Error:The path is not working.");
-    return EXIT_FAILURE;
+    fp = strcmp (argv[3], "-") ? fopen (argv[3], "r") : stdin;
+    if (!fp)
+    {
+      fprintf (stdout, "Error:The path is not working.");
+      return EXIT_FAILURE;
+    }
   }
 
-  srand ((unsigned int)strtol(argv[1], NULL, 10));
   MarkovChain *markov_chain = initialize_markov_chain (
       print_func_char,
+      append_func_char,
       comp_func_char,
+      hash_func_char,
       free_data_char,
       copy_func_char,
+      NULL,
+      serialize_char,
+      deserialize_char,
       is_last_char);
-  if (!markov_chain)
+  Vocabulary vocabulary;
+  int status = EXIT_FAILURE;
+  if (!create_vocabulary (&vocabulary, options.order) || !markov_chain)
   {
     fprintf (stdout, ALLOCATION_ERROR_MASSAGE);
-    return EXIT_FAILURE;
   }
-  int words_to_read = - 1;
-  if (argv[4]) words_to_read = strtol (argv[4], NULL, 10);
-  if (!fill_database (fp, words_to_read, markov_chain))
+  else
   {
-    fprintf (stdout, ALLOCATION_ERROR_MASSAGE);
-    free_markov_chain (&markov_chain);
-    return EXIT_FAILURE;
+    int words_to_read = - 1;
+    if (argc == INPUT_1) words_to_read = strtol (argv[4], NULL, 10);
+    Trainer trainer;
+    start_training (&trainer, markov_chain, &vocabulary, words_to_read);
+    Publisher publisher = {options.publish_every, strtol (argv[2], NULL, 10),
+                           (uint64_t) strtol (argv[1], NULL, 10),
+                           options.thread_count, 0};
+    if (options.publish_every) trainer.publisher = &publisher;
+    status = build_chain (&trainer, &options, fp);
+  }
+  if (status == EXIT_SUCCESS)
+  {
+    markov_chain_timer_start (markov_chain, MARKOV_TIMER_GENERATION);
+    if (!write_tweets (markov_chain, &vocabulary, strtol(argv[2], NULL, 10),
+                       (uint64_t) strtol(argv[1], NULL, 10),
+                       options.thread_count))
+    {
+      status = EXIT_FAILURE;
+    }
+    markov_chain_timer_stop (markov_chain, MARKOV_TIMER_GENERATION);
+  }
+  if (markov_chain && options.print_stats)
+  {
+    print_markov_chain_stats (markov_chain, stderr);
   }
 
-  write_tweets (markov_chain, strtol(argv[2], NULL, 10));
-
-  fclose (fp);
+  if (fp && fp != stdin) fclose (fp);
   free_markov_chain (&markov_chain);
-  return EXIT_SUCCESS;
+  free_vocabulary (&vocabulary);
+  return status;
 }
\ No newline at end of file